@@ -7,13 +7,32 @@ See the file COPYING.
 */
 
 #define	FUSE_USE_VERSION 26
+#define _GNU_SOURCE	//fopencookie
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/xattr.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#ifdef CS1550_WITH_LZ4
+#include <lz4.h>
+#endif
 
 //size of a disk block
 #define	BLOCK_SIZE 512
@@ -27,9 +46,292 @@ See the file COPYING.
 
 #define DISKSIZE_IN_BYTES 5242880
 
-#define MAX_NUM_OF_BLOCKS DISKSIZE_IN_BYTES / BLOCK_SIZE
+#define MAX_NUM_OF_BLOCKS (DISKSIZE_IN_BYTES / BLOCK_SIZE)
+
+//The free space tracker keeps one byte per block and occupies the last
+//blocks of the disk. The superblock sits right in front of it.
+#define TRACKER_BLOCKS ((MAX_NUM_OF_BLOCKS + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define TRACKER_START_BLOCK (MAX_NUM_OF_BLOCKS - TRACKER_BLOCKS)
+#define SUPERBLOCK_BLOCK (TRACKER_START_BLOCK - 1)
+
+//Marks the superblock of a disk formatted by this version
+#define CS1550_MAGIC 0x31353530
+
+//Format features, chosen when the disk is initialized
+#define FEATURE_INLINE_SMALL_FILES 0x1
+#define FEATURE_CHECKSUMS 0x2
+#define FEATURE_COMPRESSION 0x4
+#define FEATURE_DEDUP 0x8
+#define FEATURE_LONG_NAMES 0x10
+#define FEATURE_LOG 0x20
+
+//With FEATURE_CHECKSUMS a table of one CRC32C per block sits in front of the
+//superblock. An entry of 0 means the block has not been written since the
+//disk was initialized and is not checked.
+#define CSUM_BLOCKS ((MAX_NUM_OF_BLOCKS * sizeof(uint32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define CSUM_START_BLOCK (SUPERBLOCK_BLOCK - CSUM_BLOCKS)
+
+//With FEATURE_LOG, blocks below the log and the free space tracker are not
+//written in place. They are gathered in a segment in memory that goes to
+//the log in front of the checksum table in one write when it fills, on
+//fsync, and every LOG_SEAL_INTERVAL seconds. A map in memory says where the
+//newest copy of each logged block is. The cleaner copies those copies home
+//in block order and empties the log, in the background once half of it is
+//used, and in the writer when it is full. Logging the tracker too means a
+//crash never leaves it out of step with the directories.
+#define LOG_SEGMENT_BLOCKS 32	//header block and the blocks it describes
+#define LOG_SEGMENTS 8
+#define LOG_BLOCKS (LOG_SEGMENT_BLOCKS * LOG_SEGMENTS)
+#define LOG_START_BLOCK (CSUM_START_BLOCK - LOG_BLOCKS)
+#define LOG_MAGIC 0x4c4f4753
+#define LOG_SEAL_INTERVAL 1		//seconds a written block may wait in memory
+#define LOG_HOLDS(b) ((b) < LOG_START_BLOCK || (b) >= TRACKER_START_BLOCK)
+
+//What read_block does when a block does not match its checksum
+#define CSUM_POLICY_FAIL 0		//return -EIO
+#define CSUM_POLICY_WARN 1		//log it and return the data anyway
+
+#define DEFAULT_SCRUB_RATE 1024		//blocks per second
+#define DEFAULT_SCRUB_INTERVAL 3600	//seconds between scrubber passes
+#define SCRUB_BATCH 64
+
+#define DEFAULT_DEFRAG_RATE 256		//blocks per second the defragmenter may move
+#define DEFAULT_DEFRAG_INTERVAL 600	//seconds between defragmenter passes
+
+//Free blocks that only directories and other metadata may take, so a full
+//disk can still have entries added and removed
+#define DEFAULT_RESERVED_BLOCKS 16
+
+//Read-only file with filesystem statistics, one "name: value" per line
+#define STATS_PATH "/.stats"
+#define STATS_MAX 4096
+
+//Read-only file with one "path blocks runs" line per file with a block chain
+#define FRAG_PATH "/.fragmentation"
+#define FRAG_MAX 32768
+
+//Snapshots are listed under SNAP_DIR and each one is a read-only view of the
+//tree as it was when it was taken. A snapshot is only a copy of the root
+//block; the blocks below it are shared with the live tree through their
+//reference counts and copied the first time the live tree changes them.
+#define SNAP_DIR "/.snap"
+#define MAX_SNAPSHOT_NAME 15
+#define MAX_SNAPSHOTS 16
+
+//FUSE 2 has no copy_file_range, so copies that stay inside the image are
+//asked for with this ioctl on the destination file. The result is the
+//number of bytes copied, written back to length.
+#define COPY_PATH_MAX 1024
+#define COPY_CHUNK (64 * 1024)	//bytes moved per write when blocks are not shared
+
+struct cs1550_copy_range
+{
+	char src[COPY_PATH_MAX];	//source file, as a path inside the mount
+	uint64_t src_offset;
+	uint64_t dst_offset;
+	uint64_t length;
+};
+
+#define CS1550_IOC_COPY_RANGE _IOWR('c', 1, struct cs1550_copy_range)
+
+//Mount options. The format features only take effect when the disk is
+//initialized; after that the superblock is authoritative.
+struct cs1550_options
+{
+	int inline_small_files;
+	int attr_timeout;	//seconds getattr results are cached, here and in the kernel
+	int checksums;
+	int compression;
+	int dedup;
+	int long_names;
+	char *csum_policy_name;
+	int csum_policy;
+	int scrub_rate;		//blocks per second the scrubber verifies, 0 to disable it
+	int scrub_interval;
+	int defrag_rate;	//blocks per second the defragmenter moves, 0 to disable it
+	int defrag_interval;
+	int ramdisk;			//keep the image in memory instead of ./.disk
+	char *ramdisk_image;	//file the in-memory image is loaded from and saved to
+	char *stripe_files;		//colon separated backing files to stripe the image over
+	int stripe_width;		//blocks per stripe
+	int quota_blocks;		//blocks each top-level directory may use, 0 for no limit
+	int quota_entries;		//files and directories each may hold, 0 for no limit
+	char *quota_table;		//file of "name blocks entries" lines overriding those
+	int max_file_blocks;	//blocks one file may use, 0 for no limit
+	int reserved_blocks;		//free blocks file data may not take
+	int log;
+};
+
+static struct cs1550_options options;
+
+//FEATURE_* flags of the mounted disk, -1 until the superblock has been read
+static int disk_features = -1;
+
+//The free space tracker, read from disk once. Changes are written to both
+//this and the disk, so the disk copy is never read again.
+static struct cs1550_free_space_tracker *tracker_map = NULL;
+
+//The checksum table, kept the same way: read at mount, written through.
+static uint32_t *csum_map = NULL;
+
+//One bit per block, set for pack blocks with a free slot. Found by walking
+//every tree the first time a small file is stored, then kept up as slots
+//are taken and given back.
+static unsigned char *pack_room = NULL;
+
+//Number of unallocated blocks, -1 until the tracker has been counted once.
+//Kept up to date by everything that moves a block to or from refcount 0.
+static long free_blocks = -1;
+
+//Number of blocks with more than one owner, -1 until the tracker has been
+//counted. Writes only look for shared blocks to copy while it is not 0.
+static long shared_blocks = -1;
+
+//Operations that change the disk hold this for writing, the others for
+//reading, so the scrubber never sees a half-written block.
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_t scrub_thread;
+static volatile int scrub_running = 0;
+static pthread_mutex_t scrub_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scrub_wakeup = PTHREAD_COND_INITIALIZER;
+
+//What fsync needs to make one file durable without syncing the whole disk.
+//While an operation changes a file, every block it writes is noted in that
+//file's entry; fsync rewrites just those blocks with RWF_DSYNC, together with
+//the file's directory block and the tracker and checksum blocks covering
+//them. Direct mapped by path: a file that loses its slot to another is made
+//durable first so nothing it noted is lost.
+#define SYNC_FILES 64
+
+struct cs1550_sync_file
+{
+	char *path;		//NULL when the slot is unused
+	int nOpen;		//opens not yet released
+	long nDirty;
+	unsigned char dirty[(MAX_NUM_OF_BLOCKS + 7) / 8];
+};
+
+static struct cs1550_sync_file sync_files[SYNC_FILES];
+static struct cs1550_sync_file *sync_target = NULL;	//file whose blocks write_block notes
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sync_fd = -1;	//./.disk, opened on first fsync
+
+static unsigned long checksum_errors = 0;
+static unsigned long blocks_scrubbed = 0;
+
+//The defragmenter moves fragmented file chains into runs of consecutive
+//blocks in the background, a file at a time under the write lock.
+static pthread_t defrag_thread;
+static volatile int defrag_running = 0;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_wakeup = PTHREAD_COND_INITIALIZER;
+
+static unsigned long defrag_moved_files = 0;
+static unsigned long defrag_moved_blocks = 0;
+
+//Segment header, the first block of each log segment. Segments are filled
+//from the first one on and the log is emptied all at once, so after a crash
+//the segments to copy home are the ones up to the first that does not
+//check out.
+struct cs1550_log_header
+{
+	uint32_t nMagic;	//LOG_MAGIC until the segment has been copied home
+	uint32_t nCount;	//blocks that follow the header
+	uint64_t nSeq;		//increases by one per segment
+	uint32_t nHome[LOG_SEGMENT_BLOCKS - 1];	//where each block belongs
+	uint32_t nCrc[LOG_SEGMENT_BLOCKS - 1];	//CRC32C of each block
+
+	char padding[BLOCK_SIZE - 2 * sizeof(uint32_t) - sizeof(uint64_t) - 2 * (LOG_SEGMENT_BLOCKS - 1) * sizeof(uint32_t)];
+} ;
+
+//Only changed under the write lock, so readers need no lock of their own
+static int32_t *log_map = NULL;		//block -> log block with its newest copy, or -1
+static char *log_open = NULL;		//segment being filled, header first
+static int log_segment = 0;			//index of that segment; the ones before it are sealed
+static int log_synced = 0;			//sealed segments fsync has made durable
+static uint64_t log_seq = 1;
+
+static pthread_t log_thread;
+static volatile int log_running = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wakeup = PTHREAD_COND_INITIALIZER;
+
+static unsigned long log_segments_written = 0;
+static unsigned long log_blocks_absorbed = 0;
+static unsigned long log_blocks_cleaned = 0;
+
+//With the ramdisk option the image is kept in anonymous memory, in the same
+//layout as ./.disk, and open_disk returns streams over it. With
+//ramdisk_image it is loaded from that file when mounting and saved back on
+//unmount and whenever the filesystem gets SIGUSR1.
+static char *ram_disk = NULL;
+static pthread_t ram_save_thread;
+static volatile int ram_save_running = 0;
+
+//With the stripe option the image is split into stripes of stripe_width
+//blocks that go round robin over the backing files, so stripe s is stripe
+//s / stripe_count of file s % stripe_count. open_disk returns streams that
+//route each transfer to the files, one preadv/pwritev per file. Each file
+//has a worker thread, started at mount, so the files' parts of a transfer
+//run in parallel: the caller runs the first part itself and hands the rest
+//to their workers. Waking a worker costs more than moving a few blocks, so
+//smaller transfers stay on the calling thread.
+#define MAX_STRIPE_FILES 16
+#define DEFAULT_STRIPE_WIDTH 8
+#define STRIPE_PARALLEL_MIN (64 * 1024)	//bytes
+static int stripe_fds[MAX_STRIPE_FILES];
+static int stripe_count = 0;
+
+struct cs1550_stripe_job
+{
+	int file;			//index into stripe_fds
+	int write;
+	off64_t off;		//where the first piece goes in the file
+	struct iovec *iov;	//the pieces, consecutive in the file
+	int iovcnt;
+	int error;
+	int done;			//set by the worker once it has run the job
+};
+
+struct cs1550_stripe_worker
+{
+	pthread_t thread;
+	struct cs1550_stripe_job *job;	//handed over and not done yet, or NULL
+};
+
+static struct cs1550_stripe_worker stripe_workers[MAX_STRIPE_FILES];
+static int stripe_threads = 0;
+static volatile int stripe_running = 0;
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stripe_wakeup = PTHREAD_COND_INITIALIZER;	//a job was handed over or done
+
+//With FEATURE_DEDUP, identical blocks of file chains are shared. Because a
+//block holds its own nNextBlock, two chains can only share a common tail;
+//files are deduplicated from their last block backwards when they are
+//closed, so identical files end up sharing their whole chain.
+//
+//The index maps a hash of a block's full contents to the block. It is open
+//addressed, kept in memory only, and rebuilt from the file chains on first
+//use after mounting. Hits are always confirmed by comparing the blocks.
+#define DEDUP_INDEX_SLOTS 32768		//power of two, at least twice the blocks
+#define DEDUP_EMPTY -1
+#define DEDUP_DELETED -2
+
+struct cs1550_dedup_slot
+{
+	uint32_t fingerprint;	//high half of the block hash
+	int32_t block;			//block number, DEDUP_EMPTY or DEDUP_DELETED
+};
 
-int filesystem_initialized = 0;
+static struct cs1550_dedup_slot *dedup_index = NULL;
+static int32_t *dedup_slot_of = NULL;	//block -> its index slot, or -1
+static int dedup_used = 0;				//slots that are not DEDUP_EMPTY
+
+//Files written since they were last deduplicated, by path hash
+#define DEDUP_DIRTY_SLOTS 256
+#define DEDUP_DIRTY_PATH_MAX 128
+static char dedup_dirty[DEDUP_DIRTY_SLOTS][DEDUP_DIRTY_PATH_MAX];
 
 //The attribute packed means to not align these things
 struct cs1550_directory_entry
@@ -47,7 +349,9 @@ struct cs1550_directory_entry
 
 	//This is some space to get this to be exactly the size of the disk block.
 	//Don't use it for anything.
-	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int)];
+	char padding[BLOCK_SIZE - MAX_FILES_IN_DIR * sizeof(struct cs1550_file_directory) - sizeof(int) - sizeof(uint32_t)];
+
+	uint32_t nXattrBlock;	//attribute table of the files, 0 for none
 } ;
 
 typedef struct cs1550_root_directory cs1550_root_directory;
@@ -66,7 +370,9 @@ struct cs1550_root_directory
 
 	//This is some space to get this to be exactly the size of the disk block.
 	//Don't use it for anything.
-	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int)];
+	char padding[BLOCK_SIZE - MAX_DIRS_IN_ROOT * sizeof(struct cs1550_directory) - sizeof(int) - sizeof(uint32_t)];
+
+	uint32_t nXattrBlock;	//attribute table of the directories, 0 for none
 } ;
 
 
@@ -88,16 +394,445 @@ struct cs1550_disk_block
 
 typedef struct cs1550_disk_block cs1550_disk_block;
 
+//One byte per block: 0 when free, otherwise how many pointers lead to it.
+//That is always 1 unless FEATURE_DEDUP or a snapshot shares the block.
+#define MAX_BLOCK_REFS 255
+
 struct cs1550_free_space_tracker {
-	char data[MAX_FILES_IN_DIR+1];
+	unsigned char data[MAX_NUM_OF_BLOCKS];
 };
 
 typedef struct cs1550_free_space_tracker cs1550_free_space_tracker;
 
-static int check_fs_initialization();
+struct cs1550_superblock
+{
+	int nMagic;		//CS1550_MAGIC once the disk has been initialized
+	int nFeatures;	//FEATURE_* flags chosen at initialization
+
+	//Pack block that new small files are placed in, or -1 if none
+	long nPackBlock;
+
+	//Block holding the snapshot table, or 0 until the first snapshot
+	long nSnapTable;
+
+	//1 once the disk has been unmounted cleanly, 0 while it is mounted. A
+	//disk found mounted at startup was not, and is checked.
+	int nClean;
+
+	//No longer used: shared blocks are counted from the free space tracker
+	int nShared;
+
+	//Free blocks at the last clean unmount, so mounting need not count them
+	long nFreeBlocks;
+
+	char padding[BLOCK_SIZE - 4 * sizeof(int) - 3 * sizeof(long)];
+};
+
+typedef struct cs1550_superblock cs1550_superblock;
+
+struct cs1550_snapshot_table
+{
+	struct cs1550_snapshot
+	{
+		char name[MAX_SNAPSHOT_NAME + 1];	//empty when the entry is unused
+		long nRootBlock;					//copy of the root directory
+		long nCreated;						//time the snapshot was taken
+	} snapshots[MAX_SNAPSHOTS];
+};
+
+typedef struct cs1550_snapshot_table cs1550_snapshot_table;
+
+//With FEATURE_INLINE_SMALL_FILES, files no bigger than a slot share a pack
+//block with other small files instead of owning a whole disk block.
+#define SMALL_FILE_SLOT_SIZE 63
+#define SLOTS_PER_PACK_BLOCK 8
+
+struct cs1550_pack_block
+{
+	long nSlotMap;	//bit i is set when slot i holds a file
+	char slots[SLOTS_PER_PACK_BLOCK][SMALL_FILE_SLOT_SIZE];
+};
+
+typedef struct cs1550_pack_block cs1550_pack_block;
+
+#define PACK_BLOCK_FULL ((1L << SLOTS_PER_PACK_BLOCK) - 1)
+
+//An empty inline file has no block at all, and a packed file's nStartBlock
+//encodes its pack block and slot as a value below -1.
+#define NO_BLOCK -1L
+#define PACKED_REF(block, slot) (-2L - ((long)(block) * SLOTS_PER_PACK_BLOCK + (slot)))
+#define IS_PACKED_REF(n) ((n) <= -2L)
+#define PACKED_REF_BLOCK(n) ((-2L - (n)) / SLOTS_PER_PACK_BLOCK)
+#define PACKED_REF_SLOT(n) ((int)((-2L - (n)) % SLOTS_PER_PACK_BLOCK))
+
+//Below the top level a directory entry can also be a subdirectory. Its
+//fsize is SUBDIR_SIZE and its nStartBlock the subdirectory's own directory
+//block. On an 8.3 disk the name is split at its first '.' like a file's.
+#define SUBDIR_SIZE ((size_t)-1)
+#define IS_SUBDIR(entry) ((entry).fsize == SUBDIR_SIZE)
+
+//With FEATURE_LONG_NAMES every directory block, the root included, is a
+//cs1550_name_directory instead: a header and then one packed record per
+//entry, each a cs1550_name_record followed by the name. Names can be up to
+//MAX_NAME_LEN bytes, and short ones take less room than an 8.3 slot. nBloom
+//has bit (hash % 64) set for each name in the block, so most lookups of a
+//name that is not there never look at the records, and each record keeps
+//the top byte of its name's hash so the others are mostly skipped without
+//comparing names.
+#define MAX_NAME_LEN 255
+
+struct cs1550_name_directory
+{
+	uint16_t nRecords;
+	uint16_t nBytes;	//bytes of records[] in use
+	uint32_t nXattrBlock;	//attribute table of the entries, 0 for none
+	uint64_t nBloom;
+	char records[BLOCK_SIZE - 2 * sizeof(uint16_t) - sizeof(uint32_t) - sizeof(uint64_t)];
+};
+
+struct cs1550_name_record
+{
+	uint8_t nNameLen;	//1 to MAX_NAME_LEN, the name follows without a nul
+	uint8_t nHash;		//top byte of name_hash of the name
+	size_t fsize;		//SUBDIR_SIZE for a directory
+	long nStartBlock;
+} __attribute__((packed));
+
+#define NAME_RECORD_SIZE(len) (sizeof(struct cs1550_name_record) + (len))
+#define MAX_NAME_RECORDS (sizeof(((struct cs1550_name_directory *)0)->records) / NAME_RECORD_SIZE(1))
+
+//A directory block of either format as the code works with it, decoded by
+//load_dir and written back by store_dir. Entries keep their slot while
+//loaded, and their names sit one after another in names[].
+#define MAX_DIR_SLOTS 32
+
+struct cs1550_dir
+{
+	int nFiles;
+	uint64_t nBloom;
+	int nNamesUsed;
+	long nXattrBlock;
+	struct cs1550_dir_slot
+	{
+		size_t fsize;		//SUBDIR_SIZE for a directory
+		long nStartBlock;
+		uint16_t nNameOff;	//where the name starts in names[]
+		uint8_t nNameLen;	//0 when the slot is unused
+		uint8_t nHash;
+	} files[MAX_DIR_SLOTS];
+	char names[BLOCK_SIZE];
+};
+
+typedef struct cs1550_dir cs1550_dir;
+
+//Directories decoded from disk, loaded the first time they are used. The
+//live root is loaded at mount and keeps slot 0; other directories share
+//the remaining slots by block number.
+#define DIR_CACHE_SLOTS 256
+
+struct cs1550_dir_cache_entry
+{
+	long block;		//-1 when the slot is unused
+	int is_root;
+	cs1550_dir dir;
+};
+
+static struct cs1550_dir_cache_entry *dir_cache = NULL;	//allocated at mount
+static pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Extended attributes of the entries of a directory are kept together in one
+//attribute table that the directory block points to, so a directory of
+//tagged files costs one short chain rather than a block per file. The
+//table is a chain of cs1550_disk_blocks holding a cs1550_xattr_table: one
+//record per attribute, a cs1550_xattr_record followed by the entry's name,
+//the attribute's name and the value. A table is never changed in place; a
+//change writes a new one and drops the old, so snapshots share tables by
+//reference count like file chains.
+#define XATTR_NAME_MAX_LEN 255
+#define XATTR_VALUE_MAX 2048
+#define XATTR_TABLE_MAX 16384
+
+struct cs1550_xattr_record
+{
+	uint8_t nEntryLen;
+	uint8_t nNameLen;
+	uint16_t nValueLen;
+} __attribute__((packed));
+
+#define XATTR_RECORD_SIZE(rec) (sizeof(struct cs1550_xattr_record) + (rec).nEntryLen + (rec).nNameLen + (rec).nValueLen)
+
+struct cs1550_xattr_table
+{
+	uint32_t nLen;	//bytes of records[] in use
+	char records[XATTR_TABLE_MAX];
+};
+
+//Attribute tables read from disk, direct mapped on their first block
+#define XATTR_CACHE_SLOTS 64
+
+struct cs1550_xattr_cache_entry
+{
+	long block;		//0 when the slot is unused
+	struct cs1550_xattr_table *table;
+};
+
+static struct cs1550_xattr_cache_entry xattr_cache[XATTR_CACHE_SLOTS];
+static pthread_mutex_t xattr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Deepest directory nesting the tree walkers follow
+#define MAX_DIR_DEPTH 64
+
+//With FEATURE_COMPRESSION a file's nStartBlock points to a chain of group
+//index blocks. Every COMPRESS_GROUP_SIZE bytes of the file form a group that
+//is compressed on its own into a chain of cs1550_disk_blocks, so a read only
+//decompresses the groups it overlaps.
+#define COMPRESS_GROUP_SIZE 4096
+#define GROUPS_PER_INDEX 31
+
+//Group stored as is because it did not compress
+#define GROUP_RAW 0x1
+
+struct cs1550_group_index
+{
+	long nNextBlock;	//next index block, for groups past GROUPS_PER_INDEX
+	struct cs1550_group
+	{
+		long nStartBlock;	//chain holding the stored bytes, -1 if all zeros
+		int nStoredSize;	//bytes in that chain
+		int nFlags;			//GROUP_* flags
+	} groups[GROUPS_PER_INDEX];
+
+	char padding[BLOCK_SIZE - sizeof(long) - GROUPS_PER_INDEX * sizeof(struct cs1550_group)];
+};
+
+typedef struct cs1550_group_index cs1550_group_index;
+
+_Static_assert(sizeof(cs1550_superblock) == BLOCK_SIZE, "superblock must fill one block");
+_Static_assert(sizeof(cs1550_group_index) == BLOCK_SIZE, "group index must fill one block");
+_Static_assert(sizeof(cs1550_pack_block) == BLOCK_SIZE, "pack block must fill one block");
+_Static_assert(sizeof(cs1550_snapshot_table) == BLOCK_SIZE, "snapshot table must fill one block");
+_Static_assert(sizeof(struct cs1550_name_directory) == BLOCK_SIZE, "name directory must fill one block");
+_Static_assert(MAX_NAME_RECORDS <= MAX_DIR_SLOTS && MAX_DIRS_IN_ROOT <= MAX_DIR_SLOTS && MAX_FILES_IN_DIR <= MAX_DIR_SLOTS, "a loaded directory must have a slot for every entry");
+
+//getattr results, filled in by getattr itself and by readdir for every entry
+//it lists, so that `ls -l` is served from the directory block readdir loaded.
+//Direct mapped on a hash of the path; a colliding path just evicts the old one.
+#define ATTR_CACHE_SLOTS 512
+#define ATTR_CACHE_PATH_MAX 128
+#define DEFAULT_ATTR_TIMEOUT 1
+
+struct cs1550_attr_cache_entry
+{
+	char path[ATTR_CACHE_PATH_MAX];	//empty when the slot is unused
+	struct stat st;
+	time_t expires;
+};
+
+static struct cs1550_attr_cache_entry attr_cache[ATTR_CACHE_SLOTS];
+static pthread_mutex_t attr_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Path components already looked up, keyed by the directory block they were
+//looked up in and the name, so a path is resolved without reading the
+//directory blocks along it. Names that were not found are cached too.
+//Direct mapped like the attribute cache. Entries are only valid for the
+//generation they were stored in; anything that moves a directory block
+//starts a new generation instead of hunting down the affected entries.
+#define DENTRY_CACHE_SLOTS 1024
+#define DENTRY_NEGATIVE 0	//no such name in the directory
+#define DENTRY_DIR 1		//a directory, block is where it is
+#define DENTRY_FILE 2		//a file, index is its slot in the directory
+
+struct cs1550_dentry_cache_entry
+{
+	unsigned long generation;	//0 when the slot is unused
+	long parent;
+	char name[MAX_NAME_LEN + 1];
+	int kind;
+	int index;
+	long block;
+};
+
+static struct cs1550_dentry_cache_entry dentry_cache[DENTRY_CACHE_SLOTS];
+static unsigned long dentry_generation = 1;
+static pthread_mutex_t dentry_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Open files. open looks the path up once and keeps where the file's entry
+//is in a handle, whose number plus one goes in fi->fh, so reads and writes
+//through it go straight to the entry. A handle is only trusted while the
+//dentry generation is the one it was made in and its slot still holds the
+//file's name; otherwise the path is looked up again and the handle updated.
+//While blocks are shared, a write only trusts a handle made by a write,
+//whose lookup unshared every directory on the way.
+//It also keeps the block of the chain the last read or write ended in, so
+//the next one at or after it does not walk the chain from the start. That
+//is dropped whenever any block loses a reference, since no chain can change
+//under it otherwise.
+#define MAX_HANDLES 256
+
+struct cs1550_handle
+{
+	int used;
+	unsigned long generation;	//dentry_generation the entry was found in
+	int unshared;		//found by a write, with its directories unshared
+	long parent;		//directory block holding the entry
+	int index;			//slot of the entry in parent
+	long start_block;	//nStartBlock when the position was taken
+	size_t size;		//file size when last seen
+	unsigned long chain_generation;
+	long pos_index;		//which block of the chain pos_block is, -1 for none
+	long pos_block;
+};
+
+static struct cs1550_handle handles[MAX_HANDLES];
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long chain_generation = 1;	//changed under the write lock only
+
+static unsigned long handle_hits = 0;
+static unsigned long handle_position_hits = 0;
+
+//Usage and limits of each top-level directory, for everything below it. A
+//file is charged a block per MAX_DATA_IN_BLOCK bytes of its size, at least
+//one if it has a chain of its own and none while it is packed inline; a
+//directory is charged its block. Shared blocks are charged to every file
+//that has them. Usage is counted at mount and then only changed with
+//atomic adds, so checking a limit never waits for a lock. Nothing is kept
+//unless a quota option is given.
+struct cs1550_quota
+{
+	char name[MAX_NAME_LEN + 1];	//the top-level directory, empty when unused
+	long nBlockLimit;	//0 for no limit
+	long nEntryLimit;
+	long nBlocks;
+	long nEntries;
+};
+
+static struct cs1550_quota quotas[MAX_DIR_SLOTS];
+
+#define QUOTAS_ENABLED (options.quota_blocks > 0 || options.quota_entries > 0 || options.quota_table != NULL)
+
+//What resolve_path found at the end of a path
+struct cs1550_dentry
+{
+	int is_dir;
+	long block;		//the directory's block, or the file's nStartBlock
+	long parent;	//block holding the entry, -1 when it is the root itself
+	int parent_is_root;
+	int index;		//slot of the entry in parent
+	size_t size;	//file size
+};
+
+//What build_stats adds up while walking the files
+struct cs1550_usage
+{
+	int features;
+	unsigned char *owners;	//how many files reach each block, with FEATURE_DEDUP
+	unsigned long chained_files, fragmented_files, fragments;
+	unsigned long shared_blocks, saved_blocks;
+	unsigned long long logical, stored, stored_blocks;
+};
+
+//Text being built up by a walk over the files
+struct cs1550_text
+{
+	char *out;
+	size_t len;
+	size_t n;
+};
+
+//Paths collected by a walk over the files
+struct cs1550_path_list
+{
+	char **paths;
+	int n;
+	int cap;
+};
+
+static int mount_disk(void);
+static void unmount_disk(void);
+static void sync_disk(FILE *fs);
 static int initialize_filesystem();
 static int find_unallocated_block(FILE *fs);
 static void set_block_allocated(FILE *fs, int block_num);
+static void set_block_free(FILE *fs, int block_num);
+static FILE *open_disk(const char *mode);
+static int read_superblock(FILE *fs, cs1550_superblock *sb);
+static int write_superblock(FILE *fs, cs1550_superblock *sb);
+static int get_disk_features(FILE *fs);
+static int read_block(FILE *fs, long block_num, void *buf);
+static int write_block(FILE *fs, long block_num, const void *buf);
+static uint32_t crc32c(const void *buf, size_t len);
+static cs1550_free_space_tracker *get_tracker(FILE *fs);
+static int block_refcount(FILE *fs, long block_num);
+static int set_block_refcount(FILE *fs, long block_num, int count);
+static int block_ref(FILE *fs, long block_num);
+static int block_unref(FILE *fs, long block_num);
+static long count_free_blocks(FILE *fs);
+static void note_free_blocks(long delta);
+static void sync_begin(const char *path, int create);
+static void sync_end(void);
+static void sync_note(long block_num);
+static unsigned int path_hash(const char *path);
+static int resolve_path(FILE *fs, long root_block, const char *path, struct cs1550_dentry *d, int for_write);
+static int lookup_name(FILE *fs, long parent, int parent_is_root, const char *name, struct cs1550_dentry *d, int for_write);
+static int split_path(const char *path, char *parent, char *name);
+static int split_name(const char *name, char *fname, char *fext);
+static int load_dir(FILE *fs, long block_num, int is_root, cs1550_dir *dir);
+static int store_dir(FILE *fs, long block_num, int is_root, const cs1550_dir *dir);
+static int dir_find(const cs1550_dir *dir, const char *name);
+static int dir_add(FILE *fs, cs1550_dir *dir, int is_root, const char *name, size_t fsize, long start_block);
+static void dir_entry_name(const cs1550_dir *dir, int index, char *out);
+static void dentry_cache_invalidate(long parent, const char *name);
+static void dentry_cache_clear(void);
+static void dir_cache_invalidate(long block_num);
+static void dir_cache_clear(void);
+static void walk_files(FILE *fs, long root_block, void (*fn)(FILE *, const char *, long, int, struct cs1550_dir_slot *, void *), void *arg);
+static int find_file_entry(FILE *fs, const char *path, cs1550_dir *dir, long *dir_location, int *file_index);
+static void handle_note(struct fuse_file_info *fi, const struct cs1550_dentry *d, int unshared);
+static int unshare_chain(FILE *fs, cs1550_dir *dir, long dir_location, int file_index, int last_index);
+static int dedup_file(FILE *fs, cs1550_dir *dir, long dir_location, int file_index);
+static void dedup_index_remove(long block_num);
+static void free_chain(FILE *fs, long start_block);
+static void release_file_data(FILE *fs, long start_block);
+static long unshare_directory(FILE *fs, long parent, int parent_is_root, int index);
+static int unshare_index_chain(FILE *fs, cs1550_dir *dir, long dir_location, int file_index);
+static long load_snapshot_table(FILE *fs, cs1550_snapshot_table *table, int create);
+static int have_shared_blocks(FILE *fs);
+static int is_snapshot_path(const char *path);
+static int resolve_snapshot(const char **path, long *root_block);
+static int create_snapshot(const char *name);
+static int delete_snapshot(const char *name);
+static long new_group_index(FILE *fs);
+static int read_compressed(FILE *fs, long index_block, size_t file_size, char *buf, size_t size, off_t offset);
+static int write_compressed(FILE *fs, long index_block, size_t file_size, const char *buf, size_t size, off_t offset);
+static int truncate_compressed(FILE *fs, long index_block, size_t size);
+static int build_stats(FILE *fs, char *out, size_t len);
+static int chain_fragments(FILE *fs, long start_block, int *blocks);
+static int build_fragmentation(FILE *fs, char *out, size_t len);
+static int defrag_file(FILE *fs, long dir_location, int file_index);
+static int read_pack_slot(FILE *fs, long ref, char *out);
+static int write_pack_slot(FILE *fs, long ref, const char *data);
+static long store_in_pack(FILE *fs, const char *data);
+static void release_pack_slot(FILE *fs, long ref);
+static void pack_room_load(FILE *fs);
+static int attr_cache_lookup(const char *path, struct stat *stbuf);
+static void attr_cache_store(const char *path, const struct stat *stbuf);
+static void attr_cache_invalidate(const char *path);
+static void attr_cache_clear(void);
+static int find_data_block(FILE *fs);
+static struct cs1550_quota *quota_of(const char *path);
+static struct cs1550_quota *quota_find(const char *name);
+static int quota_charge(struct cs1550_quota *q, long blocks, long entries);
+static long quota_file_blocks(long start_block, size_t size);
+static void quota_count(FILE *fs, long dir_location, long *blocks, long *entries);
+static struct cs1550_quota *quota_add_dir(const char *name, long blocks, long entries);
+static void quota_load(FILE *fs);
+static int xattr_load(FILE *fs, long head, struct cs1550_xattr_table *t);
+static long xattr_store(FILE *fs, const struct cs1550_xattr_table *t);
+static void xattr_release(FILE *fs, long head);
+static void xattr_cache_clear(void);
+static int xattr_append(struct cs1550_xattr_table *t, const char *entry, size_t entry_len, const char *name, size_t name_len, const void *value, size_t size);
+static int xattr_take(struct cs1550_xattr_table *t, const char *entry, const char *name, struct cs1550_xattr_table *out, const char *out_entry);
+static int xattr_move(FILE *fs, cs1550_dir *from, const char *entry, cs1550_dir *to, const char *to_entry, long *released);
 
 
 /*
@@ -108,118 +843,59 @@ static void set_block_allocated(FILE *fs, int block_num);
 */
 static int cs1550_getattr(const char *path, struct stat *stbuf)
 {
-	if (check_fs_initialization() != 1) {
-		initialize_filesystem();
-		filesystem_initialized = 1;
+	if (attr_cache_lookup(path, stbuf) == 0) return 0;
+
+	//Statistics are generated on every read; open() turns on direct_io so the
+	//size reported here does not matter.
+	if (strcmp(path, STATS_PATH) == 0 || strcmp(path, FRAG_PATH) == 0) {
+		memset(stbuf, 0, sizeof(struct stat));
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+
+	//Inside a snapshot, look the rest of the path up from its root
+	const char *full_path = path;
+	long root_block = 0;
+	if (is_snapshot_path(path)) {
+		int r = resolve_snapshot(&path, &root_block);
+		if (r != 0) return r;
+		if (root_block < 0) {
+			memset(stbuf, 0, sizeof(struct stat));
+			stbuf->st_mode = S_IFDIR | 0755;
+			stbuf->st_nlink = 2;
+			return 0;
+		}
 	}
 
 
 	char* diskfile = "./.disk";
-	FILE *fs = fopen(diskfile, "rb");
-	cs1550_root_directory *root_dir=malloc(sizeof(cs1550_root_directory));
+	FILE *fs = open_disk("rb");
 	if (fs == 0) {
 		printf("cs1550_getattr(): could not open %s errno: %s\n", diskfile,strerror(errno));
-	} else {
-		fseek(fs, 0, SEEK_SET); // make sure descriptor is at beginning of file
-		if (fread(root_dir, sizeof(cs1550_root_directory), 1, fs) != 1) {
-			printf("cs1550_getattr(): could not read root struct from %s errno: %s\n", diskfile,strerror(errno));
-		}
+		return -EIO;
 	}
 
-	int res = 0;
-	int i = 0;
-	/** These sizes are well above what is required
-	to avoid fighting with overruns.
-	Null termination is added appropriately later. **/
-	char extension[10];
-	char filename[10];
-	char directory[25];
-
-	sscanf(path,  "/%[^/]/%[^.].%s", directory, filename, extension);
+	/** Walk the path down from the root **/
+	struct cs1550_dentry d;
+	int res = resolve_path(fs, root_block, path, &d, 0);
 
 	memset(stbuf, 0, sizeof(struct stat));
-
-
-	int is_subdir = 1;
-	i = 0;
-	while (path[i] != NULL) {
-		if (path[i] == '.') is_subdir = 0;
-		i++;
-	}
-
-	//is path the root dir?
-	if (strcmp(path, "/") == 0) {
+	if (res == 0 && d.is_dir) {
 		stbuf->st_mode = S_IFDIR | 0755;
 		stbuf->st_nlink = 2;
-		printf("cs1550_getattr(): Setting stat structure for root directory.\n");
-	} else if (is_subdir) {
-		/** Path denotes a directory. Does directory exist? **/
-		int subdir_exists = 0;
-		for (i=0; i<MAX_DIRS_IN_ROOT; i++) {
-			if ( strncmp(root_dir->directories[i].dname, directory, 8) == 0 ) subdir_exists = 1;
-		}
-
-		//	if (subdir_exists==1) printf("cs1550_getattr(): subdirectory %s exists.\n", path);
-		//	else printf("cs1550_getattr(): subdirectory %s does not exist.\n", directory);
-
-		if (subdir_exists) {
-			stbuf->st_mode = S_IFDIR | 0755;
-			stbuf->st_nlink = 2;
-			printf("cs1550_getattr(): Setting stat structure for subdirectory %s\n", directory);
-			res = 0;
-		} else res = -ENOENT;
-	}
-	else {
-		printf("cs1550_getattr(): Getting attributes for file %s at path %s\n", filename, path);
-		/** else it is a file. does file exist? **/
-		int file_exists = 0;
-		/** First look for its directory **/
-		int subdir_exists = 0;
-		int subdir_location_on_disk = 0;
-		for (i=0; i<MAX_DIRS_IN_ROOT; i++) {
-			if ( strncmp(root_dir->directories[i].dname, directory, 8) == 0 ) {
-				subdir_exists = 1;
-				subdir_location_on_disk = root_dir->directories[i].nStartBlock;
-				break;
-			}
-		}
-		/** Now look through the directory for the file. **/
-		int file_size = 0;
-		if (subdir_exists) {
-			/** Get the directory entry from disk **/
-			printf("cs1550_getattr(): Found subdirectory that the file is in..\n");
-			cs1550_directory_entry *dir_entry = malloc(sizeof(cs1550_directory_entry));
-			fseek(fs, subdir_location_on_disk*BLOCK_SIZE, SEEK_SET);
-			if (fread(dir_entry, sizeof(cs1550_directory_entry), 1, fs) != 1) {
-				printf("cs1550_getattr(): could not read directory entry struct from %s errno: %s\n", diskfile,strerror(errno));
-			} else printf("cs1550_getattr(): loaded directory entry struct from block %i\n", subdir_location_on_disk);
-
-			for (i=0; i<MAX_FILES_IN_DIR; i++) {
-				if (dir_entry->files[i].fname != NULL) {
-					printf("cs1550_getattr(): comparing %s and %s\n", dir_entry->files[i].fname, filename);
-				}
-				int f = strncmp(dir_entry->files[i].fname, filename, 8);
-				int e = strncmp(dir_entry->files[i].fext, extension, 3);
-				if ( (e==0) && (f==0) ) {
-					file_exists = 1;
-					file_size = dir_entry->files[i].fsize;
-					break;
-				}
-			}
-		}
-
-		if (file_exists) {
-			stbuf->st_mode = S_IFREG | 0666;
-			stbuf->st_nlink = 1; //file links
-			stbuf->st_size = file_size;
-			res = 0;
-			printf("cs1550_getattr(): Setting stat structure for file %s.%s\n", filename, extension);
-		} else res = -ENOENT;
+		printf("cs1550_getattr(): Setting stat structure for directory %s\n", path);
+	} else if (res == 0) {
+		stbuf->st_mode = S_IFREG | (root_block == 0 ? 0666 : 0444);
+		stbuf->st_nlink = 1; //file links
+		stbuf->st_size = d.size;
+		printf("cs1550_getattr(): Setting stat structure for file %s\n", path);
 	}
 
 	if (fs != NULL) fclose(fs);
 	printf("cs1550_getattr(): file pointer closed\n");
 
+	if (res == 0) attr_cache_store(full_path, stbuf);
 	return res;
 }
 
@@ -237,88 +913,85 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 		(void) fi;
 
 		int r = 0;
-		char extension[10];
-		char filename[10];
-		char directory[25];
-
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+		int i;
+
+		//SNAP_DIR lists the snapshots; inside one, list from its root
+		const char *full_path = path;
+		char prefix[64] = "";
+		long root_block = 0;
+		if (is_snapshot_path(path)) {
+			r = resolve_snapshot(&path, &root_block);
+			if (r != 0) return r;
+			if (root_block < 0) {
+				cs1550_snapshot_table table;
+				FILE *fs = open_disk("rb");
+				if (fs == NULL) return -EIO;
+				load_snapshot_table(fs, &table, 0);
+				fclose(fs);
+				filler(buf, ".", NULL, 0);
+				filler(buf, "..", NULL, 0);
+				for (i=0; i<MAX_SNAPSHOTS; i++) {
+					if (table.snapshots[i].name[0] != '\0') filler(buf, table.snapshots[i].name, NULL, 0);
+				}
+				return 0;
+			}
+			int prefix_len = strlen(full_path) - (strcmp(path, "/") == 0 ? 0 : strlen(path));
+			snprintf(prefix, sizeof(prefix), "%.*s", prefix_len, full_path);
+		}
 
 		printf("cs1550_readdir(): attempting to list contents of %s\n", path);
-		// Is path valid?
-		if (strlen(path) > MAX_FILENAME+1) return -ENOENT;
-
-		// Is path not a directory?
-		int is_subdir = 1;
-		int i = 0;
-		while (path[i] != NULL) {
-			if (path[i] == '.') is_subdir = 0;
-			i++;
-		}
-		if (!is_subdir) return -ENOENT;
 
-		// Check if directory exists
 		char* disk_name = "./.disk";
-		FILE *fs = fopen(disk_name, "rb");
-		cs1550_root_directory *root_dir=malloc(sizeof(cs1550_root_directory));
+		FILE *fs = open_disk("rb");
 		if (fs == 0) {
-			r = -1;
 			printf("cs1550_readdir(): could not open %s errno: %s\n", disk_name,strerror(errno));
-		} else {
-			if (fread(root_dir, sizeof(cs1550_root_directory), 1, fs) != 1) {
-				r = -1;
-				printf("cs1550_readdir(): could not read root struct from %s errno: %s\n", disk_name,strerror(errno));
-			}
+			return -EIO;
+		}
+
+		// Does the directory exist?
+		struct cs1550_dentry d;
+		r = resolve_path(fs, root_block, path, &d, 0);
+		if (r == 0 && !d.is_dir) r = -ENOTDIR;
+		if (r != 0) {
+			fclose(fs);
+			return r;
 		}
 
 		filler(buf, ".", NULL, 0);
 		filler(buf, "..", NULL, 0);
 
-		//If path is root directory, display subdirectories
-		//If path is a subdirectory, display files
-
-		if (strcmp(path, "/") == 0) {
-			for(i=0;i<MAX_DIRS_IN_ROOT;i++) {
-				if (root_dir->directories[i].dname != NULL) filler(buf, root_dir->directories[i].dname, NULL, 0);
-			}
-		} else {
-			//Is a subdirectory. Does the subdirectory exist?
-			int subdir_exists = 0;
-			int subdir_location_on_disk = -1;
-			for(i=0;i<MAX_DIRS_IN_ROOT;i++) {
-				if (root_dir->directories[i].dname == NULL) continue;
-				if ( strcmp(root_dir->directories[i].dname, directory) == 0 ) { subdir_exists = 1; subdir_location_on_disk = root_dir->directories[i].nStartBlock; }
-			}
-			if (!subdir_exists){
-				printf("cs1550_readdir(): could not find subdirectory %s\n", directory);
-				if (fs!=NULL) fclose(fs);
-				return -ENOENT;
+		//The root directory holds only directories, the others hold files
+		//and directories.
+		//Every entry gets its stat filled in and cached so the getattr
+		//calls that follow an `ls -l` don't go back to the disk.
+		struct stat st;
+		char entry_path[ATTR_CACHE_PATH_MAX];
+		char name[MAX_NAME_LEN + 1];
+		const char *dir_path = strcmp(path, "/") == 0 ? "" : path;
+		cs1550_dir dir;
+
+		if (load_dir(fs, d.block, d.parent < 0, &dir) != 0) {
+			printf("cs1550_readdir(): could not read directory from %s\n", disk_name);
+			fclose(fs);
+			return -EIO;
+		}
+		for(i=0;i<MAX_DIR_SLOTS;i++) {
+			if (dir.files[i].nNameLen == 0) continue;
+			dir_entry_name(&dir, i, name);
+			memset(&st, 0, sizeof(struct stat));
+			if (IS_SUBDIR(dir.files[i])) {
+				st.st_mode = S_IFDIR | 0755;
+				st.st_nlink = 2;
 			} else {
-				//List suddirectory's contents
-
-				/** Get directory entry **/
-				cs1550_directory_entry *dir_entry = malloc(sizeof(cs1550_directory_entry));
-				fseek(fs, subdir_location_on_disk*BLOCK_SIZE, SEEK_SET);
-				if (fread(dir_entry, sizeof(cs1550_directory_entry), 1, fs) != 1) {
-					printf("cs1550_readdir(): could not read directory entry struct from %s errno: %s\n", disk_name,strerror(errno));
-				}
-
-				// List all files in directory
-				char path_to_display[MAX_FILENAME + MAX_EXTENSION + 1 + 1];
-				memset(path_to_display, 0, MAX_FILENAME + MAX_EXTENSION + 2);
-				for(i=0;i<MAX_FILES_IN_DIR;i++) {
-					if (dir_entry->files[i].fname[0] != NULL) {
-						strncat(path_to_display, dir_entry->files[i].fname, 8);
-						strncat(path_to_display, ".", 1);
-						strncat(path_to_display, dir_entry->files[i].fext, 3);
-						filler(buf, path_to_display, NULL, 0);
-					}
-					memset(path_to_display, 0, MAX_FILENAME + MAX_EXTENSION + 2);
-				}
-
+				st.st_mode = S_IFREG | (root_block == 0 ? 0666 : 0444);
+				st.st_nlink = 1;
+				st.st_size = dir.files[i].fsize;
 			}
+			if (snprintf(entry_path, sizeof(entry_path), "%s%s/%s", prefix, dir_path, name) < (int)sizeof(entry_path)) attr_cache_store(entry_path, &st);
+			filler(buf, name, &st, 0);
 		}
 
-		if (fs != NULL) fclose(fs);
+		fclose(fs);
 		return 0;
 	}
 
@@ -329,679 +1002,5625 @@ static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 	static int cs1550_mkdir(const char *path, mode_t mode)
 	{
-		(void) path;
 		(void) mode;
 		int w = 0;
 		int r = 0;
-		int err = 0;
 		int i = 0;
-		//char directory_name[strlen(path)+1]; // this doesn't work in sub C99, and may lead to bad buffer overruns
-		char directory_name[MAX_FILENAME+1];
-
-		if (check_fs_initialization() != 1) {
-			initialize_filesystem();
-			filesystem_initialized = 1;
+		char parent_path[PATH_MAX];
+		char name[MAX_NAME_LEN + 1];
+		struct cs1550_dentry parent, d;
+		cs1550_dir dir;
+
+		/** mkdir under SNAP_DIR takes a snapshot **/
+		if (is_snapshot_path(path)) {
+			if (strcmp(path, SNAP_DIR) == 0) return -EEXIST;
+			return create_snapshot(path + strlen(SNAP_DIR) + 1);
 		}
 
-		strncpy(directory_name, path+1, MAX_FILENAME);
-		directory_name[strlen(path)] = "\0";
 		/** Check to see if we need to return an error
 		*  The check to see if the directory already exists
-		*  happens below after the root directory is read from disk. **/
-		int seen_root=0;
-		if (strlen(directory_name) > MAX_FILENAME+1) return -ENAMETOOLONG; // +1 because of root '/''
-
-		for (i=0;i<strlen(path);i++) {
-			if (path[i] == '/' && seen_root == 0) seen_root = 1;
-			else if (path[i] == '/') return -EPERM;
-		}
+		*  happens below after its parent is read from disk. **/
+		r = split_path(path, parent_path, name);
+		if (r != 0) return r == -EINVAL ? -EEXIST : r;
 
 		/** END primary error checking **/
 		char* filename = "./.disk";
-		FILE *fs = fopen(filename, "rb+");
-		cs1550_root_directory *root_dir=malloc(sizeof(cs1550_root_directory));
-		cs1550_directory_entry *new_dir = malloc(sizeof(cs1550_directory_entry));
-		assert(fs != 0);
+		FILE *fs = open_disk("rb+");
 		if (fs == 0) {
-			err = errno;
-			r = -1;
-			assert(r==0);
-			printf("cs1550_mkdir(): could not open %s errno: %s\n", filename,strerror(err));
-		} else {
-			/** Obtain root directory from disk **/
-			w = fread(root_dir, sizeof(cs1550_root_directory), 1, fs);
-			if ( w != 1) {
-				err = errno;
-				assert(r==0);
-				r = -1;
-				assert(r==0);
-				printf("cs1550_mkdir(): could not read root struct from %s errno: %s\n", filename,strerror(err));
-				fflush(stdout);
-			}
-			assert(r==0);
-			/** Are we at capacity for directories? **/
-			if ( root_dir->nDirectories >= MAX_DIRS_IN_ROOT ) { if (fs!=NULL) fclose(fs);
-				return -1; }
-			/** Does directory already exist? **/
-			for(i=0;i<MAX_DIRS_IN_ROOT;i++) {
-				if ( strcmp(root_dir->directories[i].dname, directory_name) == 0 ) { if (fs!=NULL) fclose(fs); return -EEXIST; }
-			}
-			/** Find somewhere to put the new directory **/
-			int block_num = find_unallocated_block(fs);
-
-			root_dir->nDirectories++;
-			for(i=0;i<MAX_DIRS_IN_ROOT;i++) {
-				if (root_dir->directories[i].dname[0] == NULL) {
-					strncpy(root_dir->directories[i].dname, directory_name, 8);
-					root_dir->directories[i].nStartBlock = block_num;
-					break;
-				}
-			}
-
-			/** Update root entry **/
-			fseek(fs, 0, SEEK_SET);
-			w = fwrite(root_dir, sizeof(cs1550_root_directory), 1, fs);
-			if (w != 1) {
-				printf("cs1550_mkdir(): fwrite() failed to update root directory on disk. errno: %s\n", strerror(errno));
-				assert(r==0);
-				r = -1;
-				assert(r==0);
-			}	else printf("cs1550_mkdir(): root directory successfully updated on disk.\n");
-			/**/
+			printf("cs1550_mkdir(): could not open %s errno: %s\n", filename,strerror(errno));
+			return -EIO;
+		}
 
-			/** Set the new directory's block as allocated and write it to disk **/
-			set_block_allocated(fs, block_num);
-			assert(r==0);
-			new_dir->nFiles = 0;
-			for(i=0;i<MAX_FILES_IN_DIR;i++) new_dir->files[i].fname[0] = '\0'; // zero out all filenames in new directory
-			assert(block_num != 0);
-			fseek(fs, BLOCK_SIZE*block_num, SEEK_SET);
-			printf("cs1550_mkdir(): writing new directory entry to byte position %i\n", BLOCK_SIZE*block_num);
-			w = fwrite(new_dir, sizeof(cs1550_directory_entry), 1, fs);
-			if (w != 1) {
-				printf("cs1550_mkdir(): fwrite() failed to write new directory entry to disk. errno: %s\n", strerror(errno));
-				assert(r==0);
-				r = -1;
-				assert(r==0);
-			} else printf("cs1550_mkdir(): new directory entry successfully written to disk.\n");
-			assert(r==0);
+		/** The parent is about to change, so it is unshared from any snapshot **/
+		r = resolve_path(fs, 0, parent_path, &parent, 1);
+		if (r == 0 && !parent.is_dir) r = -ENOTDIR;
+		/** Does directory already exist? **/
+		if (r == 0) {
+			r = lookup_name(fs, parent.block, parent.parent < 0, name, &d, 0);
+			r = r == 0 ? -EEXIST : (r == -ENOENT ? 0 : r);
+		}
+		/** Is the name allowed, and is there room for it? **/
+		if (r == 0 && load_dir(fs, parent.block, parent.parent < 0, &dir) != 0) r = -EIO;
+		if (r == 0) {
+			i = dir_add(fs, &dir, parent.parent < 0, name, SUBDIR_SIZE, NO_BLOCK);
+			if (i < 0) r = i;
+		}
 
+		/** Find somewhere to put the new directory. Below the top level it
+		counts against the quota of the directory it is in. **/
+		struct cs1550_quota *q = parent.parent < 0 ? NULL : quota_of(path);
+		int block_num = r == 0 ? find_unallocated_block(fs) : -1;
+		if (r == 0 && block_num < 0) r = -ENOSPC;
+		if (r == 0) r = quota_charge(q, 1, 1);
+		if (r != 0) {
+			fclose(fs);
+			return r;
+		}
 
+		/** Set the new directory's block as allocated and write it to disk **/
+		set_block_allocated(fs, block_num);
+		char *new_dir = calloc(1, BLOCK_SIZE);
+		printf("cs1550_mkdir(): writing new directory entry to byte position %i\n", BLOCK_SIZE*block_num);
+		w = write_block(fs, block_num, new_dir);
+		free(new_dir);
+		if (w != 0) {
+			printf("cs1550_mkdir(): fwrite() failed to write new directory entry to disk. errno: %s\n", strerror(errno));
+			set_block_free(fs, block_num);
+			quota_charge(q, -1, -1);
+			fclose(fs);
+			return -EIO;
 		}
 
-		if (fs!=NULL) fclose(fs);
+		/** Update parent entry **/
+		dir.files[i].nStartBlock = block_num;
+		w = store_dir(fs, parent.block, parent.parent < 0, &dir);
+		dentry_cache_invalidate(parent.block, name);
+		if (w != 0) {
+			printf("cs1550_mkdir(): fwrite() failed to update parent directory on disk. errno: %s\n", strerror(errno));
+			set_block_free(fs, block_num);
+			quota_charge(q, -1, -1);
+			r = -EIO;
+		} else printf("cs1550_mkdir(): parent directory successfully updated on disk.\n");
+		if (r == 0 && parent.parent < 0) quota_add_dir(name, 0, 0);
+
+		fclose(fs);
 		return r;
 	}
 
+	/*
+	* Returns the tracker, reading it from disk the first time.
+	*/
+	static cs1550_free_space_tracker *get_tracker(FILE *fs) {
+		if (tracker_map == NULL) {
+			cs1550_free_space_tracker *tracker = malloc(sizeof(cs1550_free_space_tracker));
+			fseek(fs, TRACKER_START_BLOCK * BLOCK_SIZE, SEEK_SET);
+			if (fread(tracker, sizeof(cs1550_free_space_tracker), 1, fs) != 1) {
+				printf("get_tracker(): could not read free space tracker from disk errno: %s\n", strerror(errno));
+				free(tracker);
+				return NULL;
+			}
+			tracker_map = tracker;
+		}
+		return tracker_map;
+	}
+
 	static int find_unallocated_block(FILE *fs) {
-		int r = 0;
-		int unallocated_block = -1;
-		cs1550_free_space_tracker *free_tracker =malloc(sizeof(cs1550_free_space_tracker));
+		cs1550_free_space_tracker *tracker = get_tracker(fs);
+		int i;
 
-		if (fs == NULL) printf("find_unallocated_block(): fs descriptor is NULL.\n");
-		if (fseek(fs, DISKSIZE_IN_BYTES - BLOCK_SIZE, SEEK_SET) != 0) printf("find_unallocated_block() fseek() failed. errno: %s\n", strerror(errno));
-		if (fread(free_tracker, sizeof(cs1550_free_space_tracker), 1, fs) != 1) {
-			r = -1;
-			printf("find_unallocated_block(): could not read free space tracker from disk errno: %s Location of stream: %i\n",strerror(errno), ftell(fs));
-			if (ferror(fs)!=0) printf("ferror() returned nonzero\n");
-		} else {
-			// look for unallocated block
-			int i;
-			for (i=0; i<MAX_DATA_IN_BLOCK; i++) {
-				if (free_tracker->data[i] == 0) {
-					unallocated_block = i;
-					break;
-				}
-			}
+		if (tracker == NULL) return -1;
+		// look for unallocated block
+		for (i=0; i<MAX_NUM_OF_BLOCKS; i++) {
+			if (tracker->data[i] == 0) return i;
 		}
+		return -1;
+	}
 
-		return unallocated_block;
+	/*
+	* Like find_unallocated_block, for file data. It leaves the last
+	* reserved_blocks free blocks to directories and other metadata.
+	*/
+	static int find_data_block(FILE *fs) {
+		if (count_free_blocks(fs) <= options.reserved_blocks) return -1;
+		return find_unallocated_block(fs);
 	}
 
 	static void set_block_allocated(FILE *fs, int block_num) {
-		int r = 0;
-		int w = -1;
+		if (set_block_refcount(fs, block_num, 1) == 0) printf("set_block_allocated(): free space tracker updated.\n");
+	}
 
-		cs1550_free_space_tracker *free_tracker =malloc(sizeof(cs1550_free_space_tracker));
-		fseek(fs, DISKSIZE_IN_BYTES - BLOCK_SIZE, SEEK_SET);
-		if (fread(free_tracker, sizeof(cs1550_free_space_tracker), 1, fs) != 1) {
-			r = -1;
-			printf("set_block_allocated(): could not read free space tracker from disk errno: %s\n", strerror(errno));
-		} else {
-			// mark block allocated
-			free_tracker->data[block_num] = 1;
-			fseek(fs, DISKSIZE_IN_BYTES - BLOCK_SIZE, SEEK_SET);
-			w = fwrite(free_tracker, sizeof(cs1550_free_space_tracker), 1, fs);
-			if (w != 1) printf("set_block_allocated(): fwrite() failed to write free space tracker to disk. errno: %s\n", strerror(errno));
-			else printf("set_block_allocated(): free space tracker updated.\n");
-		}
+	static void set_block_free(FILE *fs, int block_num) {
+		if (set_block_refcount(fs, block_num, 0) == 0) printf("set_block_free(): block %i released.\n", block_num);
 	}
 
 	/*
-	* Removes a directory.
+	* stdio callbacks for streams over the in-memory image. The cookie is
+	* the stream's position.
 	*/
-	static int cs1550_rmdir(const char *path)
-	{
-		(void) path;
+	static ssize_t ram_disk_read(void *cookie, char *buf, size_t size) {
+		off64_t *pos = cookie;
+		if (*pos >= DISKSIZE_IN_BYTES) return 0;
+		if (size > (size_t)(DISKSIZE_IN_BYTES - *pos)) size = DISKSIZE_IN_BYTES - *pos;
+		memcpy(buf, &ram_disk[*pos], size);
+		*pos += size;
+		return size;
+	}
+
+	static ssize_t ram_disk_write(void *cookie, const char *buf, size_t size) {
+		off64_t *pos = cookie;
+		if (*pos >= DISKSIZE_IN_BYTES) return 0;
+		if (size > (size_t)(DISKSIZE_IN_BYTES - *pos)) size = DISKSIZE_IN_BYTES - *pos;
+		memcpy(&ram_disk[*pos], buf, size);
+		*pos += size;
+		return size;
+	}
+
+	static int ram_disk_seek(void *cookie, off64_t *offset, int whence) {
+		off64_t *pos = cookie;
+		off64_t to = *offset;
+		if (whence == SEEK_CUR) to += *pos;
+		else if (whence == SEEK_END) to += DISKSIZE_IN_BYTES;
+		if (to < 0) return -1;
+		*pos = *offset = to;
 		return 0;
 	}
 
-	static int initialize_filesystem() {
-		int r = 0;
-		int w = 0;
-		char* filename = "./.disk";
-		FILE *fs = fopen(filename, "rb+");
-		if (fs == NULL) {
-			int err = errno;
-			r = 1;
-			printf("initialize_filesystem(): could not open %s errno: %s\n", filename,strerror(err));
-		} else {
-			/** Create root directory **/
-			cs1550_root_directory *root = malloc(sizeof(cs1550_root_directory));
-			root->nDirectories = 0;
-			int i;
-			for (i=0;i<MAX_DIRS_IN_ROOT;i++) strcpy(root->directories[i].dname, "");
-			fseek(fs, 0, SEEK_SET);
-			w = fwrite(root, sizeof(cs1550_root_directory), 1, fs);
-			if (w != 1) printf("initialize_filesystem(): fwrite() failed to write root directory to disk. errno: %s\n", strerror(errno));
-			else printf("initialize_filesystem(): root directory initialized.\n");
+	static int ram_disk_close(void *cookie) {
+		free(cookie);
+		return 0;
+	}
 
-			/** Create free space tracker **/
-			cs1550_free_space_tracker *free_space = malloc(sizeof(cs1550_free_space_tracker));
-			free_space->data[0] = 1; // show first block as allocated for root
-			// need to mark as allocated the space used for the tracker!
-			fseek(fs, DISKSIZE_IN_BYTES - BLOCK_SIZE, SEEK_SET);
-			w = fwrite(free_space, sizeof(cs1550_free_space_tracker), 1, fs);
-			if (w != 1) printf("initialize_filesystem(): fwrite() failed to write free space tracker to disk. errno: %s\n", strerror(errno));
-			else printf("initialize_filesystem(): free space tracker initialized and written to byte position %i.\n", DISKSIZE_IN_BYTES - BLOCK_SIZE);
+	/*
+	* Reads or writes one file's share of a striped transfer with as few
+	* preadv/pwritev calls as IOV_MAX allows. Its pieces are consecutive in
+	* the file even though they are spread over the caller's buffer.
+	*/
+	static void stripe_job_run(struct cs1550_stripe_job *job) {
+		off64_t off = job->off;
+		int done = 0;
+
+		while (done < job->iovcnt && job->error == 0) {
+			int n = job->iovcnt - done;
+			size_t want = 0;
+			int i;
+			if (n > IOV_MAX) n = IOV_MAX;
+			for (i=0; i<n; i++) want += job->iov[done + i].iov_len;
+			ssize_t got = job->write ? pwritev2(stripe_fds[job->file], &job->iov[done], n, off, job->write > 1 ? RWF_DSYNC : 0) : preadv(stripe_fds[job->file], &job->iov[done], n, off);
+			if (got != (ssize_t)want) job->error = 1;
+			off += want;
+			done += n;
 		}
+	}
 
-		if (fs != NULL) fclose(fs);
+	/*
+	* Runs the jobs handed to the worker of one backing file until
+	* stripe_stop.
+	*/
+	static void *stripe_main(void *arg) {
+		struct cs1550_stripe_worker *w = arg;
+
+		pthread_mutex_lock(&stripe_lock);
+		while (stripe_running) {
+			if (w->job == NULL) {
+				pthread_cond_wait(&stripe_wakeup, &stripe_lock);
+				continue;
+			}
+			struct cs1550_stripe_job *job = w->job;
+			pthread_mutex_unlock(&stripe_lock);
+			stripe_job_run(job);
+			pthread_mutex_lock(&stripe_lock);
+			job->done = 1;
+			w->job = NULL;
+			pthread_cond_broadcast(&stripe_wakeup);
+		}
+		pthread_mutex_unlock(&stripe_lock);
+		return NULL;
+	}
 
-		return r;
+	static void stripe_stop(void) {
+		int i;
+		pthread_mutex_lock(&stripe_lock);
+		stripe_running = 0;
+		pthread_cond_broadcast(&stripe_wakeup);
+		pthread_mutex_unlock(&stripe_lock);
+		for (i=0; i<stripe_threads; i++) pthread_join(stripe_workers[i].thread, NULL);
+		stripe_threads = 0;
 	}
 
 	/*
-	* Does the actual creation of a file. Mode and dev can be ignored.
-	*
+	* Starts a worker for each backing file. Without all of them, transfers
+	* go through the files one after another on the calling thread.
 	*/
-	static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+	static void stripe_start(void) {
+		if (stripe_count < 2 || stripe_running) return;
+		stripe_running = 1;
+		for (stripe_threads=0; stripe_threads<stripe_count; stripe_threads++) {
+			stripe_workers[stripe_threads].job = NULL;
+			if (pthread_create(&stripe_workers[stripe_threads].thread, NULL, stripe_main, &stripe_workers[stripe_threads]) != 0) {
+				printf("stripe_start(): could not start worker for stripe file %i.\n", stripe_threads);
+				stripe_stop();
+				return;
+			}
+		}
+	}
+
+	/*
+	* Moves size bytes between buf and the striped image at pos. When a
+	* range of at least STRIPE_PARALLEL_MIN covers more than one backing
+	* file and the workers are running, the files' parts run in parallel. A
+	* write of 2 is durable when it returns.
+	*/
+	static ssize_t stripe_io(off64_t pos, char *buf, size_t size, int write) {
+		struct cs1550_stripe_job jobs[MAX_STRIPE_FILES];
+		long stripe_bytes = (long)options.stripe_width * BLOCK_SIZE;
+		int f, first = -1, used = 0, error = 0;
+
+		if (pos >= DISKSIZE_IN_BYTES) return 0;
+		if (size > (size_t)(DISKSIZE_IN_BYTES - pos)) size = DISKSIZE_IN_BYTES - pos;
+		int max_pieces = size / stripe_bytes + 2;
+		memset(jobs, 0, sizeof(jobs));
+
+		/** Split the range at stripe boundaries and hand each piece to its file **/
+		size_t done = 0;
+		while (done < size) {
+			long stripe = (pos + done) / stripe_bytes;
+			long in_stripe = (pos + done) % stripe_bytes;
+			size_t n = stripe_bytes - in_stripe;
+			if (n > size - done) n = size - done;
+			struct cs1550_stripe_job *job = &jobs[stripe % stripe_count];
+			if (job->iov == NULL) {
+				job->iov = malloc(max_pieces * sizeof(struct iovec));
+				job->file = stripe % stripe_count;
+				job->write = write;
+				job->off = (stripe / stripe_count) * stripe_bytes + in_stripe;
+				if (first < 0) first = stripe % stripe_count;
+				used++;
+			}
+			job->iov[job->iovcnt].iov_base = buf + done;
+			job->iov[job->iovcnt].iov_len = n;
+			job->iovcnt++;
+			done += n;
+		}
+
+		if (used > 1 && size >= STRIPE_PARALLEL_MIN && stripe_running) {
+			/** Hand every part but the first to its file's worker, waiting
+			for one that is still busy with another transfer **/
+			pthread_mutex_lock(&stripe_lock);
+			for (f=0; f<stripe_count; f++) {
+				if (f == first || jobs[f].iov == NULL) continue;
+				while (stripe_workers[f].job != NULL) pthread_cond_wait(&stripe_wakeup, &stripe_lock);
+				stripe_workers[f].job = &jobs[f];
+				pthread_cond_broadcast(&stripe_wakeup);
+			}
+			pthread_mutex_unlock(&stripe_lock);
+			stripe_job_run(&jobs[first]);
+			pthread_mutex_lock(&stripe_lock);
+			for (f=0; f<stripe_count; f++) {
+				while (f != first && jobs[f].iov != NULL && !jobs[f].done) pthread_cond_wait(&stripe_wakeup, &stripe_lock);
+			}
+			pthread_mutex_unlock(&stripe_lock);
+		} else {
+			for (f=0; f<stripe_count; f++) {
+				if (jobs[f].iov != NULL) stripe_job_run(&jobs[f]);
+			}
+		}
+		for (f=0; f<stripe_count; f++) {
+			error |= jobs[f].error;
+			free(jobs[f].iov);
+		}
+		if (error) {
+			errno = EIO;
+			return -1;
+		}
+		return size;
+	}
+
+	static ssize_t stripe_disk_read(void *cookie, char *buf, size_t size) {
+		off64_t *pos = cookie;
+		ssize_t n = stripe_io(*pos, buf, size, 0);
+		if (n > 0) *pos += n;
+		return n;
+	}
+
+	static ssize_t stripe_disk_write(void *cookie, const char *buf, size_t size) {
+		off64_t *pos = cookie;
+		ssize_t n = stripe_io(*pos, (char *)buf, size, 1);
+		if (n > 0) *pos += n;
+		return n;
+	}
+
+#ifndef CS1550_FUZZ
+	/*
+	* Opens the backing files named in a colon separated list and makes each
+	* big enough for its share of the image.
+	*/
+	static int stripe_open(char *files) {
+		long stripe_bytes = (long)options.stripe_width * BLOCK_SIZE;
+		long stripes = (DISKSIZE_IN_BYTES + stripe_bytes - 1) / stripe_bytes;
+		char *name;
+
+		for (name = strtok(files, ":"); name != NULL; name = strtok(NULL, ":")) {
+			if (stripe_count == MAX_STRIPE_FILES) return -1;
+			int fd = open(name, O_RDWR | O_CREAT, 0644);
+			if (fd < 0) return -1;
+			stripe_fds[stripe_count++] = fd;
+		}
+		off_t share = (stripes + stripe_count - 1) / stripe_count * stripe_bytes;
+		for (int i=0; i<stripe_count; i++) {
+			struct stat st;
+			if (fstat(stripe_fds[i], &st) != 0) return -1;
+			if (st.st_size < share && ftruncate(stripe_fds[i], share) != 0) return -1;
+		}
+		return stripe_count > 0 ? 0 : -1;
+	}
+#endif
+
+	/*
+	* Opens the disk image: ./.disk, a stream over the memory holding it
+	* with the ramdisk option, or over the backing files with the stripe
+	* option. Every operation goes through here.
+	*/
+	static FILE *open_disk(const char *mode) {
+		static const cookie_io_functions_t ram_disk_io = { ram_disk_read, ram_disk_write, ram_disk_seek, ram_disk_close };
+		static const cookie_io_functions_t stripe_disk_io = { stripe_disk_read, stripe_disk_write, ram_disk_seek, ram_disk_close };
+
+		if (ram_disk == NULL && stripe_count == 0) return fopen("./.disk", mode);
+		off64_t *pos = calloc(1, sizeof(off64_t));
+		FILE *fs = fopencookie(pos, mode, ram_disk != NULL ? ram_disk_io : stripe_disk_io);
+		if (fs == NULL) {
+			free(pos);
+			return NULL;
+		}
+		setvbuf(fs, NULL, _IONBF, 0); // whole requests go to the callbacks
+		return fs;
+	}
+
+#ifndef CS1550_FUZZ
+	/*
+	* Fills the in-memory image from path. A missing file leaves it empty.
+	*/
+	static int ram_disk_load(const char *path) {
+		FILE *f = fopen(path, "rb");
+		if (f == NULL) return errno == ENOENT ? 0 : -1;
+		size_t n = fread(ram_disk, 1, DISKSIZE_IN_BYTES, f);
+		fclose(f);
+		printf("ram_disk_load(): loaded %zu bytes from %s\n", n, path);
+		return 0;
+	}
+#endif
+
+	/*
+	* Writes the in-memory image to a temporary file and renames it over
+	* path, so path always holds a complete image.
+	*/
+	static int ram_disk_save(const char *path) {
+		char tmp[PATH_MAX];
+		int r = 0;
+
+		if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) return -1;
+		FILE *f = fopen(tmp, "wb");
+		if (f == NULL) {
+			printf("ram_disk_save(): could not open %s errno: %s\n", tmp, strerror(errno));
+			return -1;
+		}
+		if (fwrite(ram_disk, DISKSIZE_IN_BYTES, 1, f) != 1 || fflush(f) != 0 || fsync(fileno(f)) != 0) r = -1;
+		if (fclose(f) != 0) r = -1;
+		if (r == 0 && rename(tmp, path) != 0) r = -1;
+		if (r != 0) {
+			printf("ram_disk_save(): could not save image to %s errno: %s\n", path, strerror(errno));
+			unlink(tmp);
+		} else printf("ram_disk_save(): saved image to %s\n", path);
+		return r;
+	}
+
+	/*
+	* Reads the superblock. A disk that has not been initialized reads back
+	* as having no features.
+	*/
+	static int read_superblock(FILE *fs, cs1550_superblock *sb) {
+		fseek(fs, SUPERBLOCK_BLOCK * BLOCK_SIZE, SEEK_SET);
+		if (fread(sb, sizeof(cs1550_superblock), 1, fs) != 1) {
+			printf("read_superblock(): could not read superblock from disk errno: %s\n", strerror(errno));
+			memset(sb, 0, sizeof(cs1550_superblock));
+			sb->nPackBlock = NO_BLOCK;
+			return -1;
+		}
+		if (sb->nMagic != CS1550_MAGIC) {
+			sb->nFeatures = 0;
+			sb->nPackBlock = NO_BLOCK;
+			sb->nSnapTable = 0;
+		}
+		return 0;
+	}
+
+	static int write_superblock(FILE *fs, cs1550_superblock *sb) {
+		fseek(fs, SUPERBLOCK_BLOCK * BLOCK_SIZE, SEEK_SET);
+		if (fwrite(sb, sizeof(cs1550_superblock), 1, fs) != 1) {
+			printf("write_superblock(): fwrite() failed to write superblock to disk. errno: %s\n", strerror(errno));
+			return -1;
+		}
+		sync_note(SUPERBLOCK_BLOCK);
+		return 0;
+	}
+
+	static int get_disk_features(FILE *fs) {
+		if (disk_features < 0) {
+			cs1550_superblock sb;
+			if (read_superblock(fs, &sb) != 0) return 0;
+			disk_features = sb.nFeatures;
+		}
+		return disk_features;
+	}
+
+	static uint32_t crc32c_table[256];
+	static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+	static void crc32c_init_table(void) {
+		uint32_t i, j, c;
+		for (i=0; i<256; i++) {
+			c = i;
+			for (j=0; j<8; j++) c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+			crc32c_table[i] = c;
+		}
+	}
+
+	static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+		pthread_once(&crc32c_table_once, crc32c_init_table);
+		while (len--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		return crc;
+	}
+
+#if defined(__x86_64__)
+	/*
+	* Uses the SSE4.2 crc32 instruction, 8 bytes at a time. A block is only
+	* 512 bytes, so this is already far cheaper than the I/O around it.
+	*/
+	__attribute__((target("sse4.2")))
+	static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+		uint64_t c = crc;
+		while (len >= 8) {
+			uint64_t v;
+			memcpy(&v, p, 8);
+			c = _mm_crc32_u64(c, v);
+			p += 8;
+			len -= 8;
+		}
+		crc = (uint32_t)c;
+		while (len--) crc = _mm_crc32_u8(crc, *p++);
+		return crc;
+	}
+#endif
+
+	static uint32_t crc32c(const void *buf, size_t len) {
+		uint32_t crc;
+#if defined(__x86_64__)
+		if (__builtin_cpu_supports("sse4.2")) crc = crc32c_hw(0xffffffff, buf, len);
+		else
+#endif
+		crc = crc32c_sw(0xffffffff, buf, len);
+		crc = ~crc;
+		return crc == 0 ? 0xffffffff : crc; // 0 is reserved for "no checksum"
+	}
+
+	/*
+	* Returns the checksum table, reading it from disk the first time.
+	*/
+	static uint32_t *get_checksums(FILE *fs) {
+		if (csum_map == NULL) {
+			uint32_t *table = malloc(CSUM_BLOCKS * BLOCK_SIZE);
+			fseek(fs, CSUM_START_BLOCK * BLOCK_SIZE, SEEK_SET);
+			if (fread(table, BLOCK_SIZE, CSUM_BLOCKS, fs) != CSUM_BLOCKS) {
+				printf("get_checksums(): could not read checksum table from disk errno: %s\n", strerror(errno));
+				free(table);
+				return NULL;
+			}
+			csum_map = table;
+		}
+		return csum_map;
+	}
+
+	static int read_checksum(FILE *fs, long block_num, uint32_t *csum) {
+		uint32_t *table = get_checksums(fs);
+		if (table == NULL) return -1;
+		*csum = table[block_num];
+		return 0;
+	}
+
+	static int write_checksum(FILE *fs, long block_num, uint32_t csum) {
+		uint32_t *table = get_checksums(fs);
+		if (table == NULL) return -1;
+		table[block_num] = csum;
+		fseek(fs, CSUM_START_BLOCK * BLOCK_SIZE + block_num * sizeof(uint32_t), SEEK_SET);
+		if (fwrite(&csum, sizeof(uint32_t), 1, fs) != 1) {
+			printf("write_checksum(): fwrite() failed to write checksum of block %li to disk.\n", block_num);
+			return -1;
+		}
+		return 0;
+	}
+
+	/*
+	* Returns 0 if buf matches the stored checksum of block_num (or it has
+	* none), 1 if it does not.
+	*/
+	static int verify_block(FILE *fs, long block_num, const void *buf) {
+		uint32_t stored;
+		if (read_checksum(fs, block_num, &stored) != 0 || stored == 0) return 0;
+		return stored != crc32c(buf, BLOCK_SIZE);
+	}
+
+	/*
+	* Copies the newest logged copy of block_num into buf. Returns 1 if there
+	* is one, 0 if the block is not in the log and -1 on error.
+	*/
+	static int log_read(FILE *fs, long block_num, void *buf) {
+		long at = log_map[block_num];
+		long open_base = LOG_START_BLOCK + (long)log_segment * LOG_SEGMENT_BLOCKS;
+
+		if (at < 0) return 0;
+		if (log_segment < LOG_SEGMENTS && at > open_base && at < open_base + LOG_SEGMENT_BLOCKS) {
+			memcpy(buf, &log_open[(at - open_base) * BLOCK_SIZE], BLOCK_SIZE);
+			return 1;
+		}
+		fseek(fs, at * BLOCK_SIZE, SEEK_SET);
+		if (fread(buf, BLOCK_SIZE, 1, fs) != 1) {
+			printf("log_read(): could not read log block %li of block %li. errno: %s\n", at, block_num, strerror(errno));
+			return -1;
+		}
+		return 1;
+	}
+
+	/*
+	* Writes the open segment to the log in one piece, if it holds anything.
+	*/
+	static int log_seal(FILE *fs) {
+		struct cs1550_log_header *h = (struct cs1550_log_header *)log_open;
+		uint32_t i;
+
+		if (h->nCount == 0) return 0;
+		h->nMagic = LOG_MAGIC;
+		h->nSeq = log_seq;
+		for (i=0; i<h->nCount; i++) h->nCrc[i] = crc32c(&log_open[(i + 1) * BLOCK_SIZE], BLOCK_SIZE);
+		fseek(fs, (LOG_START_BLOCK + (long)log_segment * LOG_SEGMENT_BLOCKS) * BLOCK_SIZE, SEEK_SET);
+		if (fwrite(log_open, BLOCK_SIZE, h->nCount + 1, fs) != h->nCount + 1 || fflush(fs) != 0) {
+			printf("log_seal(): could not write log segment %i. errno: %s\n", log_segment, strerror(errno));
+			return -1;
+		}
+		log_seq++;
+		log_segment++;
+		log_segments_written++;
+		memset(log_open, 0, BLOCK_SIZE);
+		return 0;
+	}
+
+	struct cs1550_log_copy
 	{
-		(void) mode;
-		(void) dev;
+		long home;
+		long at;	//index into the log
+	};
+
+	static int log_copy_cmp(const void *a, const void *b) {
+		const struct cs1550_log_copy *x = a, *y = b;
+		return (x->home > y->home) - (x->home < y->home);
+	}
 
-		/** These sizes are well above what is required
-		to avoid fighting with overruns.
-		Null termination is added appropriately later. **/
-		char extension[10];
-		char filename[10];
-		char directory[25];
+	/*
+	* Seals the open segment, copies the newest copy of every logged block
+	* home in block order, one write per run of consecutive blocks, and
+	* empties the log once that is on stable storage.
+	*/
+	static int log_clean(FILE *fs) {
+		struct cs1550_log_copy *copies;
+		char *log, *run, zero[BLOCK_SIZE];
+		int n = 0, s, i, j, r = 0;
+		uint32_t k;
+
+		if (log_seal(fs) != 0) return -1;
+		if (log_segment == 0) return 0;
+		log = malloc((size_t)log_segment * LOG_SEGMENT_BLOCKS * BLOCK_SIZE);
+		copies = malloc(LOG_BLOCKS * sizeof(struct cs1550_log_copy));
+		fseek(fs, LOG_START_BLOCK * BLOCK_SIZE, SEEK_SET);
+		if (fread(log, BLOCK_SIZE, log_segment * LOG_SEGMENT_BLOCKS, fs) != (size_t)log_segment * LOG_SEGMENT_BLOCKS) {
+			printf("log_clean(): could not read the log. errno: %s\n", strerror(errno));
+			r = -1;
+		}
+		for (s=0; r == 0 && s<log_segment; s++) {
+			struct cs1550_log_header *h = (struct cs1550_log_header *)&log[s * LOG_SEGMENT_BLOCKS * BLOCK_SIZE];
+			for (k=0; k<h->nCount; k++) {
+				long at = s * LOG_SEGMENT_BLOCKS + 1 + k;
+				if (log_map[h->nHome[k]] != LOG_START_BLOCK + at) continue;
+				copies[n].home = h->nHome[k];
+				copies[n++].at = at;
+			}
+		}
+		qsort(copies, n, sizeof(struct cs1550_log_copy), log_copy_cmp);
 
-		sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+		run = malloc((size_t)(n > 0 ? n : 1) * BLOCK_SIZE);
+		for (i=0; r == 0 && i<n; i=j) {
+			for (j=i; j<n && copies[j].home == copies[i].home + (j - i); j++) {
+				memcpy(&run[(j - i) * BLOCK_SIZE], &log[copies[j].at * BLOCK_SIZE], BLOCK_SIZE);
+			}
+			fseek(fs, copies[i].home * BLOCK_SIZE, SEEK_SET);
+			if (fwrite(run, BLOCK_SIZE, j - i, fs) != (size_t)(j - i)) {
+				printf("log_clean(): could not write blocks %li-%li home. errno: %s\n", copies[i].home, copies[j - 1].home, strerror(errno));
+				r = -1;
+			}
+			for (s=i; r == 0 && s<j; s++) {
+				char *b = &run[(s - i) * BLOCK_SIZE];
+				if (copies[s].home >= TRACKER_START_BLOCK) {
+					//What a crash left in the log is newer than the tracker read at mount
+					if (tracker_map != NULL) memcpy(&tracker_map->data[(copies[s].home - TRACKER_START_BLOCK) * BLOCK_SIZE], b, BLOCK_SIZE);
+				} else if (get_disk_features(fs) & FEATURE_CHECKSUMS) {
+					if (write_checksum(fs, copies[s].home, crc32c(b, BLOCK_SIZE)) != 0) r = -1;
+				}
+			}
+		}
 
-		/** Check filename length **/
-		if ( strnlen(filename, 9) > 8 || strnlen(extension, 4) > 3 ) {
-			printf("cs1550_mknod(): filename or extension for %s too long.\n", path);
-			return -ENAMETOOLONG;
+		/** The headers only go once the copies are safe **/
+		if (r == 0) {
+			sync_disk(fs);
+			memset(zero, 0, BLOCK_SIZE);
+			for (s=0; s<log_segment; s++) {
+				fseek(fs, (LOG_START_BLOCK + (long)s * LOG_SEGMENT_BLOCKS) * BLOCK_SIZE, SEEK_SET);
+				if (fwrite(zero, BLOCK_SIZE, 1, fs) != 1) r = -1;
+			}
+			sync_disk(fs);
 		}
-		/** Check if file creation is happening in root directory **/
-		int in_root = 1;
-		int i = 0;
-		for(i=1;i<strlen(path);i++) if ( path[i] == '/' ) in_root = 0;
-		if (in_root == 1) {
-			printf("cs1550_mknod(): file at path %s being created in root directory.\n", path);
-			return -EPERM;
+		if (r == 0) {
+			memset(log_map, 0xff, MAX_NUM_OF_BLOCKS * sizeof(int32_t));
+			log_segment = 0;
+			log_synced = 0;
+			log_blocks_cleaned += n;
+		}
+		free(run);
+		free(copies);
+		free(log);
+		return r;
+	}
+
+	/*
+	* Puts a copy of block_num in the open segment. A block that is already
+	* there is overwritten in place; a full segment is sealed first and a
+	* full log cleaned.
+	*/
+	static int log_write(FILE *fs, long block_num, const void *buf) {
+		struct cs1550_log_header *h = (struct cs1550_log_header *)log_open;
+		long at = log_map[block_num];
+		long open_base = LOG_START_BLOCK + (long)log_segment * LOG_SEGMENT_BLOCKS;
+
+		if (log_segment < LOG_SEGMENTS && at > open_base && at < open_base + LOG_SEGMENT_BLOCKS) {
+			memcpy(&log_open[(at - open_base) * BLOCK_SIZE], buf, BLOCK_SIZE);
+			log_blocks_absorbed++;
+			return 0;
 		}
+		if (h->nCount == LOG_SEGMENT_BLOCKS - 1 && log_seal(fs) != 0) return -1;
+		if (log_segment == LOG_SEGMENTS && log_clean(fs) != 0) return -1;
+		h->nHome[h->nCount] = block_num;
+		memcpy(&log_open[(h->nCount + 1) * BLOCK_SIZE], buf, BLOCK_SIZE);
+		log_map[block_num] = LOG_START_BLOCK + (long)log_segment * LOG_SEGMENT_BLOCKS + 1 + h->nCount;
+		h->nCount++;
+		return 0;
+	}
+
+	/*
+	* Called at mount. Sets up the log of a FEATURE_LOG disk and copies home
+	* what a crash left in it: the segments from the first on, in sequence,
+	* up to the first one that is not whole.
+	*/
+	static void log_load(FILE *fs) {
+		struct cs1550_log_header h;
+		char buf[BLOCK_SIZE];
+		uint64_t last = 0;
+		uint32_t k;
+		int s;
+
+		free(log_map);
+		log_map = NULL;
+		free(log_open);
+		log_open = NULL;
+		log_segment = 0;
+		log_synced = 0;
+		if (!(get_disk_features(fs) & FEATURE_LOG)) return;
+		log_map = malloc(MAX_NUM_OF_BLOCKS * sizeof(int32_t));
+		memset(log_map, 0xff, MAX_NUM_OF_BLOCKS * sizeof(int32_t));
+		log_open = calloc(LOG_SEGMENT_BLOCKS, BLOCK_SIZE);
+
+		for (s=0; s<LOG_SEGMENTS; s++) {
+			long base = LOG_START_BLOCK + (long)s * LOG_SEGMENT_BLOCKS;
+			fseek(fs, base * BLOCK_SIZE, SEEK_SET);
+			if (fread(&h, BLOCK_SIZE, 1, fs) != 1 || h.nMagic != LOG_MAGIC || h.nCount >= LOG_SEGMENT_BLOCKS) break;
+			if (s > 0 && h.nSeq != last + 1) break;
+			for (k=0; k<h.nCount; k++) {
+				if (!LOG_HOLDS(h.nHome[k]) || h.nHome[k] >= MAX_NUM_OF_BLOCKS || fread(buf, BLOCK_SIZE, 1, fs) != 1 || crc32c(buf, BLOCK_SIZE) != h.nCrc[k]) break;
+			}
+			if (k < h.nCount) break;
+			for (k=0; k<h.nCount; k++) log_map[h.nHome[k]] = base + 1 + k;
+			last = h.nSeq;
+		}
+		log_segment = s;
+		log_seq = last + 1;
+		if (s > 0) {
+			printf("log_load(): copying %i log segments home.\n", s);
+			if (log_clean(fs) != 0) printf("log_load(): could not empty the log.\n");
+		}
+
+		/** Segments past the first bad one must not be found next time **/
+		memset(buf, 0, BLOCK_SIZE);
+		for (; s<LOG_SEGMENTS; s++) {
+			long base = LOG_START_BLOCK + (long)s * LOG_SEGMENT_BLOCKS;
+			fseek(fs, base * BLOCK_SIZE, SEEK_SET);
+			if (fread(&h, BLOCK_SIZE, 1, fs) != 1 || h.nMagic != LOG_MAGIC) continue;
+			fseek(fs, base * BLOCK_SIZE, SEEK_SET);
+			if (fwrite(buf, BLOCK_SIZE, 1, fs) != 1) printf("log_load(): could not clear log segment %i.\n", s);
+			sync_disk(fs);
+		}
+	}
+
+	/*
+	* All reads of root, directory, file and pack blocks go through here so
+	* they can be checked against the checksum table.
+	*/
+	static int read_block(FILE *fs, long block_num, void *buf) {
+		if (block_num < 0 || block_num >= MAX_NUM_OF_BLOCKS) {
+			printf("read_block(): block %li is out of range.\n", block_num);
+			return -1;
+		}
+		//Logged copies have no checksum until they are copied home
+		if (log_map != NULL && LOG_HOLDS(block_num)) {
+			int r = log_read(fs, block_num, buf);
+			if (r != 0) return r < 0 ? -1 : 0;
+		}
+		fseek(fs, block_num * BLOCK_SIZE, SEEK_SET);
+		if (fread(buf, BLOCK_SIZE, 1, fs) != 1) {
+			printf("read_block(): could not read block %li from disk errno: %s\n", block_num, strerror(errno));
+			return -1;
+		}
+		if ((get_disk_features(fs) & FEATURE_CHECKSUMS) && verify_block(fs, block_num, buf) != 0) {
+			__sync_fetch_and_add(&checksum_errors, 1);
+			printf("read_block(): block %li does not match its checksum.\n", block_num);
+			if (options.csum_policy == CSUM_POLICY_FAIL) return -EIO;
+		}
+		return 0;
+	}
+
+	/*
+	* Notes a block as written by the file in sync_target, if there is one.
+	*/
+	static void sync_note(long block_num) {
+		struct cs1550_sync_file *f = sync_target;
+		if (f == NULL || block_num < 0 || block_num >= MAX_NUM_OF_BLOCKS) return;
+		if ((f->dirty[block_num / 8] & (1 << (block_num % 8))) == 0) {
+			f->dirty[block_num / 8] |= 1 << (block_num % 8);
+			f->nDirty++;
+		}
+	}
+
+	/*
+	* Writes blocks [first, first + count) back to the image so they are on
+	* stable storage when this returns. The in-memory image has nowhere
+	* durable to go until it is saved.
+	*/
+	static int sync_blocks(long first, long count) {
+		size_t len = count * BLOCK_SIZE;
+		off64_t pos = (off64_t)first * BLOCK_SIZE;
+		int r = 0;
+
+		if (ram_disk != NULL) return 0;
+		char *buf = malloc(len);
+		if (stripe_count > 0) {
+			if (stripe_io(pos, buf, len, 0) != (ssize_t)len || stripe_io(pos, buf, len, 2) != (ssize_t)len) r = -EIO;
+		} else {
+			struct iovec iov = { buf, len };
+			if (sync_fd < 0) sync_fd = open("./.disk", O_RDWR);
+			if (sync_fd < 0 || pread(sync_fd, buf, len, pos) != (ssize_t)len) r = -EIO;
+			else if (pwritev2(sync_fd, &iov, 1, pos, RWF_DSYNC) != (ssize_t)len) {
+				//Without RWF_DSYNC the best left is syncing the whole image
+				if ((errno != EOPNOTSUPP && errno != ENOSYS) || fdatasync(sync_fd) != 0) r = -EIO;
+			}
+		}
+		if (r != 0) printf("sync_blocks(): could not sync blocks %li-%li. errno: %s\n", first, first + count - 1, strerror(errno));
+		free(buf);
+		return r;
+	}
+
+	/*
+	* Makes the blocks noted for f durable along with its directory block and
+	* the tracker and checksum blocks that cover them, then forgets them.
+	* With the log, the noted blocks are in it, so the open segment is sealed
+	* and the sealed segments synced instead. Called with sync_lock held, and
+	* with fs_lock held for writing when there is a log.
+	*/
+	static int sync_file_flush(struct cs1550_sync_file *f) {
+		struct cs1550_dentry d;
+		long b, run = -1;
+		int r = 0;
+
+		if (f->path == NULL) return 0;
+		FILE *fs = open_disk(log_map != NULL ? "rb+" : "rb");
+		if (fs == NULL) return -EIO;
+		if (log_map != NULL && log_seal(fs) != 0) r = -EIO;
+		unsigned char *want = malloc(sizeof(f->dirty));
+		memcpy(want, f->dirty, sizeof(f->dirty));
+		if (resolve_path(fs, 0, f->path, &d, 0) == 0 && d.parent >= 0) want[d.parent / 8] |= 1 << (d.parent % 8);
+		for (b=0; b<MAX_NUM_OF_BLOCKS; b++) {
+			if ((want[b / 8] & (1 << (b % 8))) == 0 || b >= TRACKER_START_BLOCK) continue;
+			//Those and their tracker blocks are in the log
+			if (log_map != NULL) {
+				want[b / 8] &= ~(1 << (b % 8));
+				continue;
+			}
+			long t = TRACKER_START_BLOCK + b / BLOCK_SIZE;
+			want[t / 8] |= 1 << (t % 8);
+			if (get_disk_features(fs) & FEATURE_CHECKSUMS) {
+				long c = CSUM_START_BLOCK + b * sizeof(uint32_t) / BLOCK_SIZE;
+				want[c / 8] |= 1 << (c % 8);
+			}
+		}
+		for (b=LOG_START_BLOCK + (long)log_synced * LOG_SEGMENT_BLOCKS; log_map != NULL && b<LOG_START_BLOCK + (long)log_segment * LOG_SEGMENT_BLOCKS; b++) want[b / 8] |= 1 << (b % 8);
+
+		/** One durable write per run of consecutive blocks **/
+		for (b=0; b<=MAX_NUM_OF_BLOCKS; b++) {
+			int is_wanted = b < MAX_NUM_OF_BLOCKS && (want[b / 8] & (1 << (b % 8)));
+			if (is_wanted && run < 0) run = b;
+			if (!is_wanted && run >= 0) {
+				if (sync_blocks(run, b - run) != 0) r = -EIO;
+				run = -1;
+			}
+		}
+		free(want);
+		fclose(fs);
+		if (r == 0) {
+			memset(f->dirty, 0, sizeof(f->dirty));
+			f->nDirty = 0;
+			if (log_map != NULL) log_synced = log_segment;
+		}
+		return r;
+	}
+
+	/*
+	* Finds the sync state of path, taking over its slot when create is set.
+	* Called with sync_lock held.
+	*/
+	static struct cs1550_sync_file *sync_file_get(const char *path, int create) {
+		struct cs1550_sync_file *f = &sync_files[path_hash(path) % SYNC_FILES];
+		if (f->path != NULL && strcmp(f->path, path) == 0) return f;
+		if (!create) return NULL;
+		if (f->path != NULL) {
+			if (f->nDirty > 0) sync_file_flush(f);
+			free(f->path);
+		}
+		memset(f, 0, sizeof(struct cs1550_sync_file));
+		f->path = strdup(path);
+		return f;
+	}
+
+	/*
+	* Brackets an operation that changes path, so fsync on it knows which
+	* blocks it wrote. Without create, only a file that already has sync
+	* state is followed. Called with fs_lock held for writing.
+	*/
+	static void sync_begin(const char *path, int create) {
+		pthread_mutex_lock(&sync_lock);
+		sync_target = sync_file_get(path, create);
+		pthread_mutex_unlock(&sync_lock);
+	}
+
+	static void sync_end(void) {
+		sync_target = NULL;
+	}
+
+	/*
+	* Before path is renamed, makes what was noted for it and anything under
+	* it durable and forgets it, since the state is found by path. Called
+	* with fs_lock held for writing.
+	*/
+	static void sync_forget_tree(const char *path) {
+		size_t len = strlen(path);
+		int i;
+
+		pthread_mutex_lock(&sync_lock);
+		for (i=0; i<SYNC_FILES; i++) {
+			struct cs1550_sync_file *f = &sync_files[i];
+			if (f->path == NULL || strncmp(f->path, path, len) != 0 || (f->path[len] != '\0' && f->path[len] != '/')) continue;
+			if (f->nDirty > 0) sync_file_flush(f);
+			free(f->path);
+			memset(f, 0, sizeof(struct cs1550_sync_file));
+		}
+		pthread_mutex_unlock(&sync_lock);
+	}
+
+	static int write_block(FILE *fs, long block_num, const void *buf) {
+		if (block_num < 0 || block_num >= MAX_NUM_OF_BLOCKS) {
+			printf("write_block(): block %li is out of range.\n", block_num);
+			return -1;
+		}
+		if (log_map != NULL && LOG_HOLDS(block_num)) {
+			if (log_write(fs, block_num, buf) != 0) return -1;
+			sync_note(block_num);
+			dir_cache_invalidate(block_num);
+			return 0;
+		}
+		fseek(fs, block_num * BLOCK_SIZE, SEEK_SET);
+		if (fwrite(buf, BLOCK_SIZE, 1, fs) != 1) {
+			printf("write_block(): fwrite() failed to write block %li to disk. errno: %s\n", block_num, strerror(errno));
+			return -1;
+		}
+		sync_note(block_num);
+		dir_cache_invalidate(block_num);
+		if (get_disk_features(fs) & FEATURE_CHECKSUMS) return write_checksum(fs, block_num, crc32c(buf, BLOCK_SIZE));
+		return 0;
+	}
+
+	/*
+	* Copies the SMALL_FILE_SLOT_SIZE bytes of a packed file into out.
+	*/
+	static int read_pack_slot(FILE *fs, long ref, char *out) {
+		cs1550_pack_block pack;
+		long block_num = PACKED_REF_BLOCK(ref);
+
+		if (read_block(fs, block_num, &pack) != 0) {
+			printf("read_pack_slot(): could not read pack block %li from disk.\n", block_num);
+			return -1;
+		}
+		memcpy(out, pack.slots[PACKED_REF_SLOT(ref)], SMALL_FILE_SLOT_SIZE);
+		return 0;
+	}
+
+	static int write_pack_slot(FILE *fs, long ref, const char *data) {
+		cs1550_pack_block pack;
+		long block_num = PACKED_REF_BLOCK(ref);
+
+		if (read_block(fs, block_num, &pack) != 0) {
+			printf("write_pack_slot(): could not read pack block %li from disk.\n", block_num);
+			return -1;
+		}
+		pack.nSlotMap |= 1L << PACKED_REF_SLOT(ref);
+		memcpy(pack.slots[PACKED_REF_SLOT(ref)], data, SMALL_FILE_SLOT_SIZE);
+		if (write_block(fs, block_num, &pack) != 0) {
+			printf("write_pack_slot(): fwrite() failed to write pack block %li to disk.\n", block_num);
+			return -1;
+		}
+		return 0;
+	}
+
+	static void pack_room_set(long block_num, int room) {
+		if (pack_room == NULL) return;
+		if (room) pack_room[block_num / 8] |= 1 << (block_num % 8);
+		else pack_room[block_num / 8] &= ~(1 << (block_num % 8));
+	}
+
+	/*
+	* Places a small file's data in a free slot of the current pack block,
+	* or of any other pack block with one, starting a new pack block when
+	* there is none. Returns the packed reference to store in nStartBlock,
+	* or NO_BLOCK if the disk is full.
+	*/
+	static long store_in_pack(FILE *fs, const char *data) {
+		cs1550_superblock sb;
+		cs1550_pack_block pack;
+		long b, block_num;
+		int slot;
+
+		read_superblock(fs, &sb);
+		if (pack_room == NULL) pack_room_load(fs);
+		block_num = sb.nPackBlock;
+		while (block_num != NO_BLOCK) {
+			if (read_block(fs, block_num, &pack) != 0) {
+				printf("store_in_pack(): could not read pack block %li from disk.\n", block_num);
+				return NO_BLOCK;
+			}
+			for (slot=0; slot<SLOTS_PER_PACK_BLOCK; slot++) {
+				if ((pack.nSlotMap & (1L << slot)) == 0) break;
+			}
+			if (slot < SLOTS_PER_PACK_BLOCK) {
+				long ref = PACKED_REF(block_num, slot);
+				if (write_pack_slot(fs, ref, data) != 0) return NO_BLOCK;
+				pack_room_set(block_num, (pack.nSlotMap | (1L << slot)) != PACK_BLOCK_FULL);
+				return ref;
+			}
+
+			/** That one is full; try the first other pack block with room **/
+			pack_room_set(block_num, 0);
+			block_num = NO_BLOCK;
+			for (b=0; b<MAX_NUM_OF_BLOCKS; b+=8) {
+				if (pack_room[b / 8] == 0) continue;
+				for (block_num=b; (pack_room[block_num / 8] & (1 << (block_num % 8))) == 0; block_num++);
+				break;
+			}
+		}
+
+		/** No pack block has a free slot. Start a new one. **/
+		int new_block = find_data_block(fs);
+		if (new_block < 0) return NO_BLOCK;
+		set_block_allocated(fs, new_block);
+		memset(&pack, 0, sizeof(cs1550_pack_block));
+		pack.nSlotMap = 1;
+		memcpy(pack.slots[0], data, SMALL_FILE_SLOT_SIZE);
+		if (write_block(fs, new_block, &pack) != 0) {
+			printf("store_in_pack(): fwrite() failed to write pack block %i to disk.\n", new_block);
+			set_block_free(fs, new_block);
+			return NO_BLOCK;
+		}
+		printf("store_in_pack(): started new pack block %i\n", new_block);
+		pack_room_set(new_block, 1);
+		sb.nPackBlock = new_block;
+		write_superblock(fs, &sb);
+		return PACKED_REF(new_block, 0);
+	}
+
+	/*
+	* Frees a packed file's slot. A pack block that empties out is returned to
+	* the free space tracker unless new small files are still going into it.
+	*/
+	static void release_pack_slot(FILE *fs, long ref) {
+		cs1550_superblock sb;
+		cs1550_pack_block pack;
+		long block_num = PACKED_REF_BLOCK(ref);
+
+		if (read_block(fs, block_num, &pack) != 0) {
+			printf("release_pack_slot(): could not read pack block %li from disk.\n", block_num);
+			return;
+		}
+		pack.nSlotMap &= ~(1L << PACKED_REF_SLOT(ref));
+		memset(pack.slots[PACKED_REF_SLOT(ref)], 0, SMALL_FILE_SLOT_SIZE);
+		if (write_block(fs, block_num, &pack) != 0) printf("release_pack_slot(): fwrite() failed to write pack block %li to disk.\n", block_num);
+
+		read_superblock(fs, &sb);
+		if (pack.nSlotMap == 0 && sb.nPackBlock != block_num) {
+			set_block_free(fs, (int)block_num);
+			pack_room_set(block_num, 0);
+		} else pack_room_set(block_num, 1);
+	}
+
+	static unsigned int path_hash(const char *path) {
+		unsigned int h = 5381;
+		while (*path) h = h * 33 + (unsigned char)*path++;
+		return h;
+	}
+
+	static unsigned int attr_cache_slot(const char *path) {
+		return path_hash(path) % ATTR_CACHE_SLOTS;
+	}
+
+	/*
+	* Returns 0 and fills stbuf if path has an unexpired cached stat.
+	*/
+	static int attr_cache_lookup(const char *path, struct stat *stbuf) {
+		int r = -1;
+		if (options.attr_timeout <= 0 || strlen(path) >= ATTR_CACHE_PATH_MAX) return r;
+
+		struct cs1550_attr_cache_entry *e = &attr_cache[attr_cache_slot(path)];
+		pthread_mutex_lock(&attr_cache_lock);
+		if (strcmp(e->path, path) == 0 && e->expires > time(NULL)) {
+			memcpy(stbuf, &e->st, sizeof(struct stat));
+			r = 0;
+		}
+		pthread_mutex_unlock(&attr_cache_lock);
+		return r;
+	}
+
+	static void attr_cache_store(const char *path, const struct stat *stbuf) {
+		if (options.attr_timeout <= 0 || strlen(path) >= ATTR_CACHE_PATH_MAX) return;
+
+		struct cs1550_attr_cache_entry *e = &attr_cache[attr_cache_slot(path)];
+		pthread_mutex_lock(&attr_cache_lock);
+		strcpy(e->path, path);
+		memcpy(&e->st, stbuf, sizeof(struct stat));
+		e->expires = time(NULL) + options.attr_timeout;
+		pthread_mutex_unlock(&attr_cache_lock);
+	}
+
+	/*
+	* Must be called by anything that changes what getattr would return.
+	*/
+	static void attr_cache_invalidate(const char *path) {
+		if (strlen(path) >= ATTR_CACHE_PATH_MAX) return;
+
+		struct cs1550_attr_cache_entry *e = &attr_cache[attr_cache_slot(path)];
+		pthread_mutex_lock(&attr_cache_lock);
+		if (strcmp(e->path, path) == 0) e->path[0] = '\0';
+		pthread_mutex_unlock(&attr_cache_lock);
+	}
+
+	/*
+	* Drops every cached entry, for changes that affect many paths at once.
+	*/
+	static void attr_cache_clear(void) {
+		int i;
+		pthread_mutex_lock(&attr_cache_lock);
+		for (i=0; i<ATTR_CACHE_SLOTS; i++) attr_cache[i].path[0] = '\0';
+		pthread_mutex_unlock(&attr_cache_lock);
+	}
+
+	/*
+	* Returns every block of a nNextBlock chain to the free space tracker.
+	*/
+	static void free_chain(FILE *fs, long start_block) {
+		cs1550_disk_block block;
+		long b = start_block;
+		while (b >= 0 && read_block(fs, b, &block) == 0) {
+			if (block_unref(fs, b) > 0) break; // another chain still owns the rest
+			b = block.nNextBlock;
+		}
+	}
+
+	/*
+	* Reference counts live in the free space tracker. They are read from
+	* memory, and a change writes only the one byte it needs to disk, or with
+	* the log its whole tracker block to the log.
+	*/
+	static int block_refcount(FILE *fs, long block_num) {
+		cs1550_free_space_tracker *tracker = get_tracker(fs);
+		if (tracker == NULL) return -1;
+		return tracker->data[block_num];
+	}
+
+	static int set_block_refcount(FILE *fs, long block_num, int count) {
+		cs1550_free_space_tracker *tracker = get_tracker(fs);
+		unsigned char c = count;
+		if (tracker == NULL) return -1;
+		if (log_map != NULL) {
+			//The whole tracker block goes to the log
+			unsigned char blk[BLOCK_SIZE];
+			memcpy(blk, &tracker->data[block_num - block_num % BLOCK_SIZE], BLOCK_SIZE);
+			blk[block_num % BLOCK_SIZE] = c;
+			if (write_block(fs, TRACKER_START_BLOCK + block_num / BLOCK_SIZE, blk) != 0) return -1;
+		} else {
+			fseek(fs, TRACKER_START_BLOCK * BLOCK_SIZE + block_num, SEEK_SET);
+			if (fwrite(&c, 1, 1, fs) != 1) {
+				printf("set_block_refcount(): fwrite() failed to write refcount of block %li to disk.\n", block_num);
+				return -1;
+			}
+		}
+		if (tracker->data[block_num] == 0 && c != 0) note_free_blocks(-1);
+		if (tracker->data[block_num] != 0 && c == 0) note_free_blocks(1);
+		if (shared_blocks >= 0 && tracker->data[block_num] <= 1 && c > 1) shared_blocks++;
+		if (shared_blocks >= 0 && tracker->data[block_num] > 1 && c <= 1) shared_blocks--;
+		if (c < tracker->data[block_num]) chain_generation++;
+		tracker->data[block_num] = c;
+		return 0;
+	}
+
+	static int block_ref(FILE *fs, long block_num) {
+		int count = block_refcount(fs, block_num);
+		if (count < 0 || count >= MAX_BLOCK_REFS) return -1;
+		if (set_block_refcount(fs, block_num, count + 1) != 0) return -1;
+		return count + 1;
+	}
+
+	/*
+	* Drops one reference to a block and returns how many are left. The block
+	* is free once that reaches 0.
+	*/
+	static int block_unref(FILE *fs, long block_num) {
+		int count = block_refcount(fs, block_num);
+		if (count <= 0) return 0;
+		if (set_block_refcount(fs, block_num, count - 1) != 0) return count;
+		if (count == 1) {
+			dedup_index_remove(block_num);
+			printf("block_unref(): block %li released.\n", block_num);
+		}
+		return count - 1;
+	}
+
+	/*
+	* Returns how many blocks are unallocated. The tracker is only counted
+	* the first time; after that the count is kept as blocks change hands.
+	*/
+	static long count_free_blocks(FILE *fs) {
+		if (free_blocks < 0) {
+			cs1550_free_space_tracker *tracker = get_tracker(fs);
+			long n = 0;
+			int i;
+			if (tracker == NULL) return 0;
+			for (i=0; i<MAX_NUM_OF_BLOCKS; i++) {
+				if (tracker->data[i] == 0) n++;
+			}
+			free_blocks = n;
+		}
+		return free_blocks;
+	}
+
+	static void note_free_blocks(long delta) {
+		if (free_blocks >= 0) free_blocks += delta;
+	}
+
+	/*
+	* Splits a path component into the 8.3 fname and fext of a directory
+	* entry, at its first '.'.
+	*/
+	static int split_name(const char *name, char *fname, char *fext) {
+		size_t len = strcspn(name, ".");
+
+		if (len == 0) return -EINVAL;
+		if (len > MAX_FILENAME) return -ENAMETOOLONG;
+		memcpy(fname, name, len);
+		fname[len] = '\0';
+		if (name[len] == '\0') {
+			fext[0] = '\0';
+			return 0;
+		}
+		if (strlen(&name[len + 1]) > MAX_EXTENSION) return -ENAMETOOLONG;
+		strcpy(fext, &name[len + 1]);
+		return 0;
+	}
+
+	/*
+	* Splits path into the path of its directory and its last component.
+	*/
+	static int split_path(const char *path, char *parent, char *name) {
+		const char *slash = strrchr(path, '/');
+
+		if (slash == NULL || slash[1] == '\0') return -EINVAL;
+		if (strlen(&slash[1]) > MAX_NAME_LEN) return -ENAMETOOLONG;
+		if (slash == path) strcpy(parent, "/");
+		else {
+			if ((size_t)(slash - path) >= PATH_MAX) return -ENAMETOOLONG;
+			memcpy(parent, path, slash - path);
+			parent[slash - path] = '\0';
+		}
+		strcpy(name, &slash[1]);
+		return 0;
+	}
+
+	static uint32_t name_hash(const char *name, size_t len) {
+		uint32_t h = 2166136261u;
+		size_t i;
+		for (i=0; i<len; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+		return h;
+	}
+
+	static void dir_slot_set(cs1550_dir *dir, int index, const char *name, size_t len, uint32_t hash, size_t fsize, long start_block) {
+		struct cs1550_dir_slot *slot = &dir->files[index];
+
+		memcpy(&dir->names[dir->nNamesUsed], name, len);
+		slot->nNameOff = dir->nNamesUsed;
+		slot->nNameLen = len;
+		slot->nHash = hash >> 24;
+		slot->fsize = fsize;
+		slot->nStartBlock = start_block;
+		dir->nNamesUsed += len;
+		dir->nBloom |= 1ULL << (hash % 64);
+		dir->nFiles++;
+	}
+
+	static struct cs1550_dir_cache_entry *dir_cache_slot(long block_num) {
+		return &dir_cache[block_num == 0 ? 0 : 1 + block_num % (DIR_CACHE_SLOTS - 1)];
+	}
+
+	static int dir_cache_lookup(long block_num, int is_root, cs1550_dir *dir) {
+		int hit = 0;
+		if (dir_cache == NULL) return 0;
+		pthread_mutex_lock(&dir_cache_lock);
+		struct cs1550_dir_cache_entry *e = dir_cache_slot(block_num);
+		if (e->block == block_num && e->is_root == is_root) {
+			memcpy(dir, &e->dir, sizeof(cs1550_dir));
+			hit = 1;
+		}
+		pthread_mutex_unlock(&dir_cache_lock);
+		return hit;
+	}
+
+	static void dir_cache_store(long block_num, int is_root, const cs1550_dir *dir) {
+		if (dir_cache == NULL) return;
+		pthread_mutex_lock(&dir_cache_lock);
+		struct cs1550_dir_cache_entry *e = dir_cache_slot(block_num);
+		e->block = block_num;
+		e->is_root = is_root;
+		memcpy(&e->dir, dir, sizeof(cs1550_dir));
+		pthread_mutex_unlock(&dir_cache_lock);
+	}
+
+	/*
+	* Called for every block written, since it may have held a directory.
+	*/
+	static void dir_cache_invalidate(long block_num) {
+		if (dir_cache == NULL) return;
+		pthread_mutex_lock(&dir_cache_lock);
+		struct cs1550_dir_cache_entry *e = dir_cache_slot(block_num);
+		if (e->block == block_num) e->block = -1;
+		pthread_mutex_unlock(&dir_cache_lock);
+	}
+
+	static void dir_cache_clear(void) {
+		int i;
+		if (dir_cache == NULL) return;
+		pthread_mutex_lock(&dir_cache_lock);
+		for (i=0; i<DIR_CACHE_SLOTS; i++) dir_cache[i].block = -1;
+		pthread_mutex_unlock(&dir_cache_lock);
+	}
+
+	/*
+	* Decodes a directory block read from disk into dir, in whichever format
+	* the disk uses. is_root says it is a root directory, which only
+	* matters to 8.3 disks. Top level directories come out with fsize
+	* SUBDIR_SIZE like any other directory.
+	*/
+	static int decode_dir(FILE *fs, const char *buf, int is_root, cs1550_dir *dir) {
+		char name[MAX_FILENAME + 1 + MAX_EXTENSION];
+		int i;
+
+		memset(dir, 0, offsetof(cs1550_dir, names));
+		if (get_disk_features(fs) & FEATURE_LONG_NAMES) {
+			struct cs1550_name_directory *nd = (struct cs1550_name_directory *)buf;
+			struct cs1550_name_record rec;
+			size_t off = 0;
+
+			if (nd->nRecords > MAX_DIR_SLOTS || nd->nBytes > sizeof(nd->records)) return -EIO;
+			for (i=0; i<nd->nRecords; i++) {
+				if (off + sizeof(rec) > nd->nBytes) return -EIO;
+				memcpy(&rec, &nd->records[off], sizeof(rec));
+				if (rec.nNameLen == 0 || off + NAME_RECORD_SIZE(rec.nNameLen) > nd->nBytes) return -EIO;
+				dir_slot_set(dir, i, &nd->records[off + sizeof(rec)], rec.nNameLen, (uint32_t)rec.nHash << 24, rec.fsize, rec.nStartBlock);
+				off += NAME_RECORD_SIZE(rec.nNameLen);
+			}
+			dir->nBloom = nd->nBloom;
+			dir->nXattrBlock = nd->nXattrBlock;
+		} else if (is_root) {
+			cs1550_root_directory *root = (cs1550_root_directory *)buf;
+			dir->nXattrBlock = root->nXattrBlock;
+			for (i=0; i<MAX_DIRS_IN_ROOT; i++) {
+				size_t len = strnlen(root->directories[i].dname, MAX_FILENAME);
+				if (len == 0) continue;
+				dir_slot_set(dir, i, root->directories[i].dname, len, name_hash(root->directories[i].dname, len), SUBDIR_SIZE, root->directories[i].nStartBlock);
+			}
+		} else {
+			cs1550_directory_entry *entries = (cs1550_directory_entry *)buf;
+			dir->nXattrBlock = entries->nXattrBlock;
+			for (i=0; i<MAX_FILES_IN_DIR; i++) {
+				size_t len = strnlen(entries->files[i].fname, MAX_FILENAME);
+				size_t ext = strnlen(entries->files[i].fext, MAX_EXTENSION);
+				if (len == 0) continue;
+				memcpy(name, entries->files[i].fname, len);
+				if (ext > 0) {
+					name[len++] = '.';
+					memcpy(&name[len], entries->files[i].fext, ext);
+					len += ext;
+				}
+				dir_slot_set(dir, i, name, len, name_hash(name, len), entries->files[i].fsize, entries->files[i].nStartBlock);
+			}
+		}
+		return 0;
+	}
+
+	/*
+	* Reads the directory at block_num into dir, from the cache when it has
+	* been read before.
+	*/
+	static int load_dir(FILE *fs, long block_num, int is_root, cs1550_dir *dir) {
+		char buf[BLOCK_SIZE];
+
+		if (dir_cache_lookup(block_num, is_root, dir)) return 0;
+		if (read_block(fs, block_num, buf) != 0) {
+			memset(dir, 0, offsetof(cs1550_dir, names));
+			return -EIO;
+		}
+		int r = decode_dir(fs, buf, is_root, dir);
+		if (r == 0) dir_cache_store(block_num, is_root, dir);
+		return r;
+	}
+
+	/*
+	* Writes dir back to the directory block at block_num. Returns -ENOSPC
+	* if its entries no longer fit in a block. On a long name disk the
+	* records are written in slot order without the unused slots, so slots
+	* only stay put while no entry is removed.
+	*/
+	static int store_dir(FILE *fs, long block_num, int is_root, const cs1550_dir *dir) {
+		char buf[BLOCK_SIZE];
+		char name[MAX_NAME_LEN + 1];
+		int i, n = 0;
+
+		memset(buf, 0, BLOCK_SIZE);
+		if (get_disk_features(fs) & FEATURE_LONG_NAMES) {
+			struct cs1550_name_directory *nd = (struct cs1550_name_directory *)buf;
+			struct cs1550_name_record rec;
+			size_t off = 0;
+
+			for (i=0; i<MAX_DIR_SLOTS; i++) {
+				const struct cs1550_dir_slot *slot = &dir->files[i];
+				if (slot->nNameLen == 0) continue;
+				if (off + NAME_RECORD_SIZE(slot->nNameLen) > sizeof(nd->records)) return -ENOSPC;
+				uint32_t h = name_hash(&dir->names[slot->nNameOff], slot->nNameLen);
+				rec.nNameLen = slot->nNameLen;
+				rec.nHash = h >> 24;
+				rec.fsize = slot->fsize;
+				rec.nStartBlock = slot->nStartBlock;
+				memcpy(&nd->records[off], &rec, sizeof(rec));
+				memcpy(&nd->records[off + sizeof(rec)], &dir->names[slot->nNameOff], slot->nNameLen);
+				off += NAME_RECORD_SIZE(slot->nNameLen);
+				nd->nBloom |= 1ULL << (h % 64);
+				n++;
+			}
+			nd->nRecords = n;
+			nd->nBytes = off;
+			nd->nXattrBlock = dir->nXattrBlock;
+		} else if (is_root) {
+			cs1550_root_directory *root = (cs1550_root_directory *)buf;
+			for (i=0; i<MAX_DIR_SLOTS; i++) {
+				if (dir->files[i].nNameLen == 0) continue;
+				if (i >= (int)MAX_DIRS_IN_ROOT || dir->files[i].nNameLen > MAX_FILENAME) return -ENOSPC;
+				memcpy(root->directories[i].dname, &dir->names[dir->files[i].nNameOff], dir->files[i].nNameLen);
+				root->directories[i].nStartBlock = dir->files[i].nStartBlock;
+				n++;
+			}
+			root->nDirectories = n;
+			root->nXattrBlock = dir->nXattrBlock;
+		} else {
+			cs1550_directory_entry *entries = (cs1550_directory_entry *)buf;
+			for (i=0; i<MAX_DIR_SLOTS; i++) {
+				if (dir->files[i].nNameLen == 0) continue;
+				if (i >= (int)MAX_FILES_IN_DIR) return -ENOSPC;
+				dir_entry_name(dir, i, name);
+				if (split_name(name, entries->files[i].fname, entries->files[i].fext) != 0) return -ENOSPC;
+				entries->files[i].fsize = dir->files[i].fsize;
+				entries->files[i].nStartBlock = dir->files[i].nStartBlock;
+				n++;
+			}
+			entries->nFiles = n;
+			entries->nXattrBlock = dir->nXattrBlock;
+		}
+		if (write_block(fs, block_num, buf) != 0) return -EIO;
+
+		//Cache what reading it back would give, as long name slots are compacted
+		if (dir_cache != NULL) {
+			cs1550_dir *stored = malloc(sizeof(cs1550_dir));
+			if (decode_dir(fs, buf, is_root, stored) == 0) dir_cache_store(block_num, is_root, stored);
+			free(stored);
+		}
+		return 0;
+	}
+
+	/*
+	* Returns the slot of the entry called name in dir, or -1.
+	*/
+	static int dir_find(const cs1550_dir *dir, const char *name) {
+		size_t len = strlen(name);
+		uint32_t h = name_hash(name, len);
+		int i;
+
+		if (len == 0 || len > MAX_NAME_LEN || !(dir->nBloom & (1ULL << (h % 64)))) return -1;
+		for (i=0; i<MAX_DIR_SLOTS; i++) {
+			const struct cs1550_dir_slot *slot = &dir->files[i];
+			if (slot->nNameLen != len || slot->nHash != (h >> 24)) continue;
+			if (memcmp(&dir->names[slot->nNameOff], name, len) == 0) return i;
+		}
+		return -1;
+	}
+
+	/*
+	* Adds an entry to dir and returns its slot, or a negative errno if the
+	* name is not allowed on this disk or there is no room for it.
+	*/
+	static int dir_add(FILE *fs, cs1550_dir *dir, int is_root, const char *name, size_t fsize, long start_block) {
+		char fname[MAX_FILENAME + 1], fext[MAX_EXTENSION + 1];
+		size_t len = strlen(name);
+		int slots, i;
+
+		if (len == 0) return -EINVAL;
+		if (len > MAX_NAME_LEN) return -ENAMETOOLONG;
+		if (get_disk_features(fs) & FEATURE_LONG_NAMES) {
+			size_t used = 0;
+			for (i=0; i<MAX_DIR_SLOTS; i++) {
+				if (dir->files[i].nNameLen != 0) used += NAME_RECORD_SIZE(dir->files[i].nNameLen);
+			}
+			if (used + NAME_RECORD_SIZE(len) > sizeof(((struct cs1550_name_directory *)0)->records)) return -ENOSPC;
+			slots = MAX_DIR_SLOTS;
+		} else if (is_root) {
+			if (len > MAX_FILENAME) return -ENAMETOOLONG;
+			slots = MAX_DIRS_IN_ROOT;
+		} else {
+			int r = split_name(name, fname, fext);
+			if (r != 0) return r;
+			slots = MAX_FILES_IN_DIR;
+		}
+		for (i=0; i<slots; i++) {
+			if (dir->files[i].nNameLen == 0) break;
+		}
+		if (i == slots || dir->nNamesUsed + len > sizeof(dir->names)) return -ENOSPC;
+		dir_slot_set(dir, i, name, len, name_hash(name, len), fsize, start_block);
+		return i;
+	}
+
+	/*
+	* Writes the name of the entry in slot index of dir, nul terminated.
+	*/
+	static void dir_entry_name(const cs1550_dir *dir, int index, char *out) {
+		memcpy(out, &dir->names[dir->files[index].nNameOff], dir->files[index].nNameLen);
+		out[dir->files[index].nNameLen] = '\0';
+	}
+
+	static unsigned int dentry_cache_slot(long parent, const char *name) {
+		return (path_hash(name) ^ (unsigned int)parent * 2654435761u) % DENTRY_CACHE_SLOTS;
+	}
+
+	static int dentry_cache_lookup(long parent, const char *name, int *kind, int *index, long *block) {
+		int r = -1;
+		pthread_mutex_lock(&dentry_cache_lock);
+		struct cs1550_dentry_cache_entry *e = &dentry_cache[dentry_cache_slot(parent, name)];
+		if (e->generation == dentry_generation && e->parent == parent && strcmp(e->name, name) == 0) {
+			*kind = e->kind;
+			*index = e->index;
+			*block = e->block;
+			r = 0;
+		}
+		pthread_mutex_unlock(&dentry_cache_lock);
+		return r;
+	}
+
+	static void dentry_cache_store(long parent, const char *name, int kind, int index, long block) {
+		pthread_mutex_lock(&dentry_cache_lock);
+		struct cs1550_dentry_cache_entry *e = &dentry_cache[dentry_cache_slot(parent, name)];
+		e->generation = dentry_generation;
+		e->parent = parent;
+		strcpy(e->name, name);
+		e->kind = kind;
+		e->index = index;
+		e->block = block;
+		pthread_mutex_unlock(&dentry_cache_lock);
+	}
+
+	static void dentry_cache_invalidate(long parent, const char *name) {
+		if (strlen(name) > MAX_NAME_LEN) return;
+		pthread_mutex_lock(&dentry_cache_lock);
+		struct cs1550_dentry_cache_entry *e = &dentry_cache[dentry_cache_slot(parent, name)];
+		if (e->parent == parent && strcmp(e->name, name) == 0) e->generation = 0;
+		pthread_mutex_unlock(&dentry_cache_lock);
+	}
+
+	static void dentry_cache_clear(void) {
+		pthread_mutex_lock(&dentry_cache_lock);
+		dentry_generation++;
+		pthread_mutex_unlock(&dentry_cache_lock);
+	}
+
+	/*
+	* Looks name up in the directory at block parent, the root directory
+	* if parent_is_root. With for_write a directory that is found is first
+	* unshared from any snapshot, since the caller is about to change it.
+	*/
+	static int lookup_name(FILE *fs, long parent, int parent_is_root, const char *name, struct cs1550_dentry *d, int for_write) {
+		cs1550_dir dir;
+		int kind, index = -1, have_dir = 0;
+		long block = -1;
+
+		if (dentry_cache_lookup(parent, name, &kind, &index, &block) != 0) {
+			if (load_dir(fs, parent, parent_is_root, &dir) != 0) return -EIO;
+			have_dir = 1;
+			index = dir_find(&dir, name);
+			kind = DENTRY_NEGATIVE;
+			if (index >= 0) {
+				kind = IS_SUBDIR(dir.files[index]) ? DENTRY_DIR : DENTRY_FILE;
+				block = dir.files[index].nStartBlock;
+			}
+			dentry_cache_store(parent, name, kind, index, block);
+		}
+		if (kind == DENTRY_NEGATIVE) return -ENOENT;
+
+		d->is_dir = kind == DENTRY_DIR;
+		d->block = block;
+		d->parent = parent;
+		d->parent_is_root = parent_is_root;
+		d->index = index;
+		d->size = 0;
+		if (kind == DENTRY_FILE) {
+			/** A file's size and first block change on every write, so
+			only its slot is cached **/
+			if (!have_dir && load_dir(fs, parent, parent_is_root, &dir) != 0) return -EIO;
+			d->block = dir.files[index].nStartBlock;
+			d->size = dir.files[index].fsize;
+		} else if (for_write && block_refcount(fs, block) > 1) {
+			long copy = unshare_directory(fs, parent, parent_is_root, index);
+			if (copy < 0) return (int)copy;
+			d->block = copy;
+		}
+		return 0;
+	}
+
+	/*
+	* Resolves path one component at a time, starting at the root directory
+	* at root_block. With for_write every directory along the way is
+	* unshared from any snapshot, top down, so the caller may change the
+	* last one.
+	*/
+	static int resolve_path(FILE *fs, long root_block, const char *path, struct cs1550_dentry *d, int for_write) {
+		char name[MAX_NAME_LEN + 1];
+		int depth = 0;
+
+		memset(d, 0, sizeof(struct cs1550_dentry));
+		d->is_dir = 1;
+		d->block = root_block;
+		d->parent = -1;
+		d->index = -1;
+		while (*path == '/') path++;
+		while (*path != '\0') {
+			size_t len = strcspn(path, "/");
+			if (!d->is_dir) return -ENOTDIR;
+			if (len > MAX_NAME_LEN) return -ENAMETOOLONG;
+			memcpy(name, path, len);
+			name[len] = '\0';
+			int r = lookup_name(fs, d->block, depth == 0, name, d, for_write);
+			if (r != 0) return r;
+			path += len;
+			while (*path == '/') path++;
+			depth++;
+		}
+		return 0;
+	}
+
+	/*
+	* Finds the directory entry of the file at path. On success dir holds its
+	* directory block and 0 is returned.
+	*/
+	static int find_file_entry(FILE *fs, const char *path, cs1550_dir *dir, long *dir_location, int *file_index) {
+		struct cs1550_dentry d;
+		int r = resolve_path(fs, 0, path, &d, 0);
+
+		if (r != 0) return r;
+		if (d.is_dir) return -EISDIR;
+		*dir_location = d.parent;
+		*file_index = d.index;
+		return load_dir(fs, *dir_location, 0, dir) == 0 ? 0 : -EIO;
+	}
+
+	/*
+	* Gives fi a handle for the file at path, if it is a file outside the
+	* snapshots and a handle is free.
+	*/
+	static void handle_open(FILE *fs, const char *path, struct fuse_file_info *fi) {
+		struct cs1550_dentry d;
+		int i;
+
+		fi->fh = 0;
+		if (resolve_path(fs, 0, path, &d, 0) != 0 || d.is_dir) return;
+		pthread_mutex_lock(&handle_lock);
+		for (i=0; i<MAX_HANDLES && handles[i].used; i++);
+		if (i < MAX_HANDLES) {
+			memset(&handles[i], 0, sizeof(struct cs1550_handle));
+			handles[i].used = 1;
+			handles[i].pos_index = -1;
+			fi->fh = i + 1;
+		}
+		pthread_mutex_unlock(&handle_lock);
+		handle_note(fi, &d, 0);
+	}
+
+	static void handle_close(struct fuse_file_info *fi) {
+		if (fi == NULL || fi->fh == 0 || fi->fh > MAX_HANDLES) return;
+		pthread_mutex_lock(&handle_lock);
+		handles[fi->fh - 1].used = 0;
+		pthread_mutex_unlock(&handle_lock);
+		fi->fh = 0;
+	}
+
+	static struct cs1550_handle *handle_of(struct fuse_file_info *fi) {
+		if (fi == NULL || fi->fh == 0 || fi->fh > MAX_HANDLES || !handles[fi->fh - 1].used) return NULL;
+		return &handles[fi->fh - 1];
+	}
+
+	/*
+	* Points the handle of fi at the entry path was just looked up to, with
+	* unshared set if the lookup was for a write.
+	*/
+	static void handle_note(struct fuse_file_info *fi, const struct cs1550_dentry *d, int unshared) {
+		pthread_mutex_lock(&handle_lock);
+		struct cs1550_handle *h = handle_of(fi);
+		if (h != NULL) {
+			pthread_mutex_lock(&dentry_cache_lock);
+			h->generation = dentry_generation;
+			pthread_mutex_unlock(&dentry_cache_lock);
+			h->unshared = unshared;
+			h->parent = d->parent;
+			h->index = d->index;
+			h->size = d->size;
+		}
+		pthread_mutex_unlock(&handle_lock);
+	}
+
+	/*
+	* Fills d with the entry of the file the handle of fi is for, reading
+	* only its directory block. For a write while blocks are shared, the
+	* directory must have been unshared by an earlier write and still have
+	* no other owner. Returns -1 if the path has to be looked up.
+	*/
+	static int handle_find(FILE *fs, struct fuse_file_info *fi, const char *path, struct cs1550_dentry *d, int for_write) {
+		const char *name = strrchr(path, '/');
+		unsigned long generation;
+		cs1550_dir dir;
+		long parent;
+		int index, unshared;
+
+		pthread_mutex_lock(&handle_lock);
+		struct cs1550_handle *h = handle_of(fi);
+		if (h == NULL) {
+			pthread_mutex_unlock(&handle_lock);
+			return -1;
+		}
+		generation = h->generation;
+		parent = h->parent;
+		index = h->index;
+		unshared = h->unshared;
+		pthread_mutex_unlock(&handle_lock);
+
+		pthread_mutex_lock(&dentry_cache_lock);
+		int stale = generation != dentry_generation;
+		pthread_mutex_unlock(&dentry_cache_lock);
+		if (stale || name == NULL || parent < 0) return -1;
+		if (for_write && have_shared_blocks(fs) && (!unshared || block_refcount(fs, parent) > 1)) return -1;
+		if (load_dir(fs, parent, 0, &dir) != 0) return -1;
+		name++;
+		struct cs1550_dir_slot *slot = &dir.files[index];
+		if (slot->nNameLen != strlen(name) || IS_SUBDIR(*slot) || memcmp(&dir.names[slot->nNameOff], name, slot->nNameLen) != 0) return -1;
+
+		memset(d, 0, sizeof(struct cs1550_dentry));
+		d->block = slot->nStartBlock;
+		d->parent = parent;
+		d->index = index;
+		d->size = slot->fsize;
+		__sync_fetch_and_add(&handle_hits, 1);
+		return 0;
+	}
+
+	/*
+	* Gets the block of the chain starting at start_block where the last
+	* access through fi ended, if the chain cannot have changed since.
+	*/
+	static int handle_position(struct fuse_file_info *fi, long start_block, long *pos_index, long *pos_block) {
+		int r = -1;
+		pthread_mutex_lock(&handle_lock);
+		struct cs1550_handle *h = handle_of(fi);
+		if (h != NULL && h->pos_index >= 0 && h->start_block == start_block && h->chain_generation == chain_generation) {
+			*pos_index = h->pos_index;
+			*pos_block = h->pos_block;
+			r = 0;
+		}
+		pthread_mutex_unlock(&handle_lock);
+		if (r == 0) __sync_fetch_and_add(&handle_position_hits, 1);
+		return r;
+	}
+
+	static void handle_set_position(struct fuse_file_info *fi, long start_block, long pos_index, long pos_block) {
+		pthread_mutex_lock(&handle_lock);
+		struct cs1550_handle *h = handle_of(fi);
+		if (h != NULL) {
+			h->start_block = start_block;
+			h->chain_generation = chain_generation;
+			h->pos_index = pos_index;
+			h->pos_block = pos_block;
+		}
+		pthread_mutex_unlock(&handle_lock);
+	}
+
+	/*
+	* Calls fn for every file below the directory at dir_location, with
+	* its path. path holds the directory's path, path_len long.
+	*/
+	static void walk_directory(FILE *fs, long dir_location, char *path, size_t path_len, int depth, void (*fn)(FILE *, const char *, long, int, struct cs1550_dir_slot *, void *), void *arg) {
+		cs1550_dir dir;
+		char name[MAX_NAME_LEN + 1];
+		int i;
+
+		if (depth > MAX_DIR_DEPTH || load_dir(fs, dir_location, 0, &dir) != 0) return;
+		for (i=0; i<MAX_DIR_SLOTS; i++) {
+			if (dir.files[i].nNameLen == 0) continue;
+			dir_entry_name(&dir, i, name);
+			int n = snprintf(&path[path_len], PATH_MAX - path_len, "/%s", name);
+			if (n < 0 || (size_t)n >= PATH_MAX - path_len) continue;
+			if (IS_SUBDIR(dir.files[i])) walk_directory(fs, dir.files[i].nStartBlock, path, path_len + n, depth + 1, fn, arg);
+			else fn(fs, path, dir_location, i, &dir.files[i], arg);
+		}
+		path[path_len] = '\0';
+	}
+
+	/*
+	* Calls fn for every file in the tree of the root directory at
+	* root_block, with its path, directory block and slot.
+	*/
+	static void walk_files(FILE *fs, long root_block, void (*fn)(FILE *, const char *, long, int, struct cs1550_dir_slot *, void *), void *arg) {
+		cs1550_dir root_dir;
+		char path[PATH_MAX];
+		int i;
+
+		if (load_dir(fs, root_block, 1, &root_dir) != 0) return;
+		path[0] = '/';
+		for (i=0; i<MAX_DIR_SLOTS; i++) {
+			if (root_dir.files[i].nNameLen == 0) continue;
+			dir_entry_name(&root_dir, i, &path[1]);
+			walk_directory(fs, root_dir.files[i].nStartBlock, path, strlen(path), 1, fn, arg);
+		}
+	}
+
+	/*
+	* The quota of the top-level directory a path is under, or NULL for the
+	* root and the top-level directories themselves.
+	*/
+	static struct cs1550_quota *quota_of(const char *path) {
+		char name[MAX_NAME_LEN + 1];
+		const char *end = strchr(path + 1, '/');
+		size_t len = end != NULL ? (size_t)(end - path - 1) : 0;
+
+		if (!QUOTAS_ENABLED || len == 0 || len > MAX_NAME_LEN) return NULL;
+		memcpy(name, path + 1, len);
+		name[len] = '\0';
+		return quota_find(name);
+	}
+
+	static struct cs1550_quota *quota_find(const char *name) {
+		int i;
+		for (i=0; i<MAX_DIR_SLOTS; i++) {
+			if (strcmp(quotas[i].name, name) == 0) return &quotas[i];
+		}
+		return NULL;
+	}
+
+	static int quota_add(long *count, long n, long limit) {
+		long old;
+		do {
+			old = *count;
+			if (n > 0 && limit > 0 && old + n > limit) return -EDQUOT;
+		} while (!__sync_bool_compare_and_swap(count, old, old + n));
+		return 0;
+	}
+
+	/*
+	* Adds to the usage of q, or takes away with negative counts. Adding
+	* fails with -EDQUOT, and changes nothing, if it would go over a limit.
+	*/
+	static int quota_charge(struct cs1550_quota *q, long blocks, long entries) {
+		if (q == NULL) return 0;
+		if (quota_add(&q->nBlocks, blocks, q->nBlockLimit) != 0) return -EDQUOT;
+		if (quota_add(&q->nEntries, entries, q->nEntryLimit) != 0) {
+			__sync_fetch_and_sub(&q->nBlocks, blocks);
+			return -EDQUOT;
+		}
+		return 0;
+	}
+
+	/*
+	* What a file is charged for its data.
+	*/
+	static long quota_file_blocks(long start_block, size_t size) {
+		if (start_block == NO_BLOCK || IS_PACKED_REF(start_block)) return 0;
+		if (size == 0) return 1;
+		return (size + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+	}
+
+	/*
+	* Adds up the usage of everything in a directory, not counting the
+	* directory itself.
+	*/
+	static void quota_count(FILE *fs, long dir_location, long *blocks, long *entries) {
+		cs1550_dir dir;
+		int i;
+
+		if (load_dir(fs, dir_location, 0, &dir) != 0) return;
+		for (i=0; i<MAX_DIR_SLOTS; i++) {
+			if (dir.files[i].nNameLen == 0) continue;
+			(*entries)++;
+			if (IS_SUBDIR(dir.files[i])) {
+				(*blocks)++;
+				quota_count(fs, dir.files[i].nStartBlock, blocks, entries);
+			} else *blocks += quota_file_blocks(dir.files[i].nStartBlock, dir.files[i].fsize);
+		}
+	}
+
+	/*
+	* Starts keeping the quota of a new top-level directory that already
+	* uses what is given. Its limits are quota_blocks and quota_entries,
+	* unless the quota_table file has a line for it.
+	*/
+	static struct cs1550_quota *quota_add_dir(const char *name, long blocks, long entries) {
+		char line[MAX_NAME_LEN + 64], table_name[MAX_NAME_LEN + 1];
+		long table_blocks, table_entries;
+		int i;
+
+		if (!QUOTAS_ENABLED) return NULL;
+		for (i=0; i<MAX_DIR_SLOTS && quotas[i].name[0] != '\0'; i++);
+		if (i == MAX_DIR_SLOTS) return NULL;
+		struct cs1550_quota *q = &quotas[i];
+		strcpy(q->name, name);
+		q->nBlockLimit = options.quota_blocks;
+		q->nEntryLimit = options.quota_entries;
+		q->nBlocks = blocks;
+		q->nEntries = entries;
+
+		FILE *table = options.quota_table != NULL ? fopen(options.quota_table, "r") : NULL;
+		while (table != NULL && fgets(line, sizeof(line), table) != NULL) {
+			if (sscanf(line, "%255s %ld %ld", table_name, &table_blocks, &table_entries) == 3 && strcmp(table_name, name) == 0) {
+				q->nBlockLimit = table_blocks;
+				q->nEntryLimit = table_entries;
+			}
+		}
+		if (table != NULL) fclose(table);
+		return q;
+	}
+
+	/*
+	* Counts the usage of every top-level directory, at mount.
+	*/
+	static void quota_load(FILE *fs) {
+		cs1550_dir root_dir;
+		char name[MAX_NAME_LEN + 1];
+		int i;
+
+		memset(quotas, 0, sizeof(quotas));
+		if (!QUOTAS_ENABLED || load_dir(fs, 0, 1, &root_dir) != 0) return;
+		for (i=0; i<MAX_DIR_SLOTS; i++) {
+			long blocks = 0, entries = 0;
+			if (root_dir.files[i].nNameLen == 0) continue;
+			dir_entry_name(&root_dir, i, name);
+			quota_count(fs, root_dir.files[i].nStartBlock, &blocks, &entries);
+			quota_add_dir(name, blocks, entries);
+		}
+	}
+
+	static void xattr_cache_store(long head, const struct cs1550_xattr_table *t) {
+		struct cs1550_xattr_cache_entry *c = &xattr_cache[head % XATTR_CACHE_SLOTS];
+		pthread_mutex_lock(&xattr_cache_lock);
+		if (c->table == NULL) c->table = malloc(sizeof(struct cs1550_xattr_table));
+		memcpy(c->table, t, sizeof(uint32_t) + t->nLen);
+		c->block = head;
+		pthread_mutex_unlock(&xattr_cache_lock);
+	}
+
+	static void xattr_cache_clear(void) {
+		int i;
+		pthread_mutex_lock(&xattr_cache_lock);
+		for (i=0; i<XATTR_CACHE_SLOTS; i++) xattr_cache[i].block = 0;
+		pthread_mutex_unlock(&xattr_cache_lock);
+	}
+
+	/*
+	* Reads the attribute table starting at head into t, from the cache
+	* when it has been read before. A head of 0 is an empty table.
+	*/
+	static int xattr_load(FILE *fs, long head, struct cs1550_xattr_table *t) {
+		struct cs1550_xattr_cache_entry *c = &xattr_cache[head % XATTR_CACHE_SLOTS];
+		struct cs1550_xattr_record rec;
+		cs1550_disk_block block;
+		size_t total = sizeof(uint32_t), got, n;
+		long b = head;
+
+		t->nLen = 0;
+		if (head <= 0) return 0;
+		pthread_mutex_lock(&xattr_cache_lock);
+		int hit = c->block == head;
+		if (hit) memcpy(t, c->table, sizeof(uint32_t) + c->table->nLen);
+		pthread_mutex_unlock(&xattr_cache_lock);
+		if (hit) return 0;
+
+		for (got=0; got<total; got+=n) {
+			if (b < 0 || read_block(fs, b, &block) != 0) return -EIO;
+			if (got == 0) {
+				memcpy(&t->nLen, block.data, sizeof(uint32_t));
+				if (t->nLen > XATTR_TABLE_MAX) return -EIO;
+				total += t->nLen;
+			}
+			n = total - got < MAX_DATA_IN_BLOCK ? total - got : MAX_DATA_IN_BLOCK;
+			memcpy((char *)t + got, block.data, n);
+			b = block.nNextBlock;
+		}
+		//Everything else trusts the record lengths
+		for (got=0; got<t->nLen; got+=XATTR_RECORD_SIZE(rec)) {
+			if (got + sizeof(rec) > t->nLen) return -EIO;
+			memcpy(&rec, &t->records[got], sizeof(rec));
+			if (got + XATTR_RECORD_SIZE(rec) > t->nLen) return -EIO;
+		}
+		xattr_cache_store(head, t);
+		return 0;
+	}
+
+	/*
+	* Writes t to a chain of new blocks and returns the first, or 0 when t
+	* is empty and needs none.
+	*/
+	static long xattr_store(FILE *fs, const struct cs1550_xattr_table *t) {
+		long blocks[(sizeof(struct cs1550_xattr_table) + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK];
+		cs1550_disk_block block;
+		size_t total = sizeof(uint32_t) + t->nLen, done = 0;
+		int count = (total + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+		int i, r = 0;
+
+		if (t->nLen == 0) return 0;
+		for (i=0; i<count; i++) {
+			blocks[i] = find_unallocated_block(fs);
+			if (blocks[i] < 0) break;
+			set_block_allocated(fs, blocks[i]);
+		}
+		if (i < count) r = -ENOSPC;
+		for (i=0; r == 0 && i<count; i++) {
+			size_t n = total - done < MAX_DATA_IN_BLOCK ? total - done : MAX_DATA_IN_BLOCK;
+			memset(&block, 0, sizeof(cs1550_disk_block));
+			block.nNextBlock = i + 1 < count ? blocks[i + 1] : -1;
+			memcpy(block.data, (const char *)t + done, n);
+			if (write_block(fs, blocks[i], &block) != 0) r = -EIO;
+			done += n;
+		}
+		if (r != 0) {
+			while (--i >= 0) set_block_free(fs, blocks[i]);
+			return r;
+		}
+		xattr_cache_store(blocks[0], t);
+		return blocks[0];
+	}
+
+	/*
+	* Drops a reference to an attribute table, freeing it if that was the
+	* last one.
+	*/
+	static void xattr_release(FILE *fs, long head) {
+		if (head <= 0) return;
+		free_chain(fs, head);
+		pthread_mutex_lock(&xattr_cache_lock);
+		if (xattr_cache[head % XATTR_CACHE_SLOTS].block == head) xattr_cache[head % XATTR_CACHE_SLOTS].block = 0;
+		pthread_mutex_unlock(&xattr_cache_lock);
+	}
+
+	/*
+	* Adds a record to t. Returns -ENOSPC if the table is full.
+	*/
+	static int xattr_append(struct cs1550_xattr_table *t, const char *entry, size_t entry_len, const char *name, size_t name_len, const void *value, size_t size) {
+		struct cs1550_xattr_record rec;
+
+		rec.nEntryLen = entry_len;
+		rec.nNameLen = name_len;
+		rec.nValueLen = size;
+		if (t->nLen + XATTR_RECORD_SIZE(rec) > XATTR_TABLE_MAX) return -ENOSPC;
+		char *p = &t->records[t->nLen];
+		memcpy(p, &rec, sizeof(rec));
+		memcpy(p + sizeof(rec), entry, entry_len);
+		memcpy(p + sizeof(rec) + entry_len, name, name_len);
+		memcpy(p + sizeof(rec) + entry_len + name_len, value, size);
+		t->nLen += XATTR_RECORD_SIZE(rec);
+		return 0;
+	}
+
+	/*
+	* Removes the attributes of entry from t, or only the one called name if
+	* that is given, and adds them to out under out_entry when out is given.
+	* Returns how many were removed, or -ENOSPC if out filled up, in which
+	* case t is left half done.
+	*/
+	static int xattr_take(struct cs1550_xattr_table *t, const char *entry, const char *name, struct cs1550_xattr_table *out, const char *out_entry) {
+		struct cs1550_xattr_record rec;
+		size_t entry_len = strlen(entry), name_len = name != NULL ? strlen(name) : 0;
+		uint32_t off = 0, kept = 0;
+		int n = 0;
+
+		while (off < t->nLen) {
+			memcpy(&rec, &t->records[off], sizeof(rec));
+			const char *e = &t->records[off + sizeof(rec)];
+			const char *a = e + rec.nEntryLen;
+			size_t size = XATTR_RECORD_SIZE(rec);
+			if (rec.nEntryLen == entry_len && memcmp(e, entry, entry_len) == 0 && (name == NULL || (rec.nNameLen == name_len && memcmp(a, name, name_len) == 0))) {
+				if (out != NULL && xattr_append(out, out_entry, strlen(out_entry), a, rec.nNameLen, a + rec.nNameLen, rec.nValueLen) != 0) return -ENOSPC;
+				n++;
+			} else {
+				memmove(&t->records[kept], &t->records[off], size);
+				kept += size;
+			}
+			off += size;
+		}
+		t->nLen = kept;
+		return n;
+	}
+
+	/*
+	* Moves the attributes of entry in from over to to_entry in to, dropping
+	* any to_entry already had, or just drops them when to is NULL. The two
+	* may be the same directory. Only the directories in memory change; the
+	* tables they stop using are put in released[0] and released[1], to be
+	* dropped with xattr_release once the directories are stored.
+	*/
+	static int xattr_move(FILE *fs, cs1550_dir *from, const char *entry, cs1550_dir *to, const char *to_entry, long *released) {
+		long from_head = from->nXattrBlock, to_head = 0;
+		int from_changed = 0, to_changed = 0;
+
+		released[0] = released[1] = 0;
+		if (from->nXattrBlock == 0 && (to == NULL || to->nXattrBlock == 0)) return 0;
+		struct cs1550_xattr_table *t = malloc(sizeof(struct cs1550_xattr_table));
+		struct cs1550_xattr_table *moved = malloc(sizeof(struct cs1550_xattr_table));
+		struct cs1550_xattr_table *to_t = t;
+		moved->nLen = 0;
+		int r = xattr_load(fs, from->nXattrBlock, t);
+		if (r == 0) r = xattr_take(t, entry, NULL, to != NULL ? moved : NULL, to_entry);
+		if (r > 0) from_changed = 1;
+		if (r >= 0 && to != NULL && to != from) {
+			to_t = malloc(sizeof(struct cs1550_xattr_table));
+			r = xattr_load(fs, to->nXattrBlock, to_t);
+		}
+		if (r >= 0 && to != NULL) {
+			r = xattr_take(to_t, to_entry, NULL, NULL, NULL);
+			if (r > 0 || moved->nLen > 0) to_changed = 1;
+			if (to_t->nLen + moved->nLen > XATTR_TABLE_MAX) r = -ENOSPC;
+			else {
+				memcpy(&to_t->records[to_t->nLen], moved->records, moved->nLen);
+				to_t->nLen += moved->nLen;
+			}
+		}
+		if (to == from) {
+			from_changed |= to_changed;
+			to_changed = 0;
+		}
+
+		/** Write the new tables, then point the directories at them **/
+		if (r >= 0 && from_changed) {
+			from_head = xattr_store(fs, t);
+			if (from_head < 0) r = from_head;
+		}
+		if (r >= 0 && to_changed) {
+			to_head = xattr_store(fs, to_t);
+			if (to_head < 0) {
+				r = to_head;
+				if (from_changed) xattr_release(fs, from_head);
+			}
+		}
+		if (r >= 0 && from_changed) {
+			released[0] = from->nXattrBlock;
+			from->nXattrBlock = from_head;
+		}
+		if (r >= 0 && to_changed) {
+			released[1] = to->nXattrBlock;
+			to->nXattrBlock = to_head;
+		}
+		if (to_t != t) free(to_t);
+		free(moved);
+		free(t);
+		return r < 0 ? r : 0;
+	}
+
+	/*
+	* Before a write changes blocks 0..last_index of a file's chain, copies
+	* any of them that are shared so the other owners keep their data. The
+	* copies keep pointing at the original tail, which stays shared. A tail
+	* block that already has MAX_BLOCK_REFS owners is copied too.
+	*/
+	static int unshare_chain(FILE *fs, cs1550_dir *dir, long dir_location, int file_index, int last_index) {
+		cs1550_disk_block block, prev_block;
+		long prev = -1;
+		long b = dir->files[file_index].nStartBlock;
+		long needed = 0;
+		int uncounted = 0;
+		int i;
+
+		/** Count the copies first, so running out of room changes nothing.
+		Once one block is copied, the copy shares the next one, so every
+		block after it is copied as well. **/
+		for (i=0; i<=last_index && b >= 0; i++) {
+			if (read_block(fs, b, &block) != 0) return -EIO;
+			if (needed > 0 || block_refcount(fs, b) > 1) {
+				needed++;
+				if (i == last_index && block.nNextBlock >= 0 && block_refcount(fs, block.nNextBlock) >= MAX_BLOCK_REFS) last_index++;
+			}
+			b = block.nNextBlock;
+		}
+		if (needed > count_free_blocks(fs) - options.reserved_blocks) return -ENOSPC;
+
+		b = dir->files[file_index].nStartBlock;
+		for (i=0; i<=last_index && b >= 0; i++) {
+			if (read_block(fs, b, &block) != 0) return -EIO;
+			if (block_refcount(fs, b) > 1) {
+				int copy = find_data_block(fs);
+				if (copy < 0) return -ENOSPC;
+				set_block_allocated(fs, copy);
+				if (write_block(fs, copy, &block) != 0) return -EIO;
+				// the previous copy's link to b was never counted
+				if (!uncounted) block_unref(fs, b);
+				uncounted = 0;
+				if (block.nNextBlock >= 0 && block_ref(fs, block.nNextBlock) < 0) {
+					if (block_refcount(fs, block.nNextBlock) < MAX_BLOCK_REFS) return -EIO;
+					uncounted = 1; // the next block is copied on the next pass
+				}
+				if (prev < 0) {
+					dir->files[file_index].nStartBlock = copy;
+					if (store_dir(fs, dir_location, 0, dir) != 0) return -EIO;
+				} else {
+					prev_block.nNextBlock = copy;
+					if (write_block(fs, prev, &prev_block) != 0) return -EIO;
+				}
+				printf("unshare_chain(): copied shared block %li to %i\n", b, copy);
+				b = copy;
+			}
+			prev = b;
+			memcpy(&prev_block, &block, sizeof(cs1550_disk_block));
+			b = block.nNextBlock;
+		}
+		return 0;
+	}
+
+	/*
+	* Like unshare_chain for the index blocks of a compressed file. Their
+	* groups are always rewritten to new blocks, so only the index is copied.
+	* A copy takes a reference to each of its groups, so the write fails with
+	* -ENOSPC if one of them already has MAX_BLOCK_REFS owners.
+	*/
+	static int unshare_index_chain(FILE *fs, cs1550_dir *dir, long dir_location, int file_index) {
+		cs1550_group_index index, prev_index;
+		long prev = -1;
+		long b = dir->files[file_index].nStartBlock;
+		long needed = 0;
+		int uncounted = 0;
+		int g;
+
+		/** Check the copies and their references fit before anything
+		changes. Every index block after the first copy is copied too. **/
+		while (b >= 0) {
+			if (read_block(fs, b, &index) != 0) return -EIO;
+			if (needed > 0 || block_refcount(fs, b) > 1) {
+				needed++;
+				for (g=0; g<GROUPS_PER_INDEX; g++) {
+					if (index.groups[g].nStartBlock >= 0 && block_refcount(fs, index.groups[g].nStartBlock) >= MAX_BLOCK_REFS) return -ENOSPC;
+				}
+			}
+			b = index.nNextBlock;
+		}
+		if (needed > count_free_blocks(fs)) return -ENOSPC;
+
+		b = dir->files[file_index].nStartBlock;
+		while (b >= 0) {
+			if (read_block(fs, b, &index) != 0) return -EIO;
+			if (block_refcount(fs, b) > 1) {
+				int copy = find_unallocated_block(fs);
+				if (copy < 0) return -ENOSPC;
+				set_block_allocated(fs, copy);
+				for (g=0; g<GROUPS_PER_INDEX; g++) {
+					if (index.groups[g].nStartBlock >= 0 && block_ref(fs, index.groups[g].nStartBlock) < 0) break;
+				}
+				int next_ref = g == GROUPS_PER_INDEX && index.nNextBlock >= 0 ? block_ref(fs, index.nNextBlock) : 0;
+				if (next_ref < 0 && block_refcount(fs, index.nNextBlock) >= MAX_BLOCK_REFS) next_ref = 0; // copied on the next pass
+				if (g < GROUPS_PER_INDEX || next_ref < 0 || write_block(fs, copy, &index) != 0) {
+					//Give back the references this copy took
+					if (next_ref > 0) block_unref(fs, index.nNextBlock);
+					while (--g >= 0) {
+						if (index.groups[g].nStartBlock >= 0) block_unref(fs, index.groups[g].nStartBlock);
+					}
+					set_block_free(fs, copy);
+					return -EIO;
+				}
+				// the previous copy's link to b was never counted
+				if (!uncounted) block_unref(fs, b);
+				uncounted = index.nNextBlock >= 0 && next_ref == 0;
+				if (prev < 0) {
+					dir->files[file_index].nStartBlock = copy;
+					if (store_dir(fs, dir_location, 0, dir) != 0) return -EIO;
+				} else {
+					prev_index.nNextBlock = copy;
+					if (write_block(fs, prev, &prev_index) != 0) return -EIO;
+				}
+				printf("unshare_index_chain(): copied shared index block %li to %i\n", b, copy);
+				b = copy;
+			}
+			prev = b;
+			memcpy(&prev_index, &index, sizeof(cs1550_group_index));
+			b = index.nNextBlock;
+		}
+		return 0;
+	}
+
+	/*
+	* Drops a reference to the data of a file. Blocks nothing else points
+	* to any more are freed.
+	*/
+	static void release_file_data(FILE *fs, long start_block) {
+		cs1550_group_index index;
+		long b = start_block;
+		int g;
+
+		if (IS_PACKED_REF(start_block)) {
+			release_pack_slot(fs, start_block);
+			return;
+		}
+		if (!(get_disk_features(fs) & FEATURE_COMPRESSION)) {
+			free_chain(fs, start_block);
+			return;
+		}
+		while (b >= 0 && read_block(fs, b, &index) == 0) {
+			if (block_unref(fs, b) > 0) break;
+			for (g=0; g<GROUPS_PER_INDEX; g++) free_chain(fs, index.groups[g].nStartBlock);
+			b = index.nNextBlock;
+		}
+	}
+
+	/*
+	* Drops a reference to a directory block, and to the files and
+	* subdirectories in it if that was the last one.
+	*/
+	static void release_directory(FILE *fs, long dir_location) {
+		cs1550_dir dir;
+		int i;
+
+		if (load_dir(fs, dir_location, 0, &dir) != 0) return;
+		if (block_unref(fs, dir_location) > 0) return;
+		dentry_cache_clear();
+		xattr_release(fs, dir.nXattrBlock);
+		for (i=0; i<MAX_DIR_SLOTS; i++) {
+			if (dir.files[i].nNameLen == 0) continue;
+			if (IS_SUBDIR(dir.files[i])) release_directory(fs, dir.files[i].nStartBlock);
+			else release_file_data(fs, dir.files[i].nStartBlock);
+		}
+	}
+
+	/*
+	* Before the directory in slot index of the directory at parent is
+	* changed, gives the live tree its own copy if a snapshot still uses it.
+	* The copy takes a reference to every file and subdirectory in it and to
+	* its attribute table; small files are copied to new pack slots since
+	* slots are not reference counted. The parent must already be unshared. Returns where the
+	* directory is now, or a negative errno.
+	*/
+	static long unshare_directory(FILE *fs, long parent, int parent_is_root, int index) {
+		cs1550_dir parent_dir, dir;
+		char slot[SMALL_FILE_SLOT_SIZE];
+		long dir_location;
+		int j;
+
+		if (load_dir(fs, parent, parent_is_root, &parent_dir) != 0) return -EIO;
+		dir_location = parent_dir.files[index].nStartBlock;
+		if (block_refcount(fs, dir_location) <= 1) return dir_location;
+		if (load_dir(fs, dir_location, 0, &dir) != 0) return -EIO;
+
+		int copy = find_unallocated_block(fs);
+		if (copy < 0) return -ENOSPC;
+		if (dir.nXattrBlock > 0 && block_ref(fs, dir.nXattrBlock) < 0) return -ENOSPC;
+		set_block_allocated(fs, copy);
+		for (j=0; j<MAX_DIR_SLOTS; j++) {
+			long b = dir.files[j].nStartBlock;
+			if (dir.files[j].nNameLen == 0 || b == NO_BLOCK) continue;
+			if (IS_PACKED_REF(b) && !IS_SUBDIR(dir.files[j])) {
+				if (read_pack_slot(fs, b, slot) == 0) b = store_in_pack(fs, slot);
+				else b = NO_BLOCK;
+				if (b == NO_BLOCK) break;
+				dir.files[j].nStartBlock = b;
+			} else if (block_ref(fs, b) < 0) break;
+		}
+		if (j < MAX_DIR_SLOTS) {
+			/** Could not take a reference, undo the ones already taken **/
+			while (--j >= 0) {
+				if (dir.files[j].nNameLen == 0 || dir.files[j].nStartBlock == NO_BLOCK) continue;
+				if (IS_SUBDIR(dir.files[j])) block_unref(fs, dir.files[j].nStartBlock);
+				else release_file_data(fs, dir.files[j].nStartBlock);
+			}
+			xattr_release(fs, dir.nXattrBlock);
+			set_block_free(fs, copy);
+			return -ENOSPC;
+		}
+		if (store_dir(fs, copy, 0, &dir) != 0) return -EIO;
+		block_unref(fs, dir_location);
+		parent_dir.files[index].nStartBlock = copy;
+		if (store_dir(fs, parent, parent_is_root, &parent_dir) != 0) return -EIO;
+		dentry_cache_clear();
+		printf("unshare_directory(): copied shared directory block %li to %i\n", dir_location, copy);
+		return copy;
+	}
+
+	/*
+	* Reads the snapshot table into table and returns its block. If there
+	* is none yet it is created when create is set, else -1 is returned
+	* with table empty.
+	*/
+	static long load_snapshot_table(FILE *fs, cs1550_snapshot_table *table, int create) {
+		cs1550_superblock sb;
+
+		memset(table, 0, sizeof(cs1550_snapshot_table));
+		if (read_superblock(fs, &sb) != 0) return -1;
+		if (sb.nSnapTable > 0) return read_block(fs, sb.nSnapTable, table) == 0 ? sb.nSnapTable : -1;
+		if (!create) return -1;
+
+		int block_num = find_unallocated_block(fs);
+		if (block_num < 0) return -1;
+		set_block_allocated(fs, block_num);
+		if (write_block(fs, block_num, table) != 0) {
+			set_block_free(fs, block_num);
+			return -1;
+		}
+		sb.nSnapTable = block_num;
+		write_superblock(fs, &sb);
+		return block_num;
+	}
+
+	/*
+	* Returns 1 if a snapshot, a copy or deduplication has left any block
+	* with more than one owner. The tracker is only counted the first time;
+	* after that the count is kept as references are taken and dropped.
+	*/
+	static int have_shared_blocks(FILE *fs) {
+		if (shared_blocks < 0) {
+			cs1550_free_space_tracker *tracker = get_tracker(fs);
+			long n = 0;
+			int i;
+			if (tracker == NULL) return 1;
+			for (i=0; i<MAX_NUM_OF_BLOCKS; i++) {
+				if (tracker->data[i] > 1) n++;
+			}
+			shared_blocks = n;
+		}
+		return shared_blocks > 0;
+	}
+
+	static int is_snapshot_path(const char *path) {
+		size_t len = strlen(SNAP_DIR);
+		return strncmp(path, SNAP_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+	}
+
+	/*
+	* Maps a path under SNAP_DIR to the path it has inside its snapshot, and
+	* root_block to the snapshot's root. SNAP_DIR itself maps to "/" with a
+	* root_block of -1.
+	*/
+	static int resolve_snapshot(const char **path, long *root_block) {
+		cs1550_snapshot_table table;
+		const char *name = *path + strlen(SNAP_DIR);
+		int i;
+
+		if (*name == '\0' || strcmp(name, "/") == 0) {
+			*path = "/";
+			*root_block = -1;
+			return 0;
+		}
+		name++;
+		const char *rest = strchr(name, '/');
+		size_t len = rest ? (size_t)(rest - name) : strlen(name);
+
+		FILE *fs = open_disk("rb");
+		if (fs == NULL) return -EIO;
+		load_snapshot_table(fs, &table, 0);
+		fclose(fs);
+		for (i=0; i<MAX_SNAPSHOTS; i++) {
+			if (table.snapshots[i].name[0] != '\0' && strlen(table.snapshots[i].name) == len && strncmp(table.snapshots[i].name, name, len) == 0) break;
+		}
+		if (i == MAX_SNAPSHOTS) return -ENOENT;
+		*path = (rest && rest[1] != '\0') ? rest : "/";
+		*root_block = table.snapshots[i].nRootBlock;
+		return 0;
+	}
+
+	/*
+	* Takes a snapshot: a copy of the root directory, plus a reference to
+	* every directory block so the next change to one copies it first.
+	*/
+	static int create_snapshot(const char *name) {
+		cs1550_snapshot_table table;
+		cs1550_dir root_dir;
+		int i, slot = -1;
+
+		if (strlen(name) == 0 || strchr(name, '/') != NULL) return -EPERM;
+		if (strlen(name) > MAX_SNAPSHOT_NAME) return -ENAMETOOLONG;
+		FILE *fs = open_disk("rb+");
+		if (fs == NULL) return -EIO;
+		long table_block = load_snapshot_table(fs, &table, 1);
+		if (table_block < 0) { fclose(fs); return -ENOSPC; }
+		for (i=0; i<MAX_SNAPSHOTS; i++) {
+			if (strcmp(table.snapshots[i].name, name) == 0) { fclose(fs); return -EEXIST; }
+			if (slot < 0 && table.snapshots[i].name[0] == '\0') slot = i;
+		}
+		if (slot < 0) { fclose(fs); return -EMLINK; }
+
+		if (load_dir(fs, 0, 1, &root_dir) != 0) { fclose(fs); return -EIO; }
+		int root_copy = find_unallocated_block(fs);
+		if (root_copy < 0) { fclose(fs); return -ENOSPC; }
+		if (root_dir.nXattrBlock > 0 && block_ref(fs, root_dir.nXattrBlock) < 0) { fclose(fs); return -ENOSPC; }
+		set_block_allocated(fs, root_copy);
+		for (i=0; i<MAX_DIR_SLOTS; i++) {
+			if (root_dir.files[i].nNameLen == 0) continue;
+			if (block_ref(fs, root_dir.files[i].nStartBlock) < 0) break;
+		}
+		if (i < MAX_DIR_SLOTS || store_dir(fs, root_copy, 1, &root_dir) != 0) {
+			while (--i >= 0) {
+				if (root_dir.files[i].nNameLen != 0) block_unref(fs, root_dir.files[i].nStartBlock);
+			}
+			xattr_release(fs, root_dir.nXattrBlock);
+			set_block_free(fs, root_copy);
+			fclose(fs);
+			return -EIO;
+		}
+
+		strcpy(table.snapshots[slot].name, name);
+		table.snapshots[slot].nRootBlock = root_copy;
+		table.snapshots[slot].nCreated = time(NULL);
+		int r = write_block(fs, table_block, &table) == 0 ? 0 : -EIO;
+		//Every directory is shared now, so open files have to be looked up again
+		dentry_cache_clear();
+		printf("create_snapshot(): snapshot %s has its root at block %i\n", name, root_copy);
+		fclose(fs);
+		return r;
+	}
+
+	/*
+	* Deletes a snapshot and frees whatever only it was still using.
+	*/
+	static int delete_snapshot(const char *name) {
+		cs1550_snapshot_table table;
+		cs1550_dir root_dir;
+		int i;
+
+		FILE *fs = open_disk("rb+");
+		if (fs == NULL) return -EIO;
+		long table_block = load_snapshot_table(fs, &table, 0);
+		for (i=0; table_block >= 0 && i<MAX_SNAPSHOTS; i++) {
+			if (table.snapshots[i].name[0] != '\0' && strcmp(table.snapshots[i].name, name) == 0) break;
+		}
+		if (table_block < 0 || i == MAX_SNAPSHOTS) { fclose(fs); return -ENOENT; }
+
+		long root_block = table.snapshots[i].nRootBlock;
+		memset(&table.snapshots[i], 0, sizeof(struct cs1550_snapshot));
+		if (write_block(fs, table_block, &table) != 0) { fclose(fs); return -EIO; }
+		if (load_dir(fs, root_block, 1, &root_dir) == 0) {
+			for (i=0; i<MAX_DIR_SLOTS; i++) {
+				if (root_dir.files[i].nNameLen != 0) release_directory(fs, root_dir.files[i].nStartBlock);
+			}
+			xattr_release(fs, root_dir.nXattrBlock);
+		}
+		block_unref(fs, root_block);
+		printf("delete_snapshot(): deleted snapshot %s\n", name);
+		fclose(fs);
+		attr_cache_clear();
+		return 0;
+	}
+
+	static uint64_t block_hash(const void *buf) {
+		const unsigned char *p = buf;
+		uint64_t h = 0x9E3779B97F4A7C15ULL;
+		uint64_t w;
+		int i;
+		for (i=0; i<BLOCK_SIZE; i+=8) {
+			memcpy(&w, &p[i], 8);
+			h = (h ^ w) * 0xff51afd7ed558ccdULL;
+			h ^= h >> 32;
+		}
+		return h;
+	}
+
+	static void dedup_index_remove(long block_num) {
+		if (dedup_index == NULL || dedup_slot_of[block_num] < 0) return;
+		dedup_index[dedup_slot_of[block_num]].block = DEDUP_DELETED;
+		dedup_slot_of[block_num] = -1;
+	}
+
+	static void dedup_index_insert(uint64_t h, long block_num);
+
+	/*
+	* Drops the deleted slots once they take up a quarter of the index.
+	*/
+	static void dedup_index_compact(void) {
+		struct cs1550_dedup_slot *old = dedup_index;
+		int i;
+
+		dedup_index = malloc(DEDUP_INDEX_SLOTS * sizeof(struct cs1550_dedup_slot));
+		for (i=0; i<DEDUP_INDEX_SLOTS; i++) dedup_index[i].block = DEDUP_EMPTY;
+		dedup_used = 0;
+		for (i=0; i<DEDUP_INDEX_SLOTS; i++) {
+			if (old[i].block < 0) continue;
+			long b = old[i].block;
+			int slot = (old[i].fingerprint * 2654435761U) & (DEDUP_INDEX_SLOTS - 1);
+			while (dedup_index[slot].block != DEDUP_EMPTY) slot = (slot + 1) & (DEDUP_INDEX_SLOTS - 1);
+			dedup_index[slot] = old[i];
+			dedup_slot_of[b] = slot;
+			dedup_used++;
+		}
+		free(old);
+	}
+
+	static void dedup_index_insert(uint64_t h, long block_num) {
+		uint32_t fingerprint = h >> 32;
+		int slot = (fingerprint * 2654435761U) & (DEDUP_INDEX_SLOTS - 1);
+
+		dedup_index_remove(block_num);
+		if (dedup_used >= DEDUP_INDEX_SLOTS * 3 / 4) dedup_index_compact();
+		while (dedup_index[slot].block >= 0) slot = (slot + 1) & (DEDUP_INDEX_SLOTS - 1);
+		if (dedup_index[slot].block == DEDUP_EMPTY) dedup_used++;
+		dedup_index[slot].fingerprint = fingerprint;
+		dedup_index[slot].block = block_num;
+		dedup_slot_of[block_num] = slot;
+	}
+
+	/*
+	* Looks for a block other than self with exactly the contents of buf that
+	* can take another reference. Returns it, or -1.
+	*/
+	static long dedup_index_find(FILE *fs, uint64_t h, const void *buf, long self) {
+		uint32_t fingerprint = h >> 32;
+		int slot = (fingerprint * 2654435761U) & (DEDUP_INDEX_SLOTS - 1);
+		char candidate[BLOCK_SIZE];
+
+		while (dedup_index[slot].block != DEDUP_EMPTY) {
+			long b = dedup_index[slot].block;
+			if (b >= 0 && b != self && dedup_index[slot].fingerprint == fingerprint) {
+				int count = block_refcount(fs, b);
+				if (count > 0 && count < MAX_BLOCK_REFS && read_block(fs, b, candidate) == 0 && memcmp(candidate, buf, BLOCK_SIZE) == 0) return b;
+			}
+			slot = (slot + 1) & (DEDUP_INDEX_SLOTS - 1);
+		}
+		return -1;
+	}
+
+	static void dedup_index_file(FILE *fs, const char *path, long dir_location, int index, struct cs1550_dir_slot *file, void *arg) {
+		cs1550_disk_block block;
+		long b = file->nStartBlock;
+		(void) path; (void) dir_location; (void) index; (void) arg;
+
+		while (b >= 0 && dedup_slot_of[b] < 0 && read_block(fs, b, &block) == 0) {
+			dedup_index_insert(block_hash(&block), b);
+			b = block.nNextBlock;
+		}
+	}
+
+	/*
+	* Builds the index from every file chain on the disk.
+	*/
+	static void dedup_index_build(FILE *fs) {
+		int i;
+
+		dedup_index = malloc(DEDUP_INDEX_SLOTS * sizeof(struct cs1550_dedup_slot));
+		dedup_slot_of = malloc(MAX_NUM_OF_BLOCKS * sizeof(int32_t));
+		for (i=0; i<DEDUP_INDEX_SLOTS; i++) dedup_index[i].block = DEDUP_EMPTY;
+		for (i=0; i<MAX_NUM_OF_BLOCKS; i++) dedup_slot_of[i] = -1;
+		dedup_used = 0;
+
+		walk_files(fs, 0, dedup_index_file, NULL);
+		printf("dedup_index_build(): indexed %i blocks\n", dedup_used);
+	}
+
+	static void pack_room_note(FILE *fs, const char *path, long dir_location, int index, struct cs1550_dir_slot *file, void *arg) {
+		unsigned char *packs = arg;
+		(void) fs; (void) path; (void) dir_location; (void) index;
+		if (!IS_PACKED_REF(file->nStartBlock)) return;
+		long b = PACKED_REF_BLOCK(file->nStartBlock);
+		packs[b / 8] |= 1 << (b % 8);
+	}
+
+	/*
+	* Finds the pack blocks of the live tree and of every snapshot, and
+	* notes the ones with a free slot in pack_room.
+	*/
+	static void pack_room_load(FILE *fs) {
+		cs1550_snapshot_table table;
+		cs1550_pack_block pack;
+		unsigned char *packs = calloc(1, (MAX_NUM_OF_BLOCKS + 7) / 8);
+		long b;
+		int i, n = 0;
+
+		pack_room = calloc(1, (MAX_NUM_OF_BLOCKS + 7) / 8);
+		walk_files(fs, 0, pack_room_note, packs);
+		if (load_snapshot_table(fs, &table, 0) >= 0) {
+			for (i=0; i<MAX_SNAPSHOTS; i++) {
+				if (table.snapshots[i].name[0] != '\0') walk_files(fs, table.snapshots[i].nRootBlock, pack_room_note, packs);
+			}
+		}
+		for (b=0; b<MAX_NUM_OF_BLOCKS; b++) {
+			if ((packs[b / 8] & (1 << (b % 8))) == 0 || read_block(fs, b, &pack) != 0) continue;
+			if (pack.nSlotMap != PACK_BLOCK_FULL) {
+				pack_room_set(b, 1);
+				n++;
+			}
+		}
+		free(packs);
+		printf("pack_room_load(): %i pack blocks have a free slot\n", n);
+	}
+
+	/*
+	* Replaces blocks of a file's chain with identical blocks found elsewhere,
+	* starting from the end so that each replacement can make the block in
+	* front of it identical to another one too. Returns the blocks saved.
+	*/
+	static int dedup_file(FILE *fs, cs1550_dir *dir, long dir_location, int file_index) {
+		cs1550_disk_block block;
+		long *chain = malloc(MAX_NUM_OF_BLOCKS * sizeof(long));
+		long b = dir->files[file_index].nStartBlock;
+		int n = 0, saved = 0, i;
+
+		if (dedup_index == NULL) dedup_index_build(fs);
+		while (b >= 0 && n < MAX_NUM_OF_BLOCKS && read_block(fs, b, &block) == 0) {
+			chain[n++] = b;
+			b = block.nNextBlock;
+		}
+
+		for (i=n-1; i>=0; i--) {
+			if (block_refcount(fs, chain[i]) != 1) continue; // already shared
+			if (read_block(fs, chain[i], &block) != 0) break;
+			uint64_t h = block_hash(&block);
+			long match = dedup_index_find(fs, h, &block, chain[i]);
+			if (match < 0) {
+				dedup_index_insert(h, chain[i]);
+				continue;
+			}
+
+			/** Point whatever led to chain[i] at the match instead **/
+			if (block_ref(fs, match) < 0) continue;
+			int r;
+			if (i == 0) {
+				dir->files[file_index].nStartBlock = match;
+				r = store_dir(fs, dir_location, 0, dir);
+				if (r != 0) dir->files[file_index].nStartBlock = chain[i];
+			} else {
+				cs1550_disk_block prev;
+				if (read_block(fs, chain[i-1], &prev) != 0) { block_unref(fs, match); break; }
+				prev.nNextBlock = match;
+				r = write_block(fs, chain[i-1], &prev);
+			}
+			//The link was not written, so chain[i] is still in use
+			if (r != 0) {
+				block_unref(fs, match);
+				break;
+			}
+			free_chain(fs, chain[i]);
+			saved++;
+		}
+
+		free(chain);
+		printf("dedup_file(): shared %i blocks of the file in slot %i of block %li\n", saved, file_index, dir_location);
+		return saved;
+	}
+
+	/*
+	* Allocates and writes a group index with no groups. Returns its block,
+	* or -1 if the disk is full.
+	*/
+	static long new_group_index(FILE *fs) {
+		cs1550_group_index index;
+		int i;
+		int block_num = find_unallocated_block(fs);
+		if (block_num < 0) return -1;
+		set_block_allocated(fs, block_num);
+
+		memset(&index, 0, sizeof(cs1550_group_index));
+		index.nNextBlock = -1;
+		for (i=0; i<GROUPS_PER_INDEX; i++) index.groups[i].nStartBlock = -1;
+		if (write_block(fs, block_num, &index) != 0) {
+			set_block_free(fs, block_num);
+			return -1;
+		}
+		return block_num;
+	}
+
+	/*
+	* Loads the index block that holds group g. With create, index blocks
+	* missing from the end of the chain are added. Returns the block number of
+	* the loaded index, or -1.
+	*/
+	static long load_group_index(FILE *fs, long index_block, int g, int create, cs1550_group_index *index) {
+		long b = index_block;
+		if (read_block(fs, b, index) != 0) return -1;
+		while (g >= GROUPS_PER_INDEX) {
+			if (index->nNextBlock == -1) {
+				if (!create) return -1;
+				long next = new_group_index(fs);
+				if (next < 0) return -1;
+				index->nNextBlock = next;
+				if (write_block(fs, b, index) != 0) return -1;
+			}
+			b = index->nNextBlock;
+			if (read_block(fs, b, index) != 0) return -1;
+			g -= GROUPS_PER_INDEX;
+		}
+		return b;
+	}
+
+	/*
+	* Decompresses a group into out, which must hold COMPRESS_GROUP_SIZE bytes.
+	*/
+	static int read_group(FILE *fs, const struct cs1550_group *group, char *out) {
+		char stored[COMPRESS_GROUP_SIZE];
+		cs1550_disk_block block;
+		long b = group->nStartBlock;
+		int have = 0;
+
+		memset(out, 0, COMPRESS_GROUP_SIZE);
+		if (b == -1) return 0;
+		if (group->nStoredSize > COMPRESS_GROUP_SIZE) return -EIO;
+		while (have < group->nStoredSize) {
+			if (b < 0 || read_block(fs, b, &block) != 0) return -EIO;
+			int n = group->nStoredSize - have;
+			if (n > (int)MAX_DATA_IN_BLOCK) n = MAX_DATA_IN_BLOCK;
+			memcpy(&stored[have], block.data, n);
+			have += n;
+			b = block.nNextBlock;
+		}
+
+		if (group->nFlags & GROUP_RAW) {
+			memcpy(out, stored, group->nStoredSize);
+			return 0;
+		}
+#ifdef CS1550_WITH_LZ4
+		if (LZ4_decompress_safe(stored, out, group->nStoredSize, COMPRESS_GROUP_SIZE) >= 0) return 0;
+		printf("read_group(): group at block %li does not decompress.\n", group->nStartBlock);
+#else
+		printf("read_group(): built without LZ4, cannot decompress group at block %li.\n", group->nStartBlock);
+#endif
+		return -EIO;
+	}
+
+	/*
+	* Compresses len bytes of data into a new chain and points the group at
+	* it. The old chain is left alone and its start put in old_start, for the
+	* caller to free once the index pointing at the new one is on disk. On
+	* error the group is unchanged.
+	*/
+	static int write_group(FILE *fs, struct cs1550_group *group, const char *data, int len, long *old_start) {
+		char stored[COMPRESS_GROUP_SIZE];
+		cs1550_disk_block block;
+		int stored_size = 0;
+		int flags = GROUP_RAW;
+		int i;
+
+		*old_start = -1;
+		for (i=0; i<len && data[i] == 0; i++);
+		if (i == len) {
+			// all zeros, nothing to store
+			*old_start = group->nStartBlock;
+			group->nStartBlock = -1;
+			group->nStoredSize = 0;
+			group->nFlags = 0;
+			return 0;
+		}
+
+#ifdef CS1550_WITH_LZ4
+		stored_size = LZ4_compress_default(data, stored, len, COMPRESS_GROUP_SIZE);
+		if (stored_size > 0 && stored_size < len) flags = 0;
+#endif
+		if (flags & GROUP_RAW) {
+			memcpy(stored, data, len);
+			stored_size = len;
+		}
+
+		/** Lay the stored bytes out in a chain, last block first so each
+		block can be written with its nNextBlock already known. **/
+		int nblocks = (stored_size + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+		long next = -1;
+		for (i=nblocks-1; i>=0; i--) {
+			int block_num = find_data_block(fs);
+			if (block_num < 0) {
+				free_chain(fs, next);
+				return -ENOSPC;
+			}
+			set_block_allocated(fs, block_num);
+			int n = stored_size - i * (int)MAX_DATA_IN_BLOCK;
+			if (n > (int)MAX_DATA_IN_BLOCK) n = MAX_DATA_IN_BLOCK;
+			memset(&block, 0, sizeof(cs1550_disk_block));
+			block.nNextBlock = next;
+			memcpy(block.data, &stored[i * MAX_DATA_IN_BLOCK], n);
+			if (write_block(fs, block_num, &block) != 0) {
+				set_block_free(fs, block_num);
+				free_chain(fs, next);
+				return -EIO;
+			}
+			next = block_num;
+		}
+
+		*old_start = group->nStartBlock;
+		group->nStartBlock = next;
+		group->nStoredSize = stored_size;
+		group->nFlags = flags;
+		return 0;
+	}
+
+	/*
+	* Reads from a compressed file, decompressing only the groups that
+	* overlap [offset, offset + size). Returns the number of bytes read.
+	*/
+	static int read_compressed(FILE *fs, long index_block, size_t file_size, char *buf, size_t size, off_t offset) {
+		char group_data[COMPRESS_GROUP_SIZE];
+		cs1550_group_index index;
+		size_t end = offset + size;
+		size_t pos = offset;
+		int r;
+
+		if (end > file_size) end = file_size;
+		while (pos < end) {
+			int g = pos / COMPRESS_GROUP_SIZE;
+			int in_group = pos % COMPRESS_GROUP_SIZE;
+			int n = COMPRESS_GROUP_SIZE - in_group;
+			if ((size_t)n > end - pos) n = end - pos;
+
+			if (load_group_index(fs, index_block, g, 0, &index) < 0) return -EIO;
+			if ((r = read_group(fs, &index.groups[g % GROUPS_PER_INDEX], group_data)) != 0) return r;
+			memcpy(&buf[pos - offset], &group_data[in_group], n);
+			pos += n;
+		}
+		return end > (size_t)offset ? (int)(end - offset) : 0;
+	}
+
+	/*
+	* Writes to a compressed file. Each group the write overlaps is
+	* decompressed, patched, recompressed and written to a new chain.
+	* The caller updates fsize.
+	*/
+	static int write_compressed(FILE *fs, long index_block, size_t file_size, const char *buf, size_t size, off_t offset) {
+		char group_data[COMPRESS_GROUP_SIZE];
+		cs1550_group_index index;
+		size_t end = offset + size;
+		size_t new_size = end > file_size ? end : file_size;
+		size_t pos = offset;
+		int r;
+
+		while (pos < end) {
+			int g = pos / COMPRESS_GROUP_SIZE;
+			int in_group = pos % COMPRESS_GROUP_SIZE;
+			int n = COMPRESS_GROUP_SIZE - in_group;
+			if ((size_t)n > end - pos) n = end - pos;
+			int group_len = new_size - (size_t)g * COMPRESS_GROUP_SIZE;
+			if (group_len > COMPRESS_GROUP_SIZE) group_len = COMPRESS_GROUP_SIZE;
+
+			long b = load_group_index(fs, index_block, g, 1, &index);
+			if (b < 0) return -ENOSPC;
+			struct cs1550_group *group = &index.groups[g % GROUPS_PER_INDEX];
+			if ((r = read_group(fs, group, group_data)) != 0) return r;
+			memcpy(&group_data[in_group], &buf[pos - offset], n);
+			long old_start;
+			if ((r = write_group(fs, group, group_data, group_len, &old_start)) != 0) return r;
+			if (write_block(fs, b, &index) != 0) {
+				free_chain(fs, group->nStartBlock);
+				return -EIO;
+			}
+			free_chain(fs, old_start);
+			pos += n;
+		}
+		return size;
+	}
+
+	/*
+	* Cuts a compressed file down to size bytes. The last group that stays
+	* is rewritten to a new chain without the bytes past the end, and the
+	* groups and index blocks after it are freed once the index no longer
+	* points at them.
+	*/
+	static int truncate_compressed(FILE *fs, long index_block, size_t size) {
+		char group_data[COMPRESS_GROUP_SIZE];
+		cs1550_group_index index;
+		long dropped[GROUPS_PER_INDEX];
+		long old_start = -1;
+		int last = size > 0 ? (size - 1) / COMPRESS_GROUP_SIZE : -1;
+		int first = last < 0 ? 0 : last % GROUPS_PER_INDEX + 1;
+		int rewrote = 0;
+		int g, r;
+
+		long b = load_group_index(fs, index_block, last < 0 ? 0 : last, 0, &index);
+		if (b < 0) return -EIO;
+		struct cs1550_group *group = &index.groups[last < 0 ? 0 : last % GROUPS_PER_INDEX];
+		if (last >= 0 && size % COMPRESS_GROUP_SIZE != 0) {
+			if ((r = read_group(fs, group, group_data)) != 0) return r;
+			if ((r = write_group(fs, group, group_data, size - (size_t)last * COMPRESS_GROUP_SIZE, &old_start)) != 0) return r;
+			rewrote = 1;
+		}
+		for (g=first; g<GROUPS_PER_INDEX; g++) {
+			dropped[g] = index.groups[g].nStartBlock;
+			index.groups[g].nStartBlock = -1;
+			index.groups[g].nStoredSize = 0;
+			index.groups[g].nFlags = 0;
+		}
+		long rest = index.nNextBlock;
+		index.nNextBlock = -1;
+		if (write_block(fs, b, &index) != 0) {
+			if (rewrote) free_chain(fs, group->nStartBlock);
+			return -EIO;
+		}
+
+		free_chain(fs, old_start);
+		for (g=first; g<GROUPS_PER_INDEX; g++) free_chain(fs, dropped[g]);
+		release_file_data(fs, rest);
+		return 0;
+	}
+
+	/*
+	* Counts the blocks of a chain and the runs of consecutive blocks it is
+	* split into. Returns the number of runs, 0 for an empty chain.
+	*/
+	static int chain_fragments(FILE *fs, long start_block, int *blocks) {
+		cs1550_disk_block block;
+		long b = start_block, prev = -1;
+		int runs = 0;
+
+		*blocks = 0;
+		while (b >= 0 && *blocks < MAX_NUM_OF_BLOCKS && read_block(fs, b, &block) == 0) {
+			if (*blocks == 0 || b != prev + 1) runs++;
+			(*blocks)++;
+			prev = b;
+			b = block.nNextBlock;
+		}
+		return runs;
+	}
+
+	/*
+	* Fills out with the contents of FRAG_PATH: one line per file with a
+	* block chain, giving its path, its blocks and the runs they form.
+	*/
+	static void fragmentation_line(FILE *fs, const char *path, long dir_location, int index, struct cs1550_dir_slot *file, void *arg) {
+		struct cs1550_text *text = arg;
+		int blocks, runs;
+		(void) dir_location; (void) index;
+
+		if (file->nStartBlock < 0 || text->n >= text->len) return;
+		runs = chain_fragments(fs, file->nStartBlock, &blocks);
+		text->n += snprintf(&text->out[text->n], text->len - text->n, "%s %d %d\n", path, blocks, runs);
+	}
+
+	static int build_fragmentation(FILE *fs, char *out, size_t len) {
+		struct cs1550_text text = { out, len, 0 };
+
+		out[0] = '\0';
+		if (get_disk_features(fs) & FEATURE_COMPRESSION) return 0;
+		walk_files(fs, 0, fragmentation_line, &text);
+		return text.n < len ? (int)text.n : (int)len - 1;
+	}
+
+	/*
+	* Moves the chain of a file into one run of consecutive free blocks. The
+	* copy is written first and the directory entry switched over to it in
+	* one block write, so a crash in between only leaks the copy. Chains with
+	* shared blocks are left alone. Returns the blocks moved, 0 if nothing
+	* was done, or a negative errno.
+	*/
+	static int defrag_file(FILE *fs, long dir_location, int file_index) {
+		cs1550_dir dir;
+		cs1550_free_space_tracker *tracker;
+		cs1550_disk_block *chain;
+		long *old;
+		long b, run;
+		int n = 0, i, blocks;
+
+		if (get_disk_features(fs) & FEATURE_COMPRESSION) return 0;
+		if (block_refcount(fs, dir_location) != 1 || load_dir(fs, dir_location, 0, &dir) != 0) return 0;
+		b = dir.files[file_index].nStartBlock;
+		if (dir.files[file_index].nNameLen == 0 || b < 0) return 0;
+		if (chain_fragments(fs, b, &blocks) <= 1) return 0;
+
+		chain = malloc(blocks * sizeof(cs1550_disk_block));
+		old = malloc(blocks * sizeof(long));
+		tracker = get_tracker(fs);
+		while (b >= 0 && n < blocks && block_refcount(fs, b) == 1 && read_block(fs, b, &chain[n]) == 0) {
+			old[n++] = b;
+			b = chain[n-1].nNextBlock;
+		}
+
+		/** First fit for the whole chain **/
+		run = -1;
+		if (n == blocks && tracker != NULL) {
+			int free_run = 0;
+			for (i=1; i<TRACKER_START_BLOCK; i++) {
+				free_run = tracker->data[i] == 0 ? free_run + 1 : 0;
+				if (free_run == n) { run = i - n + 1; break; }
+			}
+		}
+		if (run < 0) {
+			free(chain); free(old);
+			return 0;
+		}
+
+		int r = 0;
+		for (i=0; i<n; i++) {
+			if (set_block_refcount(fs, run + i, 1) != 0) r = -EIO;
+			chain[i].nNextBlock = i + 1 < n ? run + i + 1 : -1;
+		}
+		for (i=0; r == 0 && i<n; i++) {
+			if (write_block(fs, run + i, &chain[i]) != 0) r = -EIO;
+		}
+		if (r == 0) {
+			dir.files[file_index].nStartBlock = run;
+			if (store_dir(fs, dir_location, 0, &dir) != 0) r = -EIO;
+		}
+		if (r != 0) {
+			for (i=0; i<n; i++) set_block_free(fs, run + i);
+		} else {
+			for (i=0; i<n; i++) {
+				block_unref(fs, old[i]);
+				if (dedup_index != NULL) dedup_index_insert(block_hash(&chain[i]), run + i);
+			}
+			printf("defrag_file(): moved %i blocks of the file in slot %i of block %li to blocks %li-%li\n", n, file_index, dir_location, run, run + n - 1);
+		}
+		free(chain); free(old);
+		return r == 0 ? n : r;
+	}
+
+	static void count_file_usage(FILE *fs, const char *path, long dir_location, int index, struct cs1550_dir_slot *file, void *arg) {
+		struct cs1550_usage *u = arg;
+		cs1550_disk_block block;
+		cs1550_group_index group_index;
+		long b = file->nStartBlock;
+		int blocks, runs, g;
+		(void) path; (void) dir_location; (void) index;
+
+		if (u->features & FEATURE_COMPRESSION) {
+			/** Add up what the compressed files hold against what they take **/
+			if (b < 0) return;
+			u->logical += file->fsize;
+			while (b != -1 && read_block(fs, b, &group_index) == 0) {
+				u->stored_blocks++;
+				for (g=0; g<GROUPS_PER_INDEX; g++) {
+					u->stored += group_index.groups[g].nStoredSize;
+					u->stored_blocks += (group_index.groups[g].nStoredSize + MAX_DATA_IN_BLOCK - 1) / MAX_DATA_IN_BLOCK;
+				}
+				b = group_index.nNextBlock;
+			}
+			return;
+		}
+
+		/** How many runs of consecutive blocks the file chains are split into **/
+		if (b >= 0) {
+			runs = chain_fragments(fs, b, &blocks);
+			u->chained_files++;
+			u->fragments += runs;
+			if (runs > 1) u->fragmented_files++;
+		}
+
+		/** Chains share whole tails, so count how many files reach each block **/
+		while (u->owners != NULL && b >= 0 && b < MAX_NUM_OF_BLOCKS && u->owners[b] < MAX_BLOCK_REFS && read_block(fs, b, &block) == 0) {
+			if (u->owners[b]++ == 1) u->shared_blocks++;
+			if (u->owners[b] > 1) u->saved_blocks++;
+			b = block.nNextBlock;
+		}
+	}
+
+	/*
+	* Fills out with the contents of STATS_PATH.
+	*/
+	static int build_stats(FILE *fs, char *out, size_t len) {
+		struct cs1550_usage u;
+		int features = get_disk_features(fs);
+		int i;
+
+		memset(&u, 0, sizeof(struct cs1550_usage));
+		u.features = features;
+		if (features & FEATURE_DEDUP) u.owners = calloc(MAX_NUM_OF_BLOCKS, 1);
+		walk_files(fs, 0, count_file_usage, &u);
+		free(u.owners);
+
+		cs1550_snapshot_table table;
+		int snapshots = 0;
+		load_snapshot_table(fs, &table, 0);
+		for (i=0; i<MAX_SNAPSHOTS; i++) {
+			if (table.snapshots[i].name[0] != '\0') snapshots++;
+		}
+
+		int n = snprintf(out, len,
+			"features: 0x%x\n"
+			"blocks_total: %d\n"
+			"blocks_free: %ld\n"
+			"checksum_errors: %lu\n"
+			"blocks_scrubbed: %lu\n"
+			"dedup_shared_blocks: %lu\n"
+			"dedup_saved_blocks: %lu\n"
+			"compressed_logical_bytes: %llu\n"
+			"compressed_stored_bytes: %llu\n"
+			"compressed_blocks: %llu\n"
+			"compression_ratio: %.2f\n"
+			"snapshots: %d\n"
+			"chained_files: %lu\n"
+			"fragmented_files: %lu\n"
+			"fragments: %lu\n"
+			"defrag_moved_files: %lu\n"
+			"defrag_moved_blocks: %lu\n"
+			"log_segments_written: %lu\n"
+			"log_blocks_absorbed: %lu\n"
+			"log_blocks_cleaned: %lu\n"
+			"handle_hits: %lu\n"
+			"handle_position_hits: %lu\n",
+			features, MAX_NUM_OF_BLOCKS, count_free_blocks(fs), checksum_errors, blocks_scrubbed, u.shared_blocks, u.saved_blocks,
+			u.logical, u.stored, u.stored_blocks, u.stored ? (double)u.logical / u.stored : 1.0, snapshots,
+			u.chained_files, u.fragmented_files, u.fragments, defrag_moved_files, defrag_moved_blocks,
+			log_segments_written, log_blocks_absorbed, log_blocks_cleaned, handle_hits, handle_position_hits);
+
+		//One line per top-level directory with a limit; 0 is no limit
+		for (i=0; i<MAX_DIR_SLOTS && n < (int)len; i++) {
+			struct cs1550_quota *q = &quotas[i];
+			if (q->name[0] == '\0' || (q->nBlockLimit <= 0 && q->nEntryLimit <= 0)) continue;
+			n += snprintf(out + n, len - n, "quota %s: %ld/%ld blocks, %ld/%ld entries\n",
+				q->name, q->nBlocks, q->nBlockLimit, q->nEntries, q->nEntryLimit);
+		}
+		return n < (int)len ? n : (int)len - 1;
+	}
+
+	/*
+	* Removes an empty directory. Its block is freed unless a snapshot still
+	* shares it.
+	*/
+	static int cs1550_rmdir(const char *path)
+	{
+		char parent_path[PATH_MAX];
+		char name[MAX_NAME_LEN + 1];
+		struct cs1550_dentry parent, d;
+		long released[2];
+		int i;
+
+		/** rmdir under SNAP_DIR deletes a snapshot **/
+		if (is_snapshot_path(path)) {
+			if (strcmp(path, SNAP_DIR) == 0) return -EBUSY;
+			if (strchr(path + strlen(SNAP_DIR) + 1, '/') != NULL) return -EROFS;
+			return delete_snapshot(path + strlen(SNAP_DIR) + 1);
+		}
+		int r = split_path(path, parent_path, name);
+		if (r != 0) return r == -EINVAL ? -EBUSY : r;
+
+		FILE *fs = open_disk("rb+");
+		if (fs == NULL) return -EIO;
+
+		/** Only the parent changes, so only it is unshared from any snapshot **/
+		r = resolve_path(fs, 0, parent_path, &parent, 1);
+		if (r == 0 && !parent.is_dir) r = -ENOTDIR;
+		if (r == 0) r = lookup_name(fs, parent.block, parent.parent < 0, name, &d, 0);
+		if (r == 0 && !d.is_dir) r = -ENOTDIR;
+
+		cs1550_dir *dir = malloc(sizeof(cs1550_dir));
+		if (r == 0 && load_dir(fs, d.block, 0, dir) != 0) r = -EIO;
+		for (i=0; r == 0 && i<MAX_DIR_SLOTS; i++) {
+			if (dir->files[i].nNameLen != 0) r = -ENOTEMPTY;
+		}
+
+		/** Take the entry and its attributes out of the parent **/
+		if (r == 0 && load_dir(fs, d.parent, d.parent_is_root, dir) != 0) r = -EIO;
+		if (r == 0) r = xattr_move(fs, dir, name, NULL, NULL, released);
+		if (r == 0) {
+			dir->files[d.index].nNameLen = 0;
+			dir->nFiles--;
+			r = store_dir(fs, d.parent, d.parent_is_root, dir);
+		}
+		if (r == 0) {
+			xattr_release(fs, released[0]);
+			release_directory(fs, d.block);
+			printf("cs1550_rmdir(): removed %s\n", path);
+		}
+		//A top-level directory takes its quota with it
+		struct cs1550_quota *top = d.parent_is_root ? quota_find(name) : NULL;
+		if (r == 0 && top != NULL) memset(top, 0, sizeof(struct cs1550_quota));
+		else if (r == 0) quota_charge(quota_of(path), -1, -1);
+
+		//Long name slots are renumbered when an entry goes
+		dentry_cache_clear();
+		attr_cache_invalidate(path);
+		free(dir);
+		fclose(fs);
+		return r;
+	}
+
+	static int initialize_filesystem() {
+		int r = 0;
+		int w = 0;
+		char* filename = "./.disk";
+		FILE *fs = open_disk("rb+");
+		if (fs == NULL) {
+			int err = errno;
+			r = 1;
+			printf("initialize_filesystem(): could not open %s errno: %s\n", filename,strerror(err));
+		} else {
+			/** Create root directory **/
+			cs1550_root_directory *root = calloc(1, sizeof(cs1550_root_directory));
+			root->nDirectories = 0;
+			int i;
+			for (i=0;i<MAX_DIRS_IN_ROOT;i++) strcpy(root->directories[i].dname, "");
+			fseek(fs, 0, SEEK_SET);
+			w = fwrite(root, sizeof(cs1550_root_directory), 1, fs);
+			if (w != 1) printf("initialize_filesystem(): fwrite() failed to write root directory to disk. errno: %s\n", strerror(errno));
+			else printf("initialize_filesystem(): root directory initialized.\n");
+
+			/** Create superblock **/
+			cs1550_superblock *sb = calloc(1, sizeof(cs1550_superblock));
+			sb->nMagic = CS1550_MAGIC;
+			if (options.inline_small_files) sb->nFeatures |= FEATURE_INLINE_SMALL_FILES;
+			if (options.checksums) sb->nFeatures |= FEATURE_CHECKSUMS;
+			if (options.compression) sb->nFeatures |= FEATURE_COMPRESSION;
+			if (options.dedup) sb->nFeatures |= FEATURE_DEDUP;
+			if (options.long_names) sb->nFeatures |= FEATURE_LONG_NAMES;
+			if (options.log) sb->nFeatures |= FEATURE_LOG;
+			sb->nPackBlock = NO_BLOCK;
+			if (write_superblock(fs, sb) == 0) printf("initialize_filesystem(): superblock initialized with features 0x%x.\n", sb->nFeatures);
+			disk_features = sb->nFeatures;
+
+			/** Clear the checksum table **/
+			if (sb->nFeatures & FEATURE_CHECKSUMS) {
+				char *zero = calloc(CSUM_BLOCKS, BLOCK_SIZE);
+				fseek(fs, CSUM_START_BLOCK * BLOCK_SIZE, SEEK_SET);
+				if (fwrite(zero, BLOCK_SIZE, CSUM_BLOCKS, fs) != CSUM_BLOCKS) printf("initialize_filesystem(): fwrite() failed to clear checksum table. errno: %s\n", strerror(errno));
+				if (csum_map != NULL) memset(csum_map, 0, CSUM_BLOCKS * BLOCK_SIZE);
+				free(zero);
+			}
+
+			/** Clear the log **/
+			if (sb->nFeatures & FEATURE_LOG) {
+				char *zero = calloc(LOG_BLOCKS, BLOCK_SIZE);
+				fseek(fs, LOG_START_BLOCK * BLOCK_SIZE, SEEK_SET);
+				if (fwrite(zero, BLOCK_SIZE, LOG_BLOCKS, fs) != LOG_BLOCKS) printf("initialize_filesystem(): fwrite() failed to clear the log. errno: %s\n", strerror(errno));
+				free(zero);
+			}
+
+			/** Create free space tracker **/
+			cs1550_free_space_tracker *free_space = calloc(1, sizeof(cs1550_free_space_tracker));
+			free_space->data[0] = 1; // show first block as allocated for root
+			// need to mark as allocated the space used for the superblock and the tracker!
+			for (i=SUPERBLOCK_BLOCK;i<MAX_NUM_OF_BLOCKS;i++) free_space->data[i] = 1;
+			if (sb->nFeatures & FEATURE_CHECKSUMS) {
+				for (i=CSUM_START_BLOCK;i<SUPERBLOCK_BLOCK;i++) free_space->data[i] = 1;
+			}
+			if (sb->nFeatures & FEATURE_LOG) {
+				for (i=LOG_START_BLOCK;i<CSUM_START_BLOCK;i++) free_space->data[i] = 1;
+			}
+			fseek(fs, TRACKER_START_BLOCK * BLOCK_SIZE, SEEK_SET);
+			w = fwrite(free_space, sizeof(cs1550_free_space_tracker), 1, fs);
+			if (w != 1) printf("initialize_filesystem(): fwrite() failed to write free space tracker to disk. errno: %s\n", strerror(errno));
+			else printf("initialize_filesystem(): free space tracker initialized and written to byte position %i.\n", TRACKER_START_BLOCK * BLOCK_SIZE);
+			if (tracker_map != NULL) memcpy(tracker_map, free_space, sizeof(cs1550_free_space_tracker));
+			free_blocks = -1;
+			shared_blocks = -1;
+			dir_cache_clear();
+			xattr_cache_clear();
+			free(pack_room);
+			pack_room = NULL;
+			free(free_space);
+			free(sb);
+			free(root);
+		}
+
+		if (fs != NULL) fclose(fs);
+
+		return r;
+	}
+
+	/*
+	* Does the actual creation of a file. Mode and dev can be ignored.
+	*
+	*/
+	static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+	{
+		(void) mode;
+		(void) dev;
+
+		char parent_path[PATH_MAX];
+		char name[MAX_NAME_LEN + 1];
+		struct cs1550_dentry parent, d;
+		int i = 0;
+
+		if (is_snapshot_path(path)) return -EROFS;
+
+		/** Check filename length. Whether the name suits the disk's
+		directory format is checked when it is added. **/
+		int r = split_path(path, parent_path, name);
+		if (r != 0) {
+			printf("cs1550_mknod(): bad filename or extension for %s.\n", path);
+			return r;
+		}
+
+		/** Check if the file already exists
+		If it doesn't, create it.    **/
+		char* diskname = "./.disk";
+		FILE *fs = open_disk("rb+");
+		cs1550_dir *dir = malloc(sizeof(cs1550_dir));
+		if (fs == 0) {
+			printf("cs1550_mknod(): could not open %s errno: %s\n", diskname,strerror(errno));
+			free(dir);
+			return -EIO;
+		} else {
+			/** Find the directory that this file would be in, taking it over
+			from any snapshot that shares it before it changes. **/
+			r = resolve_path(fs, 0, parent_path, &parent, 1);
+			if (r == 0 && !parent.is_dir) r = -ENOTDIR;
+			/** Check if file creation is happening in root directory **/
+			if (r == 0 && parent.parent < 0) {
+				printf("cs1550_mknod(): file at path %s being created in root directory.\n", path);
+				r = -EPERM;
+			}
+			if (r == 0) {
+				r = lookup_name(fs, parent.block, 0, name, &d, 0);
+				r = r == 0 ? -EEXIST : (r == -ENOENT ? 0 : r);
+			}
+			long dir_location = parent.block;
+			if (r == 0 && load_dir(fs, dir_location, 0, dir) != 0) r = -EIO;
+			if (r == 0) {
+				i = dir_add(fs, dir, 0, name, 0, NO_BLOCK);
+				if (i < 0) r = i;
+			}
+			if (r != 0) {
+				fclose(fs);
+				free(dir);
+				return r;
+			}
+			int slot = i;
+
+			/** Directory has been searched, file has not been found.
+			Create the file. With inline small files, an empty file
+			does not get a block until data is written to it. **/
+			cs1550_superblock sb;
+			read_superblock(fs, &sb);
+			int inline_file = (sb.nFeatures & FEATURE_INLINE_SMALL_FILES) != 0;
+			long block_to_write = NO_BLOCK;
+			int compressed = (sb.nFeatures & FEATURE_COMPRESSION) != 0;
+			struct cs1550_quota *q = quota_of(path);
+			r = quota_charge(q, inline_file ? 0 : 1, 1);
+			if (r != 0) { fclose(fs); free(dir); return r; }
+			if (!inline_file && compressed) {
+				block_to_write = new_group_index(fs);
+				if (block_to_write < 0) { quota_charge(q, -1, -1); fclose(fs); free(dir); return -ENOSPC; }
+			} else if (!inline_file) {
+				block_to_write = find_data_block(fs);
+				if (block_to_write < 0) { quota_charge(q, -1, -1); fclose(fs); free(dir); return -ENOSPC; }
+				set_block_allocated(fs, block_to_write);
+			}
+			/** Edit and write directory structure **/
+			i = slot;
+			dir->files[i].nStartBlock = block_to_write;
+			printf("cs1550_mknod(): updating directory entry with filename %s to byte location %li\n", name, dir_location*BLOCK_SIZE);
+			int w = store_dir(fs, dir_location, 0, dir);
+			if (w!=0) printf("cs1550_mknod(): fwrite failed to write updated directory entry to disk.\n");
+			dentry_cache_invalidate(dir_location, name);
+
+			/** Create and write new file structure **/
+			if (!inline_file && !compressed) {
+				cs1550_disk_block *new_file=malloc(sizeof(cs1550_disk_block));
+				memset(new_file->data, 0, MAX_DATA_IN_BLOCK);
+				new_file->nNextBlock = -1;
+
+				w = write_block(fs, block_to_write, new_file);
+				if (w!=0) printf("cs1550_mknod(): fwrite failed to write new file entry to disk.\n");
+				else printf("cs1550_mknod(): Wrote new file entry to disk.\n");
+				free(new_file);
+			}
+
+		}
+
+		if (fs!=NULL) fclose(fs);
+		free(dir);
+		printf("cs1550_mknod(): Returning success from function.\n");
+		return 0;
+	}
+
+	/*
+	* Deletes a file. Its blocks are freed unless a snapshot, a copy or
+	* deduplication still shares them.
+	*/
+	static int cs1550_unlink(const char *path)
+	{
+		struct cs1550_dentry d;
+		char name[MAX_NAME_LEN + 1];
+		long released[2];
+
+		if (is_snapshot_path(path)) return -EROFS;
+		if (strcmp(path, STATS_PATH) == 0 || strcmp(path, FRAG_PATH) == 0) return -EPERM;
+
+		FILE *fs = open_disk("rb+");
+		if (fs == NULL) return -EIO;
+		int r = resolve_path(fs, 0, path, &d, 1);
+		if (r == 0 && d.is_dir) r = -EISDIR;
+		if (r != 0) {
+			fclose(fs);
+			return r;
+		}
+		sync_forget_tree(path);
+
+		cs1550_dir *dir = malloc(sizeof(cs1550_dir));
+		if (load_dir(fs, d.parent, 0, dir) != 0) r = -EIO;
+		if (r == 0) {
+			dir_entry_name(dir, d.index, name);
+			r = xattr_move(fs, dir, name, NULL, NULL, released);
+		}
+		if (r == 0) {
+			dir->files[d.index].nNameLen = 0;
+			dir->nFiles--;
+			r = store_dir(fs, d.parent, 0, dir);
+		}
+		if (r == 0) xattr_release(fs, released[0]);
+		if (r == 0 && d.block != NO_BLOCK) release_file_data(fs, d.block);
+		if (r == 0) quota_charge(quota_of(path), -quota_file_blocks(d.block, d.size), -1);
+		if (r == 0) printf("cs1550_unlink(): deleted %s\n", path);
+
+		//Long name slots are renumbered when an entry goes
+		dentry_cache_clear();
+		attr_cache_invalidate(path);
+		free(dir);
+		fclose(fs);
+		return r;
+	}
+
+	/*
+	* Read size bytes from file into buf starting from offset
+	*
+	*/
+	static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+		struct fuse_file_info *fi)
+		{
+			printf("cs1550_read() called on %s\n", path);
+			(void) buf;
+			(void) offset;
+			(void) fi;
+			(void) path;
+
+			if (strcmp(path, STATS_PATH) == 0 || strcmp(path, FRAG_PATH) == 0) {
+				int frag = strcmp(path, FRAG_PATH) == 0;
+				char *stats = malloc(frag ? FRAG_MAX : STATS_MAX);
+				FILE *fs = open_disk("rb");
+				if (fs == NULL) { free(stats); return -EIO; }
+				int len = frag ? build_fragmentation(fs, stats, FRAG_MAX) : build_stats(fs, stats, STATS_MAX);
+				fclose(fs);
+				if (offset >= len) size = 0;
+				else if (size > (size_t)(len - offset)) size = len - offset;
+				memcpy(buf, &stats[offset], size);
+				free(stats);
+				return size;
+			}
+
+			//Inside a snapshot, look the rest of the path up from its root
+			long root_block = 0;
+			if (is_snapshot_path(path)) {
+				int r = resolve_snapshot(&path, &root_block);
+				if (r != 0) return r;
+				if (root_block < 0) return -EISDIR;
+			}
+
+			if (size <=0) { printf("cs1550_read(): Size <= 0.\n"); return 0; }
+			/*********************/
+			/** Open filesystem, try to find file **/
+			FILE *fs = open_disk("rb");
+			assert(fs != 0);
+			printf("cs1550_read(): Reading size: %i from offset: %i\n", size, offset);
+
+			/** FIND FILE, through the open handle when it is still good **/
+			struct cs1550_dentry d;
+			int found = 0;
+			if (root_block != 0 || handle_find(fs, fi, path, &d, 0) != 0) {
+				found = resolve_path(fs, root_block, path, &d, 0);
+				if (found == 0 && !d.is_dir && root_block == 0) handle_note(fi, &d, 0);
+			}
+			if (found == 0 && d.is_dir) { printf("cs1550_read(): Path is a directory.\n"); found = -EISDIR; }
+			if (found != 0) {
+				if (fs!=NULL) fclose(fs);
+				return found;
+			}
+			long file_start_block = d.block;
+			int file_size = d.size;
+			printf("cs1550_read(): Found file %s at block %li\n", path, file_start_block);
+			//Reading at or past the end finds nothing, like any other file
+			if (offset > file_size) {
+				printf("cs1550_read(): offset > file_size.\n");
+				if (fs!=NULL) fclose(fs);
+				return 0;
+			}
+
+			/** INLINE FILES: no block yet, or data kept in a pack slot **/
+			if (file_start_block == NO_BLOCK || IS_PACKED_REF(file_start_block)) {
+				char slot[SMALL_FILE_SLOT_SIZE];
+				int to_read = file_size - offset;
+				if (to_read > (int)size) to_read = size;
+				if (to_read > 0) {
+					if (read_pack_slot(fs, file_start_block, slot) != 0) { if (fs!=NULL) fclose(fs); return -EIO; }
+					memcpy(buf, &slot[offset], to_read);
+				} else to_read = 0;
+				printf("cs1550_read(): Read %i bytes of inline file %s\n", to_read, path);
+				if (fs!=NULL) fclose(fs);
+				return to_read;
+			}
+
+			/** COMPRESSED FILES: only the groups in range are decompressed **/
+			if (get_disk_features(fs) & FEATURE_COMPRESSION) {
+				int r = read_compressed(fs, file_start_block, file_size, buf, size, offset);
+				printf("cs1550_read(): Read %i bytes of compressed file %s\n", r, path);
+				if (fs!=NULL) fclose(fs);
+				return r;
+			}
+
+			/** Never walk past the end of the chain **/
+			if (size > (size_t)(file_size - offset)) size = file_size - offset;
+			if (size == 0) { if (fs!=NULL) fclose(fs); return 0; }
+
+			cs1550_disk_block *curr_block = malloc(sizeof(cs1550_disk_block));
+			int bytes_read = 0;
+			int beginning_byte_in_block = offset; // when we are in the correct block,
+																					// this variable will be < MAX_DATA_IN_BLOCK,
+																					// >= 0, and will refer to the first byte in
+																					// this block that we want to read
+			/** Start where the last access through the handle ended, if that
+			is not past the offset, else at the first block of the file **/
+			long next_block = file_start_block;
+			long block_index = 0, pos_index, pos_block;
+			if (handle_position(fi, file_start_block, &pos_index, &pos_block) == 0 && pos_index * (long)MAX_DATA_IN_BLOCK <= offset) {
+				next_block = pos_block;
+				block_index = pos_index;
+				beginning_byte_in_block = offset - pos_index * MAX_DATA_IN_BLOCK;
+			}
+			if ( read_block(fs, next_block, curr_block) != 0 ) {
+				printf("cs1550_read(): Could not read first disk block from disk.\n");
+				if (fs!=NULL) fclose(fs);
+				free(curr_block);
+				return -EIO;
+			}
+			else printf("cs1550_read(): Read first file block at block %li from disk.\n", next_block);
+
+			/** FIND THE FILE BLOCK THAT CONTAINS BYTE AT OFFEST **/
+			/** AFTER THIS WHILE LOOP, curr_block WILL BE THE BLOCK WE WANT **/
+			/** IF OFFSET IS IN THE FIRST BLOCK OF FILE, THIS WHILE IS BYPASSED **/
+			while ( beginning_byte_in_block >= (int)MAX_DATA_IN_BLOCK ) {
+				next_block = curr_block->nNextBlock;
+				if ( next_block < 0 || read_block(fs, next_block, curr_block) != 0 ) {
+					printf("cs1550_read(): Could not read block %li from disk.\n", next_block);
+					if (fs!=NULL) fclose(fs);
+					free(curr_block);
+					return -EIO;
+				}
+				block_index++;
+
+				beginning_byte_in_block = beginning_byte_in_block - MAX_DATA_IN_BLOCK;
+			}
+			printf("cs1550_read(): Beginning read from block %li\n", next_block);
+			/** curr_block contains the first block we are going to read **/
+
+			/** BEGIN READING FILE **/
+			/** Read the first block. Outside of while because
+					we may not be reading it from the beginning. **/
+			int bytes_remaining_to_read = MAX_DATA_IN_BLOCK - beginning_byte_in_block;
+			if (bytes_remaining_to_read > (int)size) bytes_remaining_to_read = size;
+			memcpy(&buf[bytes_read], &curr_block->data[beginning_byte_in_block], bytes_remaining_to_read);
+			bytes_read = bytes_read + bytes_remaining_to_read;
+			while ( bytes_read < (int)size ) {
+				bytes_remaining_to_read = size - bytes_read;
+				next_block = curr_block->nNextBlock;
+				if ( next_block < 0 || read_block(fs, next_block, curr_block) != 0 ) {
+					printf("cs1550_read(): Could not read block %li from disk.\n", next_block);
+					if (fs!=NULL) fclose(fs);
+					free(curr_block);
+					return -EIO;
+				}
+				block_index++;
+				if (bytes_remaining_to_read < (int)MAX_DATA_IN_BLOCK) { memcpy(&buf[bytes_read], curr_block->data, bytes_remaining_to_read); bytes_read = bytes_read + bytes_remaining_to_read; }
+				else { memcpy(&buf[bytes_read], curr_block->data, MAX_DATA_IN_BLOCK); bytes_read = bytes_read + MAX_DATA_IN_BLOCK; }
+
+			}
+			printf("cs1550_read(): Done reading file. Read %i bytes. Was supposed to read %i\n", bytes_read, size);
+			handle_set_position(fi, file_start_block, block_index, next_block);
+
+			if (fs!=NULL) fclose(fs);
+			free(curr_block);
+			return size;
+		}
+
+		/*
+		* Write size bytes from buf into file starting from offset
+		*
+		*/
+		static int cs1550_write(const char *path, const char *buf, size_t size,
+			off_t offset, struct fuse_file_info *fi)
+			{
+				(void) buf;
+				(void) offset;
+				(void) fi;
+				(void) path;
+
+				if (is_snapshot_path(path)) return -EROFS;
+				int file_size, file_index_in_directory_entry = -1;
+				long file_start_block = -1;
+
+				FILE *fs = open_disk("rb+");
+				cs1550_dir *dir = malloc(sizeof(cs1550_dir));
+				cs1550_disk_block *curr_block = malloc(sizeof(cs1550_disk_block));
+				assert(fs != 0);
+
+
+				/** Find File. The directories along the path are about to
+				change, so they are unshared from any snapshot on the way.
+				The open handle can skip that once a write has done it. **/
+				int shared = have_shared_blocks(fs);
+				struct cs1550_dentry d;
+				int found = 0;
+				if (handle_find(fs, fi, path, &d, 1) != 0) {
+					found = resolve_path(fs, 0, path, &d, 1);
+					if (found == 0 && !d.is_dir) handle_note(fi, &d, 1);
+				}
+				if (found == 0 && d.is_dir) found = -EISDIR;
+				if (found != 0) { printf("cs1550_write(): Directory or file does not exist.\n"); if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return found; }
+				long dir_location = d.parent;
+				file_index_in_directory_entry = d.index;
+				file_size = d.size;
+				file_start_block = d.block;
+				if ( load_dir(fs, dir_location, 0, dir) != 0 ) printf("cs1550_write(): Could not read directory from disk.\n");
+				if (size <= 0 ) { printf("cs1550_write(): Size <= 0 or offset > file_size. Size: %i Offset: %i File Size: %i\n", size, offset, file_size); if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return 0;}
+				if (offset > file_size) { if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return -EFBIG; }
+
+				/** Charge the quota up front for the blocks the file grows by **/
+				size_t new_size = (size_t)(offset + size) > (size_t)file_size ? (size_t)(offset + size) : (size_t)file_size;
+				int stays_inline = (file_start_block == NO_BLOCK || IS_PACKED_REF(file_start_block)) && new_size <= SMALL_FILE_SLOT_SIZE;
+				long old_blocks = quota_file_blocks(file_start_block, file_size);
+				long new_blocks = quota_file_blocks(stays_inline ? NO_BLOCK : 0, new_size);
+				if (options.max_file_blocks > 0 && new_blocks > options.max_file_blocks) { if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return -EFBIG; }
+				struct cs1550_quota *q = quota_of(path);
+				long charged = new_blocks - old_blocks;
+				if (quota_charge(q, charged, 0) != 0) { if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return -EDQUOT; }
+
+				/** INLINE FILES: a file that still fits in a slot is rewritten in its
+				pack block. One that outgrows the slot moves to a block chain. **/
+				if (file_start_block == NO_BLOCK || IS_PACKED_REF(file_start_block)) {
+					char slot[SMALL_FILE_SLOT_SIZE];
+					int new_size = file_size;
+					if ((int)(offset + size) > new_size) new_size = offset + size;
+					memset(slot, 0, SMALL_FILE_SLOT_SIZE);
+					if (IS_PACKED_REF(file_start_block)) read_pack_slot(fs, file_start_block, slot);
+
+					if (new_size <= SMALL_FILE_SLOT_SIZE) {
+						memcpy(&slot[offset], buf, size);
+						long ref = file_start_block;
+						if (IS_PACKED_REF(ref)) write_pack_slot(fs, ref, slot);
+						else ref = store_in_pack(fs, slot);
+						if (ref == NO_BLOCK) { quota_charge(q, -charged, 0); if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return -ENOSPC; }
+						dir->files[file_index_in_directory_entry].fsize = new_size;
+						dir->files[file_index_in_directory_entry].nStartBlock = ref;
+						if (store_dir(fs, dir_location, 0, dir) != 0) printf("cs1550_write(): Writing data to directory entry failed.\n");
+						printf("cs1550_write(): Wrote %i bytes to inline file %s\n", (int)size, path);
+						if (fs!=NULL) fclose(fs);
+						free(dir);
+						free(curr_block);
+						attr_cache_invalidate(path);
+						return size;
+					}
+
+					printf("cs1550_write(): Inline file %s outgrew its slot. Moving it to a block.\n", path);
+					long new_block_number;
+					if (get_disk_features(fs) & FEATURE_COMPRESSION) {
+						new_block_number = new_group_index(fs);
+						if (new_block_number < 0) { quota_charge(q, -charged, 0); if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return -ENOSPC; }
+						if (file_size > 0 && write_compressed(fs, new_block_number, 0, slot, file_size, 0) < 0) printf("cs1550_write(): Writing moved inline file to group index %li failed.\n", new_block_number);
+					} else {
+						new_block_number = find_data_block(fs);
+						if (new_block_number < 0) { quota_charge(q, -charged, 0); if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return -ENOSPC; }
+						set_block_allocated(fs, new_block_number);
+						memset(curr_block, 0, sizeof(cs1550_disk_block));
+						curr_block->nNextBlock = -1;
+						memcpy(curr_block->data, slot, file_size);
+						if (write_block(fs, new_block_number, curr_block) != 0) printf("cs1550_write(): Writing moved inline file to block %li failed.\n", new_block_number);
+					}
+					if (IS_PACKED_REF(file_start_block)) release_pack_slot(fs, file_start_block);
+					file_start_block = new_block_number;
+					dir->files[file_index_in_directory_entry].nStartBlock = file_start_block;
+				}
+
+				/** COMPRESSED FILES: rewrite just the groups the write covers **/
+				if (get_disk_features(fs) & FEATURE_COMPRESSION) {
+					if (shared) {
+						int r = unshare_index_chain(fs, dir, dir_location, file_index_in_directory_entry);
+						if (r != 0) { quota_charge(q, -charged, 0); if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return r; }
+						file_start_block = dir->files[file_index_in_directory_entry].nStartBlock;
+					}
+					int r = write_compressed(fs, file_start_block, file_size, buf, size, offset);
+					if (r >= 0) {
+						if ((size_t)(offset + size) > (size_t)file_size) dir->files[file_index_in_directory_entry].fsize = offset + size;
+						if (store_dir(fs, dir_location, 0, dir) != 0) printf("cs1550_write(): Writing data to directory entry failed.\n");
+					}
+					printf("cs1550_write(): Wrote %i bytes to compressed file %s\n", r, path);
+					if (r < 0) quota_charge(q, -charged, 0);
+					if (fs!=NULL) fclose(fs);
+					free(dir);
+					free(curr_block);
+					attr_cache_invalidate(path);
+					return r;
+				}
+				/** DEDUPLICATED, SNAPSHOTTED AND COPIED FILES: copy the shared
+				blocks this write could touch, and remember to deduplicate the
+				file again when it is closed **/
+				if ((get_disk_features(fs) & FEATURE_DEDUP) || shared) {
+					int r = unshare_chain(fs, dir, dir_location, file_index_in_directory_entry, (offset + size) / MAX_DATA_IN_BLOCK + 1);
+					if (r != 0) { quota_charge(q, -charged, 0); if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return r; }
+					file_start_block = dir->files[file_index_in_directory_entry].nStartBlock;
+				}
+				if ((get_disk_features(fs) & FEATURE_DEDUP) && strlen(path) < DEDUP_DIRTY_PATH_MAX) strcpy(dedup_dirty[path_hash(path) % DEDUP_DIRTY_SLOTS], path);
+
+				/** Error checking done, now retrieve file's first block, or the
+				one the last access through the handle ended in **/
+				long next_block = file_start_block;
+				long block_index = 0, pos_index, pos_block;
+				int bytes_until_at_offset = (int)offset;
+				if (handle_position(fi, file_start_block, &pos_index, &pos_block) == 0 && pos_index * (long)MAX_DATA_IN_BLOCK <= offset) {
+					next_block = pos_block;
+					block_index = pos_index;
+					bytes_until_at_offset = offset - pos_index * MAX_DATA_IN_BLOCK;
+				}
+				printf("cs1550_write(): File to write to is located at block %li\n", file_start_block);
+				if ( read_block(fs, next_block, curr_block) != 0 ) printf("cs1550_write(): Could not read first disk block from disk.\n");
+				/** END RETRIEVING FILE'S FIRST BLOCK **/
+
+				/** Find the block of the file that the offset points to. An
+				offset at the end of a file that fills its last block exactly
+				is the start of a block the file does not have yet. **/
+				while (bytes_until_at_offset >= (int)MAX_DATA_IN_BLOCK) {
+					printf("cs1550_write(): bytes_until_at_offset >= MAX_DATA_IN_BLOCK. bytes_until_at_offset: %i MAX_DATA_IN_BLOCK: %i\n", bytes_until_at_offset, MAX_DATA_IN_BLOCK);
+					if (curr_block->nNextBlock < 0) {
+						long new_block_number = find_data_block(fs);
+						if (new_block_number < 0) { quota_charge(q, -charged, 0); if (fs!=NULL) fclose(fs); free(dir); free(curr_block); return -ENOSPC; }
+						set_block_allocated(fs, new_block_number);
+						curr_block->nNextBlock = new_block_number;
+						if (write_block(fs, next_block, curr_block) != 0) printf("cs1550_write(): Writing data to file block %li failed.\n", next_block);
+						next_block = new_block_number;
+						memset(curr_block, 0, sizeof(cs1550_disk_block));
+						curr_block->nNextBlock = -1;
+					} else {
+						next_block = curr_block->nNextBlock;
+						if ( read_block(fs, next_block, curr_block) != 0 ) printf("cs1550_write(): Could not read %li'th disk block from disk.\n", next_block);
+					}
+					block_index++;
+					bytes_until_at_offset = bytes_until_at_offset-(int)MAX_DATA_IN_BLOCK;
+				}
+				printf("cs1550_write(): Retrieved first block of the write. It is block %li\n", next_block);
+				/** END RETRIEVAL OF BLOCK **/
+
+				/** Fill the blocks from there on. A write in the middle of the
+				file carries on into the blocks the file already has, and only
+				allocates new ones once it runs past the end of the chain. **/
+				int bytes_written = 0;
+				int w;
+				while (bytes_written < (int)size) {
+					int bytes_to_write = MAX_DATA_IN_BLOCK - bytes_until_at_offset;
+					if (bytes_to_write > (int)size - bytes_written) bytes_to_write = size - bytes_written;
+					memcpy(&curr_block->data[bytes_until_at_offset], &buf[bytes_written], bytes_to_write);
+
+					long following = curr_block->nNextBlock;
+					int fresh = 0;
+					if (bytes_written + bytes_to_write < (int)size && following < 0) {
+						following = find_data_block(fs);
+						if (following >= 0) {
+							set_block_allocated(fs, following);
+							curr_block->nNextBlock = following;
+							fresh = 1;
+						}
+					}
+					w = write_block(fs, next_block, curr_block);
+					if (w!=0) printf("cs1550_write(): Writing data to file block %li failed.\n", next_block);
+					else printf("cs1550_write(): File data written to disk block %li.\n", next_block);
+					bytes_written = bytes_written + bytes_to_write;
+					bytes_until_at_offset = 0;
+					if (bytes_written == (int)size) break;
+					if (following < 0) {
+						printf("cs1550_write(): Disk is full after %i bytes.\n", bytes_written);
+						break;
+					}
+
+					/** A block that was just allocated has nothing to read yet **/
+					next_block = following;
+					block_index++;
+					if (fresh) {
+						memset(curr_block, 0, sizeof(cs1550_disk_block));
+						curr_block->nNextBlock = -1;
+					} else if ( read_block(fs, next_block, curr_block) != 0 ) printf("cs1550_write(): Could not read %li'th disk block from disk.\n", next_block);
+				}
+				/** END WRITING BLOCKS **/
+				handle_set_position(fi, file_start_block, block_index, next_block);
+
+				/** UPDATE FILE'S DIR ENTRY WITH NEW SIZE **/
+				if ((size_t)(offset + bytes_written) > (size_t)file_size) dir->files[file_index_in_directory_entry].fsize = offset + bytes_written;
+				//Give back what a short write did not use
+				quota_charge(q, quota_file_blocks(file_start_block, dir->files[file_index_in_directory_entry].fsize) - old_blocks - charged, 0);
+				w = store_dir(fs, dir_location, 0, dir); //update the DIRECTORY entry
+				if (w!=0) printf("cs1550_write(): Writing data to directory entry failed.\n");
+
+				if (fs!=NULL) fclose(fs);
+				free(dir);
+				free(curr_block);
+				attr_cache_invalidate(path);
+				return bytes_written > 0 ? bytes_written : -ENOSPC;
+			}
+
+			/*
+			* Forces everything written through fs so far to stable storage.
+			*/
+			static void sync_disk(FILE *fs) {
+				int i;
+				fflush(fs);
+				if (ram_disk != NULL) return;
+				if (stripe_count > 0) {
+					for (i=0; i<stripe_count; i++) fsync(stripe_fds[i]);
+				} else {
+					fsync(fileno(fs));
+				}
+			}
+
+			/*
+			* Called once at mount. A blank disk is formatted; otherwise its
+			* superblock is read once, along with the free space tracker, the
+			* checksum table and the root directory. Other directories are read
+			* the first time they are used. A disk that was not unmounted cleanly
+			* has its free blocks counted again and its pack block checked. It
+			* stays marked as not clean until unmount_disk. Anything left in the
+			* log is copied home first.
+			*/
+			static int mount_disk(void) {
+				cs1550_superblock sb;
+				cs1550_dir root;
+				FILE *fs = open_disk("rb+");
+				if (fs == NULL) {
+					printf("mount_disk(): could not open the disk. errno: %s\n", strerror(errno));
+					return -1;
+				}
+				cs1550_free_space_tracker *tracker = get_tracker(fs);
+				if (tracker == NULL) {
+					fclose(fs);
+					return -1;
+				}
+				read_superblock(fs, &sb);
+
+				//Block 0 holds the root directory, so only a blank disk has it free.
+				//The old format kept its tracker in the last block alone.
+				if (sb.nMagic != CS1550_MAGIC) {
+					char old_root = 0;
+					fseek(fs, DISKSIZE_IN_BYTES - BLOCK_SIZE, SEEK_SET);
+					if (tracker->data[0] != 0 || fread(&old_root, 1, 1, fs) != 1 || old_root != 0) {
+						printf("mount_disk(): the disk was initialized without a superblock, by an older version. Copy its files off with that version and initialize it again.\n");
+						fclose(fs);
+						return -1;
+					}
+					printf("mount_disk(): Filesystem found to NOT be initialized.\n");
+					fclose(fs);
+					initialize_filesystem();
+					fs = open_disk("rb+");
+					if (fs == NULL) return -1;
+					read_superblock(fs, &sb);
+				}
+				disk_features = sb.nFeatures;
+				shared_blocks = -1;
+				if ((disk_features & FEATURE_CHECKSUMS) && get_checksums(fs) == NULL) {
+					fclose(fs);
+					return -1;
+				}
+				log_load(fs);
+
+				if (sb.nMagic == CS1550_MAGIC) {
+					if (sb.nClean && sb.nFreeBlocks >= 0) {
+						free_blocks = sb.nFreeBlocks;
+					} else {
+						printf("mount_disk(): disk was not unmounted cleanly, checking it.\n");
+						free_blocks = -1;
+						if (sb.nPackBlock != NO_BLOCK && tracker->data[sb.nPackBlock] == 0) sb.nPackBlock = NO_BLOCK;
+					}
+					sb.nClean = 0;
+					write_superblock(fs, &sb);
+					sync_disk(fs);
+				}
+				printf("mount_disk(): %li blocks free.\n", count_free_blocks(fs));
+
+				if (dir_cache == NULL) {
+					dir_cache = malloc(DIR_CACHE_SLOTS * sizeof(struct cs1550_dir_cache_entry));
+					dir_cache_clear();
+				}
+				load_dir(fs, 0, 1, &root);
+				quota_load(fs);
+				fclose(fs);
+				return 0;
+			}
+
+			/*
+			* Marks the disk clean once everything else is on stable storage, and
+			* saves the free block count for the next mount.
+			*/
+			static void unmount_disk(void) {
+				cs1550_superblock sb;
+				FILE *fs = open_disk("rb+");
+				if (fs == NULL) return;
+				if (read_superblock(fs, &sb) == 0 && sb.nMagic == CS1550_MAGIC) {
+					if (log_map != NULL && log_clean(fs) != 0) printf("unmount_disk(): could not empty the log.\n");
+					sync_disk(fs);
+					sb.nClean = 1;
+					sb.nFreeBlocks = count_free_blocks(fs);
+					write_superblock(fs, &sb);
+					sync_disk(fs);
+				}
+				fclose(fs);
+			}
+
+			/*
+			* Sleeps for up to ns nanoseconds, waking early on destroy.
+			*/
+			static void scrub_sleep(long long ns) {
+				struct timespec until;
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_sec += ns / 1000000000LL;
+				until.tv_nsec += ns % 1000000000LL;
+				if (until.tv_nsec >= 1000000000L) { until.tv_sec++; until.tv_nsec -= 1000000000L; }
+
+				pthread_mutex_lock(&scrub_lock);
+				if (scrub_running) pthread_cond_timedwait(&scrub_wakeup, &scrub_lock, &until);
+				pthread_mutex_unlock(&scrub_lock);
+			}
+
+			/*
+			* Background scrubber. Every scrub_interval seconds it verifies all
+			* allocated blocks against the checksum table, SCRUB_BATCH blocks at a
+			* time under the read lock, pacing itself to scrub_rate blocks a second.
+			*/
+			static void *scrub_main(void *arg) {
+				(void) arg;
+				cs1550_free_space_tracker *tracker = malloc(sizeof(cs1550_free_space_tracker));
+				char buf[BLOCK_SIZE];
+				long long batch_ns = SCRUB_BATCH * 1000000000LL / options.scrub_rate;
+
+				while (scrub_running) {
+					int features = 0;
+					int have_tracker = 0;
+					unsigned long pass_errors = 0;
+					long b, i;
+
+					pthread_rwlock_rdlock(&fs_lock);
+					FILE *fs = open_disk("rb");
+					if (fs != NULL) {
+						features = get_disk_features(fs);
+						if (get_tracker(fs) != NULL) {
+							memcpy(tracker, get_tracker(fs), sizeof(cs1550_free_space_tracker));
+							have_tracker = 1;
+						}
+						fclose(fs);
+					}
+					pthread_rwlock_unlock(&fs_lock);
+
+					for (b=0; have_tracker && (features & FEATURE_CHECKSUMS) && b<CSUM_START_BLOCK && scrub_running; b+=SCRUB_BATCH) {
+						pthread_rwlock_rdlock(&fs_lock);
+						fs = open_disk("rb");
+						for (i=b; fs != NULL && i<b+SCRUB_BATCH && i<CSUM_START_BLOCK; i++) {
+							if (tracker->data[i] == 0) continue;
+							fseek(fs, i * BLOCK_SIZE, SEEK_SET);
+							if (fread(buf, BLOCK_SIZE, 1, fs) != 1) continue;
+							__sync_fetch_and_add(&blocks_scrubbed, 1);
+							if (verify_block(fs, i, buf) != 0) {
+								pass_errors++;
+								__sync_fetch_and_add(&checksum_errors, 1);
+								printf("scrub_main(): block %li does not match its checksum.\n", i);
+							}
+						}
+						if (fs != NULL) fclose(fs);
+						pthread_rwlock_unlock(&fs_lock);
+
+						scrub_sleep(batch_ns);
+					}
+					if (features & FEATURE_CHECKSUMS) printf("scrub_main(): pass finished, %lu bad blocks.\n", pass_errors);
+
+					/** Wait for the next pass **/
+					time_t next_pass = time(NULL) + options.scrub_interval;
+					while (scrub_running && time(NULL) < next_pass) {
+						scrub_sleep((long long)(next_pass - time(NULL)) * 1000000000LL);
+					}
+				}
+
+				free(tracker);
+				return NULL;
+			}
+
+			static void defrag_sleep(long long ns) {
+				struct timespec until;
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_sec += ns / 1000000000LL;
+				until.tv_nsec += ns % 1000000000LL;
+				if (until.tv_nsec >= 1000000000L) { until.tv_sec++; until.tv_nsec -= 1000000000L; }
+
+				pthread_mutex_lock(&defrag_lock);
+				if (defrag_running) pthread_cond_timedwait(&defrag_wakeup, &defrag_lock, &until);
+				pthread_mutex_unlock(&defrag_lock);
+			}
+
+			static void collect_path(FILE *fs, const char *path, long dir_location, int index, struct cs1550_dir_slot *file, void *arg) {
+				struct cs1550_path_list *list = arg;
+				(void) fs; (void) dir_location; (void) index;
+
+				if (file->nStartBlock < 0) return;
+				if (list->n == list->cap) {
+					list->cap = list->cap ? list->cap * 2 : 64;
+					list->paths = realloc(list->paths, list->cap * sizeof(char *));
+				}
+				list->paths[list->n++] = strdup(path);
+			}
+
+			/*
+			* Background defragmenter. Every defrag_interval seconds it looks at
+			* each file in turn under the write lock and moves fragmented chains
+			* into consecutive blocks, sleeping after each move so it averages no
+			* more than defrag_rate blocks a second.
+			*/
+			static void *defrag_main(void *arg) {
+				(void) arg;
+				struct cs1550_dentry d;
+
+				while (defrag_running) {
+					struct cs1550_path_list list = { NULL, 0, 0 };
+					unsigned long pass_files = 0;
+					int i;
+
+					/** Files are found once per pass and looked up again by path
+					before each move, since directories may have moved since **/
+					pthread_rwlock_rdlock(&fs_lock);
+					FILE *fs = open_disk("rb");
+					if (fs != NULL) {
+						walk_files(fs, 0, collect_path, &list);
+						fclose(fs);
+					}
+					pthread_rwlock_unlock(&fs_lock);
+
+					for (i=0; i<list.n && defrag_running; i++) {
+						int moved = 0;
+						pthread_rwlock_wrlock(&fs_lock);
+						fs = open_disk("rb+");
+						if (fs != NULL) {
+							sync_begin(list.paths[i], 0);
+							if (resolve_path(fs, 0, list.paths[i], &d, 0) == 0 && !d.is_dir) moved = defrag_file(fs, d.parent, d.index);
+							sync_end();
+							fclose(fs);
+						}
+						pthread_rwlock_unlock(&fs_lock);
+
+						if (moved > 0) {
+							pass_files++;
+							__sync_fetch_and_add(&defrag_moved_files, 1);
+							__sync_fetch_and_add(&defrag_moved_blocks, moved);
+							defrag_sleep(moved * 1000000000LL / options.defrag_rate);
+						}
+					}
+					for (i=0; i<list.n; i++) free(list.paths[i]);
+					free(list.paths);
+					printf("defrag_main(): pass finished, %lu files moved.\n", pass_files);
+
+					time_t next_pass = time(NULL) + options.defrag_interval;
+					while (defrag_running && time(NULL) < next_pass) defrag_sleep((long long)(next_pass - time(NULL)) * 1000000000LL);
+				}
+				return NULL;
+			}
+
+			/*
+			* Background log cleaner. Every LOG_SEAL_INTERVAL seconds it seals
+			* the open segment, so nothing written waits in memory longer than
+			* that, and cleans the log once half of it is used.
+			*/
+			static void *log_main(void *arg) {
+				(void) arg;
+				struct timespec until;
+
+				while (log_running) {
+					clock_gettime(CLOCK_REALTIME, &until);
+					until.tv_sec += LOG_SEAL_INTERVAL;
+					pthread_mutex_lock(&log_lock);
+					if (log_running) pthread_cond_timedwait(&log_wakeup, &log_lock, &until);
+					pthread_mutex_unlock(&log_lock);
+
+					pthread_rwlock_wrlock(&fs_lock);
+					FILE *fs = open_disk("rb+");
+					if (fs != NULL) {
+						if (log_segment >= LOG_SEGMENTS / 2) log_clean(fs);
+						else log_seal(fs);
+						fclose(fs);
+					}
+					pthread_rwlock_unlock(&fs_lock);
+				}
+				return NULL;
+			}
+
+			/*
+			* Saves the in-memory image each time SIGUSR1 arrives. main blocks the
+			* signal in every thread so that it is only ever taken here.
+			*/
+			static void *ram_save_main(void *arg) {
+				(void) arg;
+				sigset_t usr1;
+				int sig;
+
+				sigemptyset(&usr1);
+				sigaddset(&usr1, SIGUSR1);
+				while (ram_save_running) {
+					if (sigwait(&usr1, &sig) != 0 || !ram_save_running) continue;
+					if (log_map == NULL) {
+						pthread_rwlock_rdlock(&fs_lock);
+						ram_disk_save(options.ramdisk_image);
+						pthread_rwlock_unlock(&fs_lock);
+						continue;
+					}
+					//The open segment is sealed so the saved image has it
+					pthread_rwlock_wrlock(&fs_lock);
+					FILE *fs = open_disk("rb+");
+					if (fs != NULL) {
+						log_seal(fs);
+						fclose(fs);
+					}
+					ram_disk_save(options.ramdisk_image);
+					pthread_rwlock_unlock(&fs_lock);
+				}
+				return NULL;
+			}
+
+			static void *cs1550_init(struct fuse_conn_info *conn)
+			{
+				(void) conn;
+
+				//The stripe workers go first, so mounting already uses them
+				stripe_start();
+				mount_disk();
+
+				//Started here rather than in main, since fuse_main may fork
+				if (options.scrub_rate > 0) {
+					scrub_running = 1;
+					if (pthread_create(&scrub_thread, NULL, scrub_main, NULL) != 0) {
+						scrub_running = 0;
+						printf("cs1550_init(): could not start scrubber thread.\n");
+					}
+				}
+				if (options.defrag_rate > 0) {
+					defrag_running = 1;
+					if (pthread_create(&defrag_thread, NULL, defrag_main, NULL) != 0) {
+						defrag_running = 0;
+						printf("cs1550_init(): could not start defragmenter thread.\n");
+					}
+				}
+				if (log_map != NULL) {
+					log_running = 1;
+					if (pthread_create(&log_thread, NULL, log_main, NULL) != 0) {
+						log_running = 0;
+						printf("cs1550_init(): could not start log cleaner thread.\n");
+					}
+				}
+				if (ram_disk != NULL && options.ramdisk_image != NULL) {
+					ram_save_running = 1;
+					if (pthread_create(&ram_save_thread, NULL, ram_save_main, NULL) != 0) {
+						ram_save_running = 0;
+						printf("cs1550_init(): could not start image saving thread.\n");
+					}
+				}
+				return NULL;
+			}
+
+			static void cs1550_destroy(void *private_data)
+			{
+				(void) private_data;
+
+				if (scrub_running) {
+					pthread_mutex_lock(&scrub_lock);
+					scrub_running = 0;
+					pthread_cond_broadcast(&scrub_wakeup);
+					pthread_mutex_unlock(&scrub_lock);
+					pthread_join(scrub_thread, NULL);
+				}
+				if (defrag_running) {
+					pthread_mutex_lock(&defrag_lock);
+					defrag_running = 0;
+					pthread_cond_broadcast(&defrag_wakeup);
+					pthread_mutex_unlock(&defrag_lock);
+					pthread_join(defrag_thread, NULL);
+				}
+				if (log_running) {
+					pthread_mutex_lock(&log_lock);
+					log_running = 0;
+					pthread_cond_broadcast(&log_wakeup);
+					pthread_mutex_unlock(&log_lock);
+					pthread_join(log_thread, NULL);
+				}
+				if (ram_save_running) {
+					ram_save_running = 0;
+					pthread_kill(ram_save_thread, SIGUSR1);
+					pthread_join(ram_save_thread, NULL);
+				}
+				unmount_disk();
+				if (stripe_running) stripe_stop();
+				if (ram_disk != NULL && options.ramdisk_image != NULL) ram_disk_save(options.ramdisk_image);
+				if (sync_fd >= 0) close(sync_fd);
+			}
+
+			/******************************************************************************
+			*
+			*  DO NOT MODIFY ANYTHING BELOW THIS LINE
+			*
+			*****************************************************************************/
+
+			/*
+			* truncate is called when a new file is created (with a 0 size), when an
+			* existing file is made shorter, or to extend one with zeros. A block
+			* chain is cut after the block the new end falls in, and a group index
+			* after the group it falls in. An inline file keeps its slot.
+			*
+			*/
+			static int cs1550_truncate(const char *path, off_t size)
+			{
+				struct cs1550_dentry d;
+				int r;
+
+				if (is_snapshot_path(path)) return -EROFS;
+				if (strcmp(path, STATS_PATH) == 0 || strcmp(path, FRAG_PATH) == 0) return -EPERM;
+				if (size < 0) return -EINVAL;
+
+				FILE *fs = open_disk("rb+");
+				if (fs == NULL) return -EIO;
+				r = resolve_path(fs, 0, path, &d, 1);
+				if (r == 0 && d.is_dir) r = -EISDIR;
+				if (r != 0 || size == (off_t)d.size) {
+					fclose(fs);
+					return r;
+				}
+
+				/** GROWING: write zeros past the end **/
+				if (size > (off_t)d.size) {
+					fclose(fs);
+					char *zero = calloc(1, COPY_CHUNK);
+					off_t pos = d.size;
+					while (r == 0 && pos < size) {
+						size_t n = size - pos < COPY_CHUNK ? size - pos : COPY_CHUNK;
+						int w = cs1550_write(path, zero, n, pos, NULL);
+						if (w < 0) r = w;
+						else if (w == 0) r = -ENOSPC;
+						else pos += w;
+					}
+					free(zero);
+					return r;
+				}
+
+				int features = get_disk_features(fs);
+				cs1550_dir *dir = malloc(sizeof(cs1550_dir));
+				if (load_dir(fs, d.parent, 0, dir) != 0) r = -EIO;
+
+				/** BLOCK CHAINS: keep the blocks up to the new end, after taking
+				them over from anything that shares them **/
+				if (r == 0 && d.block >= 0 && !(features & FEATURE_COMPRESSION)) {
+					cs1550_disk_block block;
+					int last = size > 0 ? (size - 1) / MAX_DATA_IN_BLOCK : 0;
+					int i;
+					if ((features & FEATURE_DEDUP) || have_shared_blocks(fs)) r = unshare_chain(fs, dir, d.parent, d.index, last);
+					long b = dir->files[d.index].nStartBlock;
+					for (i=0; r == 0 && i<=last; i++) {
+						if (b < 0 || read_block(fs, b, &block) != 0) r = -EIO;
+						else if (i < last) b = block.nNextBlock;
+					}
+					if (r == 0) {
+						long rest = block.nNextBlock;
+						int keep = size - last * MAX_DATA_IN_BLOCK;
+						memset(&block.data[keep], 0, MAX_DATA_IN_BLOCK - keep);
+						block.nNextBlock = -1;
+						if (write_block(fs, b, &block) != 0) r = -EIO;
+						else free_chain(fs, rest);
+					}
+					if (r == 0) {
+						dir->files[d.index].fsize = size;
+						r = store_dir(fs, d.parent, 0, dir);
+					}
+					if (r == 0) quota_charge(quota_of(path), quota_file_blocks(dir->files[d.index].nStartBlock, size) - quota_file_blocks(d.block, d.size), 0);
+					if ((features & FEATURE_DEDUP) && strlen(path) < DEDUP_DIRTY_PATH_MAX) strcpy(dedup_dirty[path_hash(path) % DEDUP_DIRTY_SLOTS], path);
+					printf("cs1550_truncate(): cut %s to %li bytes\n", path, (long)size);
+					free(dir);
+					fclose(fs);
+					attr_cache_invalidate(path);
+					return r;
+				}
+				if (r != 0) {
+					free(dir);
+					fclose(fs);
+					return r;
+				}
+
+				/** COMPRESSED FILES: cut the group index in place **/
+				if (d.block >= 0) {
+					if (have_shared_blocks(fs)) r = unshare_index_chain(fs, dir, d.parent, d.index);
+					if (r == 0) r = truncate_compressed(fs, dir->files[d.index].nStartBlock, size);
+				}
+				/** INLINE FILES: clear the slot past the new end, or give it back
+				once the file is empty **/
+				char slot[SMALL_FILE_SLOT_SIZE];
+				if (IS_PACKED_REF(d.block) && size > 0) {
+					if (read_pack_slot(fs, d.block, slot) != 0) r = -EIO;
+					else {
+						memset(&slot[size], 0, SMALL_FILE_SLOT_SIZE - size);
+						if (write_pack_slot(fs, d.block, slot) != 0) r = -EIO;
+					}
+				}
+				if (IS_PACKED_REF(d.block) && size == 0) dir->files[d.index].nStartBlock = NO_BLOCK;
+				if (r == 0) {
+					dir->files[d.index].fsize = size;
+					r = store_dir(fs, d.parent, 0, dir);
+				}
+				if (r == 0 && IS_PACKED_REF(d.block) && size == 0) release_pack_slot(fs, d.block);
+				if (r == 0) quota_charge(quota_of(path), quota_file_blocks(dir->files[d.index].nStartBlock, size) - quota_file_blocks(d.block, d.size), 0);
+				printf("cs1550_truncate(): cut %s to %li bytes\n", path, (long)size);
+				free(dir);
+				fclose(fs);
+				attr_cache_invalidate(path);
+				return r;
+			}
+
+
+			/*
+			* Called when we open a file
+			*
+			*/
+			static int cs1550_open(const char *path, struct fuse_file_info *fi)
+			{
+				(void) path;
+				(void) fi;
+
+				//Statistics have no fixed size, so bypass the page cache
+				if (strcmp(path, STATS_PATH) == 0 || strcmp(path, FRAG_PATH) == 0) fi->direct_io = 1;
+				//Snapshots are read-only
+				if (is_snapshot_path(path) && (fi->flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+				/*
+				//if we can't find the desired file, return an error
+				return -ENOENT;
+				*/
+
+				//It's not really necessary for this project to anything in open
+
+				/* We're not going to worry about permissions for this project, but
+				if we were and we don't have them to the file we should return an error
+
+				return -EACCES;
+				*/
+
+				//Count the open, so release knows when the file's sync state can go
+				fi->fh = 0;
+				if (strcmp(path, STATS_PATH) != 0 && strcmp(path, FRAG_PATH) != 0 && !is_snapshot_path(path)) {
+					pthread_mutex_lock(&sync_lock);
+					struct cs1550_sync_file *f = sync_file_get(path, 1);
+					if (f != NULL) f->nOpen++;
+					pthread_mutex_unlock(&sync_lock);
+
+					//Look the file up once for the reads and writes through fi
+					FILE *fs = open_disk("rb");
+					if (fs != NULL) {
+						handle_open(fs, path, fi);
+						fclose(fs);
+					}
+				}
+
+				return 0; //success!
+			}
+
+			/*
+			* Called when close is called on a file descriptor, but because it might
+			* have been dup'ed, this isn't a guarantee we won't ever need the file
+			* again. For us, return success simply to avoid the unimplemented error
+			* in the debug log.
+			*/
+			static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+			{
+				(void) path;
+				(void) fi;
+
+				//Deduplicate files that were written since they were last closed
+				char *dirty = dedup_dirty[path_hash(path) % DEDUP_DIRTY_SLOTS];
+				if (strcmp(dirty, path) == 0) {
+					cs1550_dir dir;
+					long dir_location;
+					int file_index;
+
+					dirty[0] = '\0';
+					FILE *fs = open_disk("rb+");
+					if (fs == NULL) return 0;
+					if ((get_disk_features(fs) & FEATURE_DEDUP) && !(get_disk_features(fs) & FEATURE_COMPRESSION) && find_file_entry(fs, path, &dir, &dir_location, &file_index) == 0 && dir.files[file_index].nStartBlock >= 0) {
+						dedup_file(fs, &dir, dir_location, file_index);
+					}
+					fclose(fs);
+				}
+
+				return 0; //success!
+			}
+
+			/*
+			* Reports the size of the disk. Free blocks come from the running
+			* count rather than a scan of the tracker.
+			*/
+			static int cs1550_statfs(const char *path, struct statvfs *stbuf)
+			{
+				(void) path;
+
+				FILE *fs = open_disk("rb");
+				if (fs == NULL) return -EIO;
+				long free_count = count_free_blocks(fs);
+				int features = get_disk_features(fs);
+				fclose(fs);
+
+				memset(stbuf, 0, sizeof(struct statvfs));
+				stbuf->f_bsize = BLOCK_SIZE;
+				stbuf->f_frsize = BLOCK_SIZE;
+				stbuf->f_blocks = MAX_NUM_OF_BLOCKS;
+				stbuf->f_bfree = free_count;
+				stbuf->f_bavail = free_count;
+				//There is no inode table; a new file or directory needs at most a block
+				stbuf->f_files = MAX_NUM_OF_BLOCKS;
+				stbuf->f_ffree = free_count;
+				stbuf->f_namemax = (features & FEATURE_LONG_NAMES) ? MAX_NAME_LEN : MAX_FILENAME + 1 + MAX_EXTENSION;
+				return 0;
+			}
+
+			/*
+			* Makes path durable: the blocks written for it since its last fsync,
+			* its directory block and the tracker and checksum blocks covering
+			* them. The directory block holds the size, so fdatasync needs it as
+			* well. Blocks other files wrote are left to the page cache.
+			*/
+			static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+			{
+				(void) datasync;
+				(void) fi;
+				struct cs1550_sync_file clean;
+
+				if (is_snapshot_path(path)) return 0;
+				pthread_mutex_lock(&sync_lock);
+				struct cs1550_sync_file *f = sync_file_get(path, 0);
+				if (f == NULL) {
+					//Nothing noted (or already made durable when its slot was taken)
+					memset(&clean, 0, sizeof(struct cs1550_sync_file));
+					clean.path = (char *)path;
+					f = &clean;
+				}
+				int r = sync_file_flush(f);
+				pthread_mutex_unlock(&sync_lock);
+				return r;
+			}
+
+			/*
+			* Called once every descriptor of an open is closed. The file's sync
+			* state is dropped when nobody has it open any more; its blocks are
+			* already in the image, just not forced to stable storage.
+			*/
+			static int cs1550_release(const char *path, struct fuse_file_info *fi)
+			{
+				handle_close(fi);
+				pthread_mutex_lock(&sync_lock);
+				struct cs1550_sync_file *f = sync_file_get(path, 0);
+				if (f != NULL && --f->nOpen <= 0) {
+					free(f->path);
+					memset(f, 0, sizeof(struct cs1550_sync_file));
+				}
+				pthread_mutex_unlock(&sync_lock);
+				return 0;
+			}
+
+
+			/*
+			* Moves the entry for from into the directory of to, under its new
+			* name. The data, or the directory block, stays where it is. A file
+			* already at to is replaced; a directory is not.
+			*/
+			static int cs1550_rename(const char *from, const char *to)
+			{
+				char parent_path[PATH_MAX];
+				char name[MAX_NAME_LEN + 1];
+				struct cs1550_dentry src, dst, old;
+				size_t len = strlen(from);
+				int have_old = 0;
+
+				if (is_snapshot_path(from) || is_snapshot_path(to)) return -EROFS;
+				if (strcmp(from, STATS_PATH) == 0 || strcmp(from, FRAG_PATH) == 0 || strcmp(to, STATS_PATH) == 0 || strcmp(to, FRAG_PATH) == 0) return -EPERM;
+				if (strcmp(from, to) == 0) return 0;
+				if (strncmp(from, to, len) == 0 && to[len] == '/') return -EINVAL;
+				int r = split_path(to, parent_path, name);
+				if (r != 0) return r;
+
+				FILE *fs = open_disk("rb+");
+				if (fs == NULL) return -EIO;
+
+				/** Both directories are about to change, so they are unshared from
+				any snapshot; the destination first, so that unsharing it cannot
+				move the source's entry afterwards **/
+				r = resolve_path(fs, 0, parent_path, &dst, 1);
+				if (r == 0 && !dst.is_dir) r = -ENOTDIR;
+				if (r == 0) r = resolve_path(fs, 0, from, &src, 1);
+				if (r == 0 && src.parent < 0) r = -EBUSY;
+				if (r == 0) {
+					r = lookup_name(fs, dst.block, dst.parent < 0, name, &old, 0);
+					if (r == 0 && old.is_dir) r = src.is_dir ? -EEXIST : -EISDIR;
+					else if (r == 0 && src.is_dir) r = -ENOTDIR;
+					else if (r == 0) have_old = 1;
+					else if (r == -ENOENT) r = 0;
+				}
+				//Only directories live in the root
+				if (r == 0 && !src.is_dir && dst.parent < 0) r = -EPERM;
+
+				/** The entry takes its usage along into another top-level
+				directory, which must have room for it less any file it replaces **/
+				long moved_blocks = 0, moved_entries = 1;
+				struct cs1550_quota *from_q = quota_of(from), *to_q = quota_of(to);
+				if (r == 0 && src.is_dir && QUOTAS_ENABLED) {
+					quota_count(fs, src.block, &moved_blocks, &moved_entries);
+					moved_blocks++;
+				} else if (r == 0) moved_blocks = quota_file_blocks(src.block, src.size);
+				long old_blocks = have_old ? quota_file_blocks(old.block, old.size) : 0;
+				if (r == 0 && to_q != from_q) r = quota_charge(to_q, moved_blocks - old_blocks, moved_entries - have_old);
+				if (r != 0) {
+					fclose(fs);
+					return r;
+				}
+				sync_forget_tree(from);
+
+				cs1550_dir *from_dir = malloc(sizeof(cs1550_dir));
+				cs1550_dir *to_dir = from_dir;
+				if (load_dir(fs, src.parent, src.parent_is_root, from_dir) != 0) r = -EIO;
+				if (r == 0 && dst.block != src.parent) {
+					to_dir = malloc(sizeof(cs1550_dir));
+					if (load_dir(fs, dst.block, dst.parent < 0, to_dir) != 0) r = -EIO;
+				}
+
+				/** Take the entry out of its old directory and add it to the new
+				one with its attributes, dropping any file it replaces **/
+				long replaced = NO_BLOCK;
+				long released[2];
+				char src_name[MAX_NAME_LEN + 1];
+				if (r == 0) {
+					dir_entry_name(from_dir, src.index, src_name);
+					r = xattr_move(fs, from_dir, src_name, to_dir, name, released);
+				}
+				if (r == 0) {
+					struct cs1550_dir_slot moved = from_dir->files[src.index];
+					from_dir->files[src.index].nNameLen = 0;
+					from_dir->nFiles--;
+					if (have_old) {
+						replaced = to_dir->files[old.index].nStartBlock;
+						to_dir->files[old.index].nNameLen = 0;
+						to_dir->nFiles--;
+					}
+					int i = dir_add(fs, to_dir, dst.parent < 0, name, moved.fsize, moved.nStartBlock);
+					if (i < 0) r = i;
+				}
+				//The new name is written first, so a crash in between leaves two
+				//names rather than none
+				if (r == 0) r = store_dir(fs, dst.block, dst.parent < 0, to_dir);
+				if (r == 0 && to_dir != from_dir) r = store_dir(fs, src.parent, src.parent_is_root, from_dir);
+				if (r == 0) {
+					xattr_release(fs, released[0]);
+					xattr_release(fs, released[1]);
+				}
+				if (r == 0 && have_old && replaced != NO_BLOCK) release_file_data(fs, replaced);
+				if (r == 0) printf("cs1550_rename(): moved %s to %s\n", from, to);
+				if (r == 0 && to_q == from_q) quota_charge(to_q, -old_blocks, -have_old);
+				else if (r == 0) quota_charge(from_q, -moved_blocks, -moved_entries);
+				else if (to_q != from_q) quota_charge(to_q, old_blocks - moved_blocks, have_old - moved_entries);
+				//A top-level directory keeps its quota under its new name, unless
+				//it moved into another one; one that moves to the top gets its own
+				struct cs1550_quota *top = src.parent_is_root ? quota_find(from + 1) : NULL;
+				if (r == 0 && top != NULL && to_q == NULL) strcpy(top->name, name);
+				else if (r == 0 && top != NULL) memset(top, 0, sizeof(struct cs1550_quota));
+				else if (r == 0 && to_q == NULL) quota_add_dir(name, moved_blocks - 1, moved_entries - 1);
+
+				//Long name slots are renumbered when an entry goes, and a moved
+				//directory takes everything below it along
+				dentry_cache_clear();
+				attr_cache_clear();
+				if (to_dir != from_dir) free(to_dir);
+				free(from_dir);
+				fclose(fs);
+				return r;
+			}
+
+			/*
+			* Copies length bytes at src_offset of src to dst_offset of path
+			* without the data leaving the image. A whole file copied into an
+			* empty one just shares its blocks, which the first write to either
+			* copies. Anything else goes through a buffer COPY_CHUNK at a time.
+			* Returns the number of bytes copied.
+			*/
+			static long copy_range(const char *src, off_t src_offset, const char *path, off_t dst_offset, size_t length)
+			{
+				struct cs1550_dentry s, d;
+				const char *src_path = src;
+				long root_block = 0;
+
+				if (is_snapshot_path(path)) return -EROFS;
+				if (strcmp(src, path) == 0) return -EINVAL;
+				if (length == 0) return 0;
+				if (is_snapshot_path(src)) {
+					int r = resolve_snapshot(&src_path, &root_block);
+					if (r != 0) return r;
+					if (root_block < 0) return -EISDIR;
+				}
+
+				FILE *fs = open_disk("rb+");
+				if (fs == NULL) return -EIO;
+				int r = resolve_path(fs, root_block, src_path, &s, 0);
+				if (r == 0 && s.is_dir) r = -EISDIR;
+				if (r == 0) r = resolve_path(fs, 0, path, &d, 1);
+				if (r == 0 && d.is_dir) r = -EISDIR;
+				if (r != 0) {
+					fclose(fs);
+					return r;
+				}
+
+				/** Share the whole chain with an empty destination **/
+				if (src_offset == 0 && dst_offset == 0 && length >= s.size && d.size == 0 && s.block >= 0 && !IS_PACKED_REF(s.block) && block_ref(fs, s.block) > 0) {
+					struct cs1550_quota *q = quota_of(path);
+					long charged = quota_file_blocks(s.block, s.size) - quota_file_blocks(d.block, d.size);
+					if (quota_charge(q, charged, 0) != 0) {
+						block_unref(fs, s.block);
+						fclose(fs);
+						return -EDQUOT;
+					}
+					cs1550_dir *dir = malloc(sizeof(cs1550_dir));
+					r = load_dir(fs, d.parent, 0, dir);
+					if (r == 0) {
+						long old = dir->files[d.index].nStartBlock;
+						dir->files[d.index].nStartBlock = s.block;
+						dir->files[d.index].fsize = s.size;
+						r = store_dir(fs, d.parent, 0, dir);
+						if (r == 0 && old != NO_BLOCK) release_file_data(fs, old);
+					}
+					if (r != 0) {
+						block_unref(fs, s.block);
+						quota_charge(q, -charged, 0);
+					}
+					if (r == 0) printf("copy_range(): %s now shares the blocks of %s\n", path, src);
+					free(dir);
+					fclose(fs);
+					attr_cache_invalidate(path);
+					return r == 0 ? (long)s.size : r;
+				}
+				fclose(fs);
+
+				char *buf = malloc(COPY_CHUNK);
+				long done = 0;
+				while ((size_t)done < length) {
+					size_t n = length - done < COPY_CHUNK ? length - done : COPY_CHUNK;
+					int got = cs1550_read(src, buf, n, src_offset + done, NULL);
+					if (got <= 0) {
+						if (got < 0 && done == 0) done = got;
+						break;
+					}
+					int put = cs1550_write(path, buf, got, dst_offset + done, NULL);
+					if (put < 0) {
+						if (done == 0) done = put;
+						break;
+					}
+					done += put;
+					if (put < got) break;
+				}
+				free(buf);
+				return done;
+			}
+
+			/*
+			* CS1550_IOC_COPY_RANGE is the only ioctl.
+			*/
+			static int cs1550_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+			{
+				(void) arg;
+				(void) fi;
+				(void) flags;
+				struct cs1550_copy_range *req = data;
+
+				if ((unsigned int)cmd != CS1550_IOC_COPY_RANGE) return -ENOTTY;
+				req->src[COPY_PATH_MAX - 1] = '\0';
+				long r = copy_range(req->src, req->src_offset, path, req->dst_offset, req->length);
+				if (r < 0) return r;
+				req->length = r;
+				return 0;
+			}
+
+			/*
+			* Finds the directory holding the entry at path and the entry's name.
+			* The root has no such directory and gets -ENOTSUP.
+			*/
+			static int xattr_entry(FILE *fs, long root_block, const char *path, int for_write, struct cs1550_dentry *d, cs1550_dir *dir, char *entry)
+			{
+				int r = resolve_path(fs, root_block, path, d, for_write);
+				if (r == 0 && d->parent < 0) r = -ENOTSUP;
+				if (r == 0 && load_dir(fs, d->parent, d->parent_is_root, dir) != 0) r = -EIO;
+				if (r == 0) dir_entry_name(dir, d->index, entry);
+				return r;
+			}
+
+			/*
+			* Loads the attributes of the entry at path into t, along with its name.
+			*/
+			static int xattr_lookup(const char *path, struct cs1550_xattr_table *t, char *entry)
+			{
+				struct cs1550_dentry d;
+				long root_block = 0;
+
+				t->nLen = 0;
+				entry[0] = '\0';
+				if (strcmp(path, STATS_PATH) == 0 || strcmp(path, FRAG_PATH) == 0) return 0;
+				if (is_snapshot_path(path)) {
+					int r = resolve_snapshot(&path, &root_block);
+					if (r != 0) return r;
+					if (root_block < 0) return 0;
+				}
+				FILE *fs = open_disk("rb");
+				if (fs == NULL) return -EIO;
+				cs1550_dir *dir = malloc(sizeof(cs1550_dir));
+				int r = xattr_entry(fs, root_block, path, 0, &d, dir, entry);
+				if (r == -ENOTSUP) r = 0;
+				else if (r == 0) r = xattr_load(fs, dir->nXattrBlock, t);
+				free(dir);
+				fclose(fs);
+				return r;
+			}
+
+			/*
+			* Sets the attribute name of the entry at path to value, or removes it
+			* when value is NULL. The whole attribute table of the directory the
+			* entry is in is written anew.
+			*/
+			static int xattr_change(const char *path, const char *name, const char *value, size_t size, int flags)
+			{
+				struct cs1550_dentry d;
+				char entry[MAX_NAME_LEN + 1];
+				size_t name_len = strlen(name);
+
+				if (is_snapshot_path(path)) return -EROFS;
+				if (strcmp(path, STATS_PATH) == 0 || strcmp(path, FRAG_PATH) == 0) return -EPERM;
+				if (name_len == 0 || name_len > XATTR_NAME_MAX_LEN) return -ERANGE;
+				if (value != NULL && size > XATTR_VALUE_MAX) return -E2BIG;
+
+				FILE *fs = open_disk("rb+");
+				if (fs == NULL) return -EIO;
+				cs1550_dir *dir = malloc(sizeof(cs1550_dir));
+				struct cs1550_xattr_table *t = malloc(sizeof(struct cs1550_xattr_table));
+				int r = xattr_entry(fs, 0, path, 1, &d, dir, entry);
+				if (r == 0) r = xattr_load(fs, dir->nXattrBlock, t);
+				if (r == 0) {
+					int had = xattr_take(t, entry, name, NULL, NULL);
+					if (had > 0 && (flags & XATTR_CREATE)) r = -EEXIST;
+					else if (had == 0 && (value == NULL || (flags & XATTR_REPLACE))) r = -ENODATA;
+				}
+				if (r == 0 && value != NULL) r = xattr_append(t, entry, strlen(entry), name, name_len, value, size);
+				//Like file data, a new table may not take the reserved blocks
+				if (r == 0 && value != NULL && count_free_blocks(fs) <= options.reserved_blocks + (long)((sizeof(uint32_t) + t->nLen) / MAX_DATA_IN_BLOCK)) r = -ENOSPC;
+
+				long head = r == 0 ? xattr_store(fs, t) : 0;
+				if (head < 0) r = head;
+				if (r == 0) {
+					long old = dir->nXattrBlock;
+					dir->nXattrBlock = head;
+					r = store_dir(fs, d.parent, d.parent_is_root, dir);
+					xattr_release(fs, r == 0 ? old : head);
+				}
+				if (r == 0) printf("xattr_change(): %s %s on %s, table at block %li\n", value != NULL ? "set" : "removed", name, path, head);
+				free(t);
+				free(dir);
+				fclose(fs);
+				return r;
+			}
+
+			static int cs1550_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+			{
+				return xattr_change(path, name, value, size, flags);
+			}
+
+			static int cs1550_removexattr(const char *path, const char *name)
+			{
+				return xattr_change(path, name, NULL, 0, 0);
+			}
+
+			/*
+			* Copies the value of attribute name out, or with size 0 just returns
+			* its length.
+			*/
+			static int cs1550_getxattr(const char *path, const char *name, char *value, size_t size)
+			{
+				struct cs1550_xattr_table *t = malloc(sizeof(struct cs1550_xattr_table));
+				struct cs1550_xattr_record rec;
+				char entry[MAX_NAME_LEN + 1];
+				size_t entry_len, name_len = strlen(name);
+				uint32_t off;
+
+				int r = xattr_lookup(path, t, entry);
+				entry_len = strlen(entry);
+				for (off=0; r == 0 && off<t->nLen; off+=XATTR_RECORD_SIZE(rec)) {
+					memcpy(&rec, &t->records[off], sizeof(rec));
+					const char *e = &t->records[off + sizeof(rec)];
+					if (rec.nEntryLen != entry_len || rec.nNameLen != name_len || memcmp(e, entry, entry_len) != 0 || memcmp(e + entry_len, name, name_len) != 0) continue;
+					if (size > 0 && size < rec.nValueLen) r = -ERANGE;
+					else if (size > 0) memcpy(value, e + entry_len + name_len, rec.nValueLen);
+					break;
+				}
+				if (r == 0) r = off < t->nLen ? rec.nValueLen : -ENODATA;
+				free(t);
+				return r;
+			}
 
-		/** Check if the file already exists
-		If it doesn't, create it.    **/
-		char* diskname = "./.disk";
-		FILE *fs = fopen(diskname, "rb+");
-		cs1550_root_directory *root_dir=malloc(sizeof(cs1550_root_directory));
-		cs1550_directory_entry *dir = malloc(sizeof(cs1550_directory_entry));
-		assert(fs != 0);
-		if (fs == 0) {
-			printf("cs1550_mknod(): could not open %s errno: %s\n", diskname,strerror(errno));
-		} else {
-			int dir_location = -1;
-			if ( fread(root_dir, sizeof(cs1550_root_directory), 1, fs) != 1 ) printf("cs1550_mknod(): Could not read root directory from disk.\n");
-			/** Find the directory that this file would be in **/
-			for(i=0; i<MAX_DIRS_IN_ROOT; i++) {
-				dir_location = root_dir->directories[i].nStartBlock;
-				if ( strncmp(root_dir->directories[i].dname, directory, 8) == 0 ) break;
-			}
-			/** Directory that the file is in has been found **/
-			fseek(fs, dir_location*BLOCK_SIZE, SEEK_SET);
-			if ( fread(dir, sizeof(cs1550_directory_entry), 1, fs) != 1 ) printf("cs1550_mknod(): Could not read directory from disk.\n");
-			int file_exists = 0;
-			for(i=0; i<MAX_FILES_IN_DIR; i++) {
-				if ( strncmp(filename, dir->files[i].fname, 8) == 0 && strncmp(extension, dir->files[i].fext, 3) == 0 ) {
-					if (fs!=NULL) fclose(fs);
-					return -EEXIST;
+			/*
+			* Lists the names of the attributes of path, each ending in a nul, or
+			* with size 0 just returns the length of the list.
+			*/
+			static int cs1550_listxattr(const char *path, char *list, size_t size)
+			{
+				struct cs1550_xattr_table *t = malloc(sizeof(struct cs1550_xattr_table));
+				struct cs1550_xattr_record rec;
+				char entry[MAX_NAME_LEN + 1];
+				size_t entry_len, len = 0;
+				uint32_t off;
+
+				int r = xattr_lookup(path, t, entry);
+				entry_len = strlen(entry);
+				for (off=0; r == 0 && off<t->nLen; off+=XATTR_RECORD_SIZE(rec)) {
+					memcpy(&rec, &t->records[off], sizeof(rec));
+					const char *e = &t->records[off + sizeof(rec)];
+					if (rec.nEntryLen != entry_len || memcmp(e, entry, entry_len) != 0) continue;
+					if (size > 0 && len + rec.nNameLen + 1 > size) r = -ERANGE;
+					else if (size > 0) {
+						memcpy(&list[len], e + entry_len, rec.nNameLen);
+						list[len + rec.nNameLen] = '\0';
+					}
+					len += rec.nNameLen + 1;
 				}
+				free(t);
+				return r == 0 ? (int)len : r;
 			}
 
-			/** Directory has been searched, file has not been found.
-			Create the file. **/
-			int block_to_write = find_unallocated_block(fs);
-			set_block_allocated(fs, block_to_write);
-			/** Edit and write directory structure **/
-			fseek(fs, dir_location*BLOCK_SIZE, SEEK_SET);
-			dir->nFiles++;
-			for(i=0;i<MAX_FILES_IN_DIR;i++) if (dir->files[i].fname[0] == NULL) break;
-			strncpy(dir->files[i].fname, filename, 8);
-			strncpy(dir->files[i].fext, extension, 3);
 
-			dir->files[i].fsize = 0;
-			dir->files[i].nStartBlock = block_to_write;
-			printf("cs1550_mknod(): updating directory entry with filename %s.%s to byte location %i\n", dir->files[i].fname, dir->files[i].fext, dir_location*BLOCK_SIZE);
-			int w = fwrite(dir, sizeof(cs1550_directory_entry), 1, fs);
-			if (w!=1) printf("cs1550_mknod(): fwrite failed to write updated directory entry to disk.\n");
+			/*
+			* The operations below take fs_lock around the real implementations:
+			* shared for the ones that only read the disk, exclusive otherwise.
+			*/
+			#define LOCKED(lock, call) { pthread_rwlock_##lock(&fs_lock); int r = call; pthread_rwlock_unlock(&fs_lock); return r; }
 
-			/** Create and write new file structure **/
-			cs1550_disk_block *new_file=malloc(sizeof(cs1550_disk_block));
-			memset(new_file->data, 0, MAX_DATA_IN_BLOCK);
-			new_file->nNextBlock = -1;
+			//Exclusive, with the blocks written noted against path for fsync
+			#define LOCKED_SYNC(path, call) { pthread_rwlock_wrlock(&fs_lock); sync_begin(path, 1); int r = call; sync_end(); pthread_rwlock_unlock(&fs_lock); return r; }
 
-			fseek(fs, block_to_write*BLOCK_SIZE, SEEK_SET);
-			w = fwrite(new_file, sizeof(cs1550_disk_block), 1, fs);
-			if (w!=1) printf("cs1550_mknod(): fwrite failed to write new file entry to disk.\n");
-			else printf("cs1550_mknod(): Wrote new file entry to disk.\n");
+			static int locked_rename(const char *from, const char *to)
+			LOCKED(wrlock, cs1550_rename(from, to))
 
-		}
+			static int locked_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+			LOCKED_SYNC(path, cs1550_ioctl(path, cmd, arg, fi, flags, data))
 
-		if (fs!=NULL) fclose(fs);
-		printf("cs1550_mknod(): Returning success from function.\n");
-		return 0;
-	}
+			static int locked_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+			LOCKED(wrlock, cs1550_setxattr(path, name, value, size, flags))
 
-	/*
-	* Deletes a file
-	*/
-	static int cs1550_unlink(const char *path)
-	{
-		(void) path;
+			static int locked_getxattr(const char *path, const char *name, char *value, size_t size)
+			LOCKED(rdlock, cs1550_getxattr(path, name, value, size))
 
-		return 0;
-	}
+			static int locked_listxattr(const char *path, char *list, size_t size)
+			LOCKED(rdlock, cs1550_listxattr(path, list, size))
 
-	/*
-	* Read size bytes from file into buf starting from offset
-	*
-	*/
-	static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
-		struct fuse_file_info *fi)
-		{
-			printf("cs1550_read() called on %s\n", path);
-			(void) buf;
-			(void) offset;
-			(void) fi;
-			(void) path;
+			static int locked_removexattr(const char *path, const char *name)
+			LOCKED(wrlock, cs1550_removexattr(path, name))
 
-			/** These sizes are well above what is required
-			to avoid fighting with overruns.
-			Null termination is added appropriately later. **/
-			char extension[10];
-			char filename[10];
-			char directory[25];
+			static int locked_getattr(const char *path, struct stat *stbuf)
+			LOCKED(rdlock, cs1550_getattr(path, stbuf))
 
-			sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+			static int locked_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+			LOCKED(rdlock, cs1550_readdir(path, buf, filler, offset, fi))
 
-			/** Is path a directory? **/
-			int i;
-			int is_dir = 1;
-			for(i=0;i<strlen(path);i++){
-				if (path[i] == '.') {
-					is_dir = 0;
-					break;
-				}
-			}
-			if (is_dir){ printf("cs1550_read(): Path is a directory.\n"); return -EISDIR; }
-			if (size <=0) { printf("cs1550_read(): Size <= 0.\n"); return -1; }
-			/*********************/
-			/** Open filesystem, try to find file **/
-			char* diskname = "./.disk";
-			FILE *fs = fopen(diskname, "rb");
-			cs1550_root_directory *root_dir=malloc(sizeof(cs1550_root_directory));
-			cs1550_directory_entry *dir = malloc(sizeof(cs1550_directory_entry));
-			cs1550_disk_block *curr_block = malloc(sizeof(cs1550_disk_block));
-			assert(fs != 0);
-			printf("cs1550_read(): Reading size: %i from offset: %i\n", size, offset);
+			static int locked_mkdir(const char *path, mode_t mode)
+			LOCKED(wrlock, cs1550_mkdir(path, mode))
 
-			/** GET ROOT **/
-			fseek(fs, 0, SEEK_SET);
-			if ( fread(root_dir, sizeof(cs1550_root_directory), 1, fs) != 1 ) printf("cs1550_read(): Could not read root directory from disk.\n");
-			/** GET DIRECTORY **/
-			int dir_location = -1;
-			for(i=0; i<MAX_DIRS_IN_ROOT; i++) {
-				dir_location = root_dir->directories[i].nStartBlock;
-				if ( strncmp(root_dir->directories[i].dname, directory, 8) == 0 ) break;
-			}
-			printf("cs1550_read(): Found directory %s at block %i\n", directory, dir_location);
-			fseek(fs, BLOCK_SIZE*dir_location, SEEK_SET);
-			if ( fread(dir, sizeof(cs1550_directory_entry), 1, fs) != 1 ) printf("cs1550_read(): Could not read directory from disk.\n");
-
-			/** FIND FILE **/
-			int file_start_block = -1;
-			int file_size = -1;
-			for(i=0; i<MAX_FILES_IN_DIR; i++) {
-				if ( strncmp(filename, dir->files[i].fname, 8) == 0 && strncmp(extension, dir->files[i].fext, 3) == 0 ){
-					file_size = dir->files[i].fsize;
-					file_start_block = (int)dir->files[i].nStartBlock;
-				}
-			}
-			printf("cs1550_read(): Found file %s.%s at block %i\n", filename, extension, file_start_block);
-			if (offset > file_size) {
-				printf("cs1550_read(): offset > file_size.\n");
-				if (fs!=NULL) fclose(fs);
-				return -1;
-			}
+			static int locked_rmdir(const char *path)
+			LOCKED(wrlock, cs1550_rmdir(path))
 
-			int bytes_read = 0;
-			int beginning_byte_in_block = offset; // when we are in the correct block,
-																					// this variable will be < 512, > 0,
-																					// and will refer to the first byte in
-																					// this block that we want to read
-			/** GET THE FIRST BLOCK OF THE FILE **/
-			fseek(fs, file_start_block*BLOCK_SIZE, SEEK_SET);
-			if ( fread(curr_block, sizeof(cs1550_disk_block), 1, fs) != 1 ) printf("cs1550_read(): Could not read first disk block from disk.\n");
-			else printf("cs1550_read(): Read first file block at block %i from disk.\n", file_start_block);
+			static int locked_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+			LOCKED(rdlock, cs1550_read(path, buf, size, offset, fi))
 
-			/** FIND THE FILE BLOCK THAT CONTAINS BYTE AT OFFEST **/
-			/** AFTER THIS WHILE LOOP, curr_block WILL BE THE BLOCK WE WANT **/
-			/** IF OFFSET IS IN THE FIRST BLOCK OF FILE, THIS WHILE IS BYPASSED **/
-			int next_block = file_start_block;
-			while ( beginning_byte_in_block > MAX_DATA_IN_BLOCK ) {
-				next_block = (int)curr_block->nNextBlock;
-				curr_block = malloc(sizeof(cs1550_disk_block));
-				fseek(fs, next_block*BLOCK_SIZE, SEEK_SET);
-				if ( fread(curr_block, sizeof(cs1550_disk_block), 1, fs) != 1 ) printf("cs1550_read(): Could not read block %i from disk.\n", next_block);
+			static int locked_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+			LOCKED_SYNC(path, cs1550_write(path, buf, size, offset, fi))
 
-				beginning_byte_in_block = beginning_byte_in_block - MAX_DATA_IN_BLOCK;
-			}
-			printf("cs1550_read(): Beginning read from block %i\n", next_block);
-			/** curr_block contains the first block we are going to read **/
+			static int locked_mknod(const char *path, mode_t mode, dev_t dev)
+			LOCKED_SYNC(path, cs1550_mknod(path, mode, dev))
 
-			/** BEGIN READING FILE **/
-			/** Read the first block. Outside of while because
-					we may not be reading it from the beginning. **/
-			memcpy(&buf[bytes_read], &curr_block->data[beginning_byte_in_block], MAX_DATA_IN_BLOCK);
-			bytes_read = bytes_read + MAX_DATA_IN_BLOCK;
-			int bytes_remaining_to_read = size;
-			while ( bytes_read < size ) {
-				bytes_remaining_to_read = size - bytes_read;
-				next_block = (int)curr_block->nNextBlock;
-				curr_block = malloc(sizeof(cs1550_disk_block));
-				fseek(fs, next_block*BLOCK_SIZE, SEEK_SET);
-				if ( fread(curr_block, sizeof(cs1550_disk_block), 1, fs) != 1 ) printf("cs1550_read(): Could not read block %i from disk.\n", next_block);
-				if (bytes_remaining_to_read < MAX_DATA_IN_BLOCK) { memcpy(&buf[bytes_read], curr_block->data, bytes_remaining_to_read); bytes_read = bytes_read + bytes_remaining_to_read; }
-				else { memcpy(&buf[bytes_read], curr_block->data, MAX_DATA_IN_BLOCK); bytes_read = bytes_read + MAX_DATA_IN_BLOCK; }
+			static int locked_unlink(const char *path)
+			LOCKED(wrlock, cs1550_unlink(path))
+
+			static int locked_truncate(const char *path, off_t size)
+			LOCKED_SYNC(path, cs1550_truncate(path, size))
 
+			static int locked_flush(const char *path, struct fuse_file_info *fi)
+			LOCKED_SYNC(path, cs1550_flush(path, fi))
+
+			//Both can seal the log, which changes what readers see
+			static int locked_open(const char *path, struct fuse_file_info *fi)
+			{
+				if (log_map != NULL) LOCKED(wrlock, cs1550_open(path, fi))
+				LOCKED(rdlock, cs1550_open(path, fi))
 			}
-			printf("cs1550_read(): Done reading file. Read %i bytes. Was supposed to read %i\n", bytes_read, size);
 
-			if (fs!=NULL) fclose(fs);
-			return size;
-		}
+			static int locked_statfs(const char *path, struct statvfs *stbuf)
+			LOCKED(rdlock, cs1550_statfs(path, stbuf))
 
-		/*
-		* Write size bytes from buf into file starting from offset
-		*
-		*/
-		static int cs1550_write(const char *path, const char *buf, size_t size,
-			off_t offset, struct fuse_file_info *fi)
+			static int locked_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 			{
-				(void) buf;
-				(void) offset;
-				(void) fi;
-				(void) path;
+				if (log_map != NULL) LOCKED(wrlock, cs1550_fsync(path, datasync, fi))
+				LOCKED(rdlock, cs1550_fsync(path, datasync, fi))
+			}
 
-				/** These sizes are well above what is required
-				to avoid fighting with overruns.
-				Null termination is added appropriately later. **/
-				char extension[10];
-				char filename[10];
-				char directory[25];
-				int directory_exists = 0;
-				int file_exists = 0;
-				int file_size, file_start_block, file_index_in_directory_entry = -1;
-
-				sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
-
-				char* diskname = "./.disk";
-				FILE *fs = fopen(diskname, "rb+");
-				cs1550_root_directory *root_dir=malloc(sizeof(cs1550_root_directory));
-				cs1550_directory_entry *dir = malloc(sizeof(cs1550_directory_entry));
-				cs1550_disk_block *curr_block = malloc(sizeof(cs1550_disk_block));
-				assert(fs != 0);
+			static int locked_release(const char *path, struct fuse_file_info *fi)
+			LOCKED(rdlock, cs1550_release(path, fi))
+
+			//register our new functions as the implementations of the syscalls
+			static struct fuse_operations hello_oper = {
+				.getattr	= locked_getattr,
+				.readdir	= locked_readdir,
+				.mkdir	= locked_mkdir,
+				.rmdir = locked_rmdir,
+				.read	= locked_read,
+				.write	= locked_write,
+				.mknod	= locked_mknod,
+				.unlink = locked_unlink,
+				.truncate = locked_truncate,
+				.flush = locked_flush,
+				.open	= locked_open,
+				.release	= locked_release,
+				.fsync	= locked_fsync,
+				.statfs	= locked_statfs,
+				.rename	= locked_rename,
+				.ioctl	= locked_ioctl,
+				.setxattr	= locked_setxattr,
+				.getxattr	= locked_getxattr,
+				.listxattr	= locked_listxattr,
+				.removexattr	= locked_removexattr,
+				.init	= cs1550_init,
+				.destroy	= cs1550_destroy,
+			};
 
+#ifndef CS1550_FUZZ
+			#define CS1550_OPT(t, p, v) { t, offsetof(struct cs1550_options, p), v }
+
+			//Our own -o options. Anything else is passed through to FUSE.
+			static struct fuse_opt cs1550_opts[] = {
+				CS1550_OPT("inline_small_files", inline_small_files, 1),
+				CS1550_OPT("attr_cache=%i", attr_timeout, 0),
+				CS1550_OPT("checksums", checksums, 1),
+				CS1550_OPT("compress", compression, 1),
+				CS1550_OPT("dedup", dedup, 1),
+				CS1550_OPT("long_names", long_names, 1),
+				CS1550_OPT("log", log, 1),
+				CS1550_OPT("csum_policy=%s", csum_policy_name, 0),
+				CS1550_OPT("scrub_rate=%i", scrub_rate, 0),
+				CS1550_OPT("scrub_interval=%i", scrub_interval, 0),
+				CS1550_OPT("defrag_rate=%i", defrag_rate, 0),
+				CS1550_OPT("defrag_interval=%i", defrag_interval, 0),
+				CS1550_OPT("ramdisk", ramdisk, 1),
+				CS1550_OPT("ramdisk_image=%s", ramdisk_image, 0),
+				CS1550_OPT("stripe=%s", stripe_files, 0),
+				CS1550_OPT("stripe_width=%i", stripe_width, 0),
+				CS1550_OPT("quota_blocks=%i", quota_blocks, 0),
+				CS1550_OPT("quota_entries=%i", quota_entries, 0),
+				CS1550_OPT("quota_table=%s", quota_table, 0),
+				CS1550_OPT("max_file_blocks=%i", max_file_blocks, 0),
+				CS1550_OPT("reserved_blocks=%i", reserved_blocks, 0),
+				FUSE_OPT_END
+			};
 
-				/** Find File **/
-				int dir_location = -1;
-				if ( fread(root_dir, sizeof(cs1550_root_directory), 1, fs) != 1 ) printf("cs1550_write(): Could not read root directory from disk.\n");
-				/** Find the directory that this file would be in **/
-				int i;
-				for(i=0; i<MAX_DIRS_IN_ROOT; i++) {
-					dir_location = root_dir->directories[i].nStartBlock;
-					if ( strncmp(root_dir->directories[i].dname, directory, 8) == 0 ){ directory_exists = 1; break; }
-				}
-				if (directory_exists) {
-					/** Directory that the file is in has been found **/
-					fseek(fs, dir_location*BLOCK_SIZE, SEEK_SET);
-					if ( fread(dir, sizeof(cs1550_directory_entry), 1, fs) != 1 ) printf("cs1550_write(): Could not read directory from disk.\n");
-					for(i=0; i<MAX_FILES_IN_DIR; i++) {
-						if ( strncmp(filename, dir->files[i].fname, 8) == 0 && strncmp(extension, dir->files[i].fext, 3) == 0 ){
-							file_size = dir->files[i].fsize;
-							file_exists = 1;
-							file_index_in_directory_entry = i;
-							file_start_block = (int)dir->files[i].nStartBlock;
-						}
-					}
+			int main(int argc, char *argv[])
+			{
+				struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+				options.attr_timeout = DEFAULT_ATTR_TIMEOUT;
+				options.scrub_rate = DEFAULT_SCRUB_RATE;
+				options.scrub_interval = DEFAULT_SCRUB_INTERVAL;
+				options.defrag_rate = DEFAULT_DEFRAG_RATE;
+				options.defrag_interval = DEFAULT_DEFRAG_INTERVAL;
+				options.stripe_width = DEFAULT_STRIPE_WIDTH;
+				options.reserved_blocks = DEFAULT_RESERVED_BLOCKS;
+				if (fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1) return 1;
+
+#ifndef CS1550_WITH_LZ4
+				if (options.compression) {
+					fprintf(stderr, "cs1550: built without LZ4, compress is not available\n");
+					return 1;
 				}
-				if (directory_exists == 0 || file_exists == 0) { printf("cs1550_write(): Directory or file does not exist.\n"); if (fs!=NULL) fclose(fs); return -1; }
-				if (size <= 0 ) { printf("cs1550_write(): Size <= 0 or offset > file_size. Size: %i Offset: %i File Size: %i\n", size, offset, file_size); if (fs!=NULL) fclose(fs); return -1;}
-				if (offset > file_size) { if (fs!=NULL) fclose(fs); return -EFBIG; }
-				/** Error checking done, now retrieve file's first block **/
-				int next_block = file_start_block;
-				printf("cs1550_write(): File to write to is located at block %i\n", file_start_block);
-				fseek(fs, file_start_block*BLOCK_SIZE, SEEK_SET);
-				if ( fread(curr_block, sizeof(cs1550_disk_block), 1, fs) != 1 ) printf("cs1550_write(): Could not read first disk block from disk.\n");
-				/** END RETRIEVING FILE'S FIRST BLOCK **/
-				/** UPDATE FILE'S DIR ENTRY WITH NEW SIZE **/
-				dir->files[file_index_in_directory_entry].fsize = dir->files[file_index_in_directory_entry].fsize + size;
-				fseek(fs, dir_location*BLOCK_SIZE, SEEK_SET);
-				int w = fwrite(dir, sizeof(cs1550_directory_entry), 1, fs); //update the DIRECTORY entry
-				if (w!=1) printf("cs1550_write(): Writing data to directory entry failed.\n");
+#endif
 
+				if (options.csum_policy_name == NULL || strcmp(options.csum_policy_name, "fail") == 0) options.csum_policy = CSUM_POLICY_FAIL;
+				else if (strcmp(options.csum_policy_name, "warn") == 0) options.csum_policy = CSUM_POLICY_WARN;
+				else {
+					fprintf(stderr, "cs1550: csum_policy must be fail or warn\n");
+					return 1;
+				}
 
-				/** Find the block of the file that the offset points to **/
-				int bytes_until_at_offset = (int)offset;
-				while ((int)bytes_until_at_offset > (int)MAX_DATA_IN_BLOCK) {
-					printf("cs1550_write(): bytes_until_at_offset > MAX_DATA_IN_BLOCK. bytes_until_at_offset: %i MAX_DATA_IN_BLOCK: %i\n", bytes_until_at_offset, MAX_DATA_IN_BLOCK);
-					next_block = (int)curr_block->nNextBlock;
-					fseek(fs, next_block*BLOCK_SIZE, SEEK_SET);
-					if ( fread(curr_block, sizeof(cs1550_disk_block), 1, fs) != 1 ) printf("cs1550_write(): Could not read %i'th disk block from disk.\n", next_block);
-					bytes_until_at_offset = bytes_until_at_offset-(int)MAX_DATA_IN_BLOCK;
+				if (options.stripe_files != NULL) {
+					if (options.ramdisk || options.ramdisk_image != NULL) {
+						fprintf(stderr, "cs1550: stripe and ramdisk cannot be used together\n");
+						return 1;
+					}
+					if (options.stripe_width <= 0) {
+						fprintf(stderr, "cs1550: stripe_width must be at least 1\n");
+						return 1;
+					}
+					if (stripe_open(options.stripe_files) != 0) {
+						fprintf(stderr, "cs1550: could not open the stripe files (at most %d): %s\n", MAX_STRIPE_FILES, strerror(errno));
+						return 1;
+					}
+				}
+				if (options.ramdisk || options.ramdisk_image != NULL) {
+					ram_disk = mmap(NULL, DISKSIZE_IN_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+					if (ram_disk == MAP_FAILED) {
+						fprintf(stderr, "cs1550: could not allocate the ramdisk: %s\n", strerror(errno));
+						return 1;
+					}
+					if (options.ramdisk_image != NULL && ram_disk_load(options.ramdisk_image) != 0) {
+						fprintf(stderr, "cs1550: could not load %s: %s\n", options.ramdisk_image, strerror(errno));
+						return 1;
+					}
+					//Only ram_save_main takes SIGUSR1; threads inherit this mask
+					sigset_t usr1;
+					sigemptyset(&usr1);
+					sigaddset(&usr1, SIGUSR1);
+					pthread_sigmask(SIG_BLOCK, &usr1, NULL);
 				}
-				printf("cs1550_write(): Retrieved final block of file. Final block is block %i\n", next_block);
-				/** END RETRIEVAL OF BLOCK **/
 
-				/** We should have the block that will have a write occur.
-				First, we need to figure out whether the write will
-				fit within one block. **/
-				int need_new_block = 0;
-				if ( (int)(size + bytes_until_at_offset) > (int)MAX_DATA_IN_BLOCK) need_new_block = 1;
-
-				/** FIRST CASE: Can perform the write without needing a new block.
-				Does not differentiate between "appends" and writes, since
-				offset could be either.                                   **/
-				if (need_new_block == 0) {
-					printf("cs1550_write(): Do not need to create new block. Writing data to file block %i.\n", next_block);
-					memcpy(&curr_block->data[bytes_until_at_offset], buf, size);
-
-					w = fwrite(curr_block, sizeof(cs1550_disk_block), 1, fs); //update the FILE entry
-					if (w!=1) printf("cs1550_write(): Writing data to file block %i failed.\n", next_block);
-					else printf("cs1550_write(): File data written to disk block %i.\n", next_block);
-				}
-				/** END OF FIRST CASE **/
-
-				/** SECOND CASE: The write needs a new block.
-				Even if the offset is at beginning of file.
-				If this is the case, curr_block should already
-				point to the last allocated block of the file. **/
-				if (need_new_block == 1) {
-					printf("cs1550_write(): Need to create a new block. Filling in remaining space in current block.\n");
-					int bytes_remaining_to_write = size;
-					int bytes_written = 0;
-					int new_block_number = find_unallocated_block(fs);// get a new block
-					set_block_allocated(fs, new_block_number);// set that block as allocated
-					curr_block->nNextBlock = new_block_number;
-					/** First, we have to fill up the current block's data segment **/
-					memcpy(&curr_block->data[bytes_until_at_offset], buf, MAX_DATA_IN_BLOCK - bytes_until_at_offset);
-					fseek(fs, next_block*BLOCK_SIZE, SEEK_SET);
-					int w = fwrite(curr_block, sizeof(cs1550_disk_block), 1, fs);
-					if (w!=1) printf("cs1550_write(): Writing data to file block %i failed.\n", next_block);
-					else printf("cs1550_write(): File data written to disk block %i.\n", next_block);
-					bytes_written = (MAX_DATA_IN_BLOCK - bytes_until_at_offset);
-					bytes_remaining_to_write = bytes_remaining_to_write - bytes_written;
-					/** END WRITE **/
-					/** Now we must write new blocks **/
-					printf("cs1550_write(): Preparing to append new blocks to file.\n");
-					int bytes_to_write = -1;
-					int tmp = -1;
-					while (bytes_remaining_to_write > 0) {
-						curr_block = malloc(sizeof(cs1550_disk_block));
-						tmp = new_block_number;
-						new_block_number = find_unallocated_block(fs); // set curr_block's next_block fields
-						set_block_allocated(fs, new_block_number);
-						curr_block->nNextBlock = (long)new_block_number;
+				//Let the kernel keep attributes and lookups as long as we do.
+				//Given first, so an explicit attr_timeout/entry_timeout still wins.
+				char timeouts[64];
+				snprintf(timeouts, sizeof(timeouts), "-oattr_timeout=%i,entry_timeout=%i", options.attr_timeout, options.attr_timeout);
+				fuse_opt_insert_arg(&args, 1, timeouts);
 
-						if ( bytes_remaining_to_write < MAX_DATA_IN_BLOCK ) bytes_to_write = bytes_remaining_to_write;
-						else bytes_to_write = MAX_DATA_IN_BLOCK;
-						printf("cs1550_write(): calling memcpy. bytes_written: %i bytes_to_write: %i\n", bytes_written, bytes_to_write);
-						memcpy(curr_block->data, &buf[bytes_written], bytes_to_write);
-						fseek(fs, tmp*BLOCK_SIZE, SEEK_SET);
-						printf("cs1550_write(): Writing file block to block num %i\n", tmp);
-						w = fwrite(curr_block, sizeof(cs1550_disk_block), 1, fs);
-						if (w!=1) printf("cs1550_write(): Writing data to file block failed.\n");
-						else printf("cs1550_write(): File data written to disk.\n");
+				int r = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+				fuse_opt_free_args(&args);
+				return r;
+			}
+#endif
 
-						bytes_remaining_to_write = bytes_remaining_to_write - bytes_to_write;
-					}
-					/** END WHILE **/
+#ifdef CS1550_FUZZ
+			/*
+			* Randomized differential harness, built with -DCS1550_FUZZ in place of
+			* the FUSE main. An input is decoded into mkdir, mknod, write, read,
+			* truncate, unlink, getattr and open/flush/release calls made through
+			* hello_oper on a freshly formatted ramdisk, and every result is
+			* compared with a plain in-memory model of the tree. Its first byte
+			* picks the format features. Once the sequence is done, every file must
+			* read back as the model has it, the in-memory free space tracker and
+			* free block count must agree with the disk, and deleting every file
+			* must give back every block the files used.
+			*
+			* With -DCS1550_LIBFUZZER it is a libFuzzer target (clang
+			* -fsanitize=fuzzer). Otherwise main runs random sequences on its own,
+			* on several threads at once with -t, each in directories of its own,
+			* and with the defragmenter moving chains underneath them with -d.
+			*/
+			#define FUZZ_DIRS 3			//per thread
+			#define FUZZ_FILES 4		//per directory
+			#define FUZZ_FILE_MAX 20000	//bytes a model file can hold
+			#define FUZZ_IO_MAX 3000	//bytes one read or write moves at most
+			#define FUZZ_MAX_THREADS 7	//FUZZ_DIRS each must fit in a long_names root
 
-				}
-				/** END NEED NEW BLOCKS CASE **/
+			struct fuzz_file
+			{
+				int exists;
+				int open;					//reads and writes go through fi
+				struct fuse_file_info fi;
+				size_t size;
+				char data[FUZZ_FILE_MAX];
+			};
 
-				if (fs!=NULL) fclose(fs);
-				return size;
+			struct fuzz_model
+			{
+				int thread;			//directories are /t<thread>d<n>
+				const uint8_t *in;	//the sequence being decoded
+				size_t len;
+				size_t pos;
+				int dirs;			//directories there are now
+				int dir_exists[FUZZ_DIRS];
+				struct fuzz_file files[FUZZ_DIRS][FUZZ_FILES];
+			};
+
+			static void fuzz_fail(struct fuzz_model *m, const char *op, const char *path, long got, long want)
+			{
+				fprintf(stderr, "cs1550 fuzz: thread %d: %s %s gave %li, expected %li (input byte %zu)\n", m->thread, op, path, got, want, m->pos);
+				abort();
 			}
 
-			static int check_fs_initialization() {
-				int r = 0;
-				char* filename = "./.disk";
-				FILE *fs = fopen(filename, "rb");
-				cs1550_free_space_tracker *tracker = malloc(sizeof(cs1550_free_space_tracker));
-				if (fs == 0) {
-					r = -1;
-					printf("check_fs_initialization(): could not open %s errno: %s\n", filename,strerror(errno));
-				} else {
-					fseek(fs, DISKSIZE_IN_BYTES - BLOCK_SIZE, SEEK_SET); //seek to free space tracker
-					if (fread(tracker, sizeof(cs1550_free_space_tracker), 1, fs) != 1) {
-						r = -1;
-						printf("check_fs_initialization(): could not read root struct from %s errno: %s\n", filename,strerror(errno));
-					} else {
-						int init = 0;
-						int i;
-						for(i=0;i<MAX_FILES_IN_DIR;i++) if (tracker->data[i] == 1) init = 1;
-						if (init) { r = 1; }
-						else printf("check_fs_initialization(): Filesystem found to NOT be initialized.\n");
-					}
-				}
+			#define FUZZ_EXPECT(m, op, path, got, want) { long g = (got), w = (want); if (g != w) fuzz_fail(m, op, path, g, w); }
 
-				if (fs != NULL) fclose(fs);
-				return r;
+			static unsigned fuzz_byte(struct fuzz_model *m)
+			{
+				return m->pos < m->len ? m->in[m->pos++] : 0;
+			}
 
+			static unsigned fuzz_u16(struct fuzz_model *m)
+			{
+				unsigned lo = fuzz_byte(m);
+				return lo | fuzz_byte(m) << 8;
 			}
 
-			/******************************************************************************
-			*
-			*  DO NOT MODIFY ANYTHING BELOW THIS LINE
-			*
-			*****************************************************************************/
+			/*
+			* Mounts the ramdisk again without unmounting it, as after a crash,
+			* dropping everything kept in memory from the last mount.
+			*/
+			static void fuzz_remount(void)
+			{
+				int i;
+
+				free(tracker_map);
+				tracker_map = NULL;
+				free(csum_map);
+				csum_map = NULL;
+				free(pack_room);
+				pack_room = NULL;
+				free(dedup_index);
+				dedup_index = NULL;
+				free(dedup_slot_of);
+				dedup_slot_of = NULL;
+				dedup_used = 0;
+				memset(dedup_dirty, 0, sizeof(dedup_dirty));
+				for (i=0; i<SYNC_FILES; i++) free(sync_files[i].path);
+				memset(sync_files, 0, sizeof(sync_files));
+				memset(handles, 0, sizeof(handles));
+				free_blocks = -1;
+				disk_features = -1;
+				dentry_cache_clear();
+				attr_cache_clear();
+				xattr_cache_clear();
+				if (dir_cache != NULL) dir_cache_clear();
+				int mounted = mount_disk();
+				if (mounted != 0) {
+					fprintf(stderr, "cs1550 fuzz: mount_disk gave %d\n", mounted);
+					abort();
+				}
+			}
 
 			/*
-			* truncate is called when a new file is created (with a 0 size) or when an
-			* existing file is made shorter. We're not handling deleting files or
-			* truncating existing ones, so all we need to do here is to initialize
-			* the appropriate directory entry.
-			*
+			* Formats a blank ramdisk with the FEATURE_* flags set in features and
+			* mounts it, dropping everything kept from the last one.
 			*/
-			static int cs1550_truncate(const char *path, off_t size)
+			static void fuzz_setup(unsigned features)
 			{
-				(void) path;
-				(void) size;
+				if (ram_disk == NULL) {
+					ram_disk = mmap(NULL, DISKSIZE_IN_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+					if (ram_disk == MAP_FAILED) {
+						perror("cs1550 fuzz: mmap");
+						abort();
+					}
+					//The operations log every step; only failures matter here
+					if (freopen("/dev/null", "w", stdout) == NULL) perror("cs1550 fuzz: /dev/null");
+				}
+				memset(ram_disk, 0, DISKSIZE_IN_BYTES);
+				options.inline_small_files = (features & FEATURE_INLINE_SMALL_FILES) != 0;
+				options.checksums = (features & FEATURE_CHECKSUMS) != 0;
+				options.dedup = (features & FEATURE_DEDUP) != 0;
+				options.long_names = (features & FEATURE_LONG_NAMES) != 0;
+				options.log = (features & FEATURE_LOG) != 0;
+#ifdef CS1550_WITH_LZ4
+				options.compression = (features & FEATURE_COMPRESSION) != 0;
+#endif
+				options.attr_timeout = 1;
+				//Limits no run reaches, so only the counting gets checked
+				options.quota_entries = MAX_NUM_OF_BLOCKS * MAX_DIR_SLOTS;
+				fuzz_remount();
+			}
 
-				return 0;
+			static long fuzz_free_blocks(void)
+			{
+				FILE *fs = open_disk("rb");
+				long n = count_free_blocks(fs);
+				fclose(fs);
+				return n;
 			}
 
+			/*
+			* Decodes and runs one operation, checking it against the model.
+			*/
+			static void fuzz_step(struct fuzz_model *m)
+			{
+				char dir[32], path[48], buf[FUZZ_IO_MAX];
+				struct fuse_file_info fi;
+				struct stat st;
+				unsigned op = fuzz_byte(m) % 8;
+				int d = fuzz_byte(m) % FUZZ_DIRS;
+				struct fuzz_file *file = &m->files[d][fuzz_byte(m) % FUZZ_FILES];
+				size_t off, n, i;
+				long want;
+
+				memset(&fi, 0, sizeof(fi));
+				snprintf(dir, sizeof(dir), "/t%dd%d", m->thread, d);
+				snprintf(path, sizeof(path), "%s/f%d.txt", dir, (int)(file - m->files[d]));
+				//What anything but mkdir and mknod gets when the file is not there
+				int missing = m->dir_exists[d] && file->exists ? 0 : -ENOENT;
+				struct fuse_file_info *io = file->open ? &file->fi : &fi;
+
+				switch (op) {
+				case 0:
+					//Half the time an existing directory is removed instead
+					if (m->dir_exists[d] && fuzz_byte(m) % 2) {
+						int empty = 1, f;
+						for (f=0; f<FUZZ_FILES; f++) empty &= !m->files[d][f].exists;
+						FUZZ_EXPECT(m, "rmdir", dir, hello_oper.rmdir(dir), empty ? 0 : -ENOTEMPTY);
+						if (empty) {
+							m->dirs--;
+							m->dir_exists[d] = 0;
+						}
+						break;
+					}
+					FUZZ_EXPECT(m, "mkdir", dir, hello_oper.mkdir(dir, 0755), m->dir_exists[d] ? -EEXIST : 0);
+					if (!m->dir_exists[d]) m->dirs++;
+					m->dir_exists[d] = 1;
+					break;
+				case 1:
+					FUZZ_EXPECT(m, "mknod", path, hello_oper.mknod(path, S_IFREG | 0644, 0), !m->dir_exists[d] ? -ENOENT : (file->exists ? -EEXIST : 0));
+					if (m->dir_exists[d] && !file->exists) {
+						file->exists = 1;
+						file->size = 0;
+					}
+					break;
+				case 2:
+					//Offsets run to one past the end, which is an error here
+					off = fuzz_u16(m) % (file->size + 2);
+					n = fuzz_u16(m) % FUZZ_IO_MAX + 1;
+					if (off >= FUZZ_FILE_MAX) break;
+					if (off + n > FUZZ_FILE_MAX) n = FUZZ_FILE_MAX - off;
+					//Runs of zeros and of one byte give compression and dedup work
+					unsigned seed = fuzz_byte(m);
+					for (i=0; i<n; i++) buf[i] = seed % 4 == 0 ? 0 : (seed % 4 == 1 ? (char)seed : (char)(seed + i * 7));
+					want = missing ? missing : (off > file->size ? -EFBIG : (long)n);
+					FUZZ_EXPECT(m, "write", path, hello_oper.write(path, buf, n, off, io), want);
+					if (want > 0) {
+						memcpy(&file->data[off], buf, n);
+						if (off + n > file->size) file->size = off + n;
+					}
+					break;
+				case 3:
+					off = fuzz_u16(m) % (file->size + 2);
+					n = fuzz_u16(m) % FUZZ_IO_MAX + 1;
+					want = missing ? missing : (off >= file->size ? 0 : (long)(file->size - off < n ? file->size - off : n));
+					FUZZ_EXPECT(m, "read", path, hello_oper.read(path, buf, n, off, io), want);
+					if (want > 0 && memcmp(buf, &file->data[off], want) != 0) fuzz_fail(m, "read at", path, off, -1);
+					break;
+				case 4:
+					n = fuzz_u16(m) % FUZZ_FILE_MAX;
+					FUZZ_EXPECT(m, "truncate", path, hello_oper.truncate(path, n), missing);
+					if (!missing) {
+						if (n > file->size) memset(&file->data[file->size], 0, n - file->size);
+						file->size = n;
+					}
+					break;
+				case 5:
+					FUZZ_EXPECT(m, "unlink", path, hello_oper.unlink(path), missing);
+					file->exists = 0;
+					break;
+				case 6:
+					FUZZ_EXPECT(m, "getattr", path, hello_oper.getattr(path, &st), missing);
+					if (!missing) FUZZ_EXPECT(m, "getattr size of", path, st.st_size, file->size);
+					break;
+				case 7:
+					//Opens the file for the operations after, or closes it,
+					//which is when dedup shares the blocks just written
+					if (!file->open) {
+						memset(&file->fi, 0, sizeof(file->fi));
+						FUZZ_EXPECT(m, "open", path, hello_oper.open(path, &file->fi), 0);
+						file->open = 1;
+						break;
+					}
+					FUZZ_EXPECT(m, "flush", path, hello_oper.flush(path, &file->fi), 0);
+					FUZZ_EXPECT(m, "release", path, hello_oper.release(path, &file->fi), 0);
+					file->open = 0;
+					break;
+				}
+			}
 
 			/*
-			* Called when we open a file
-			*
+			* Reads every file of the model back whole, then deletes them all.
 			*/
-			static int cs1550_open(const char *path, struct fuse_file_info *fi)
+			static void fuzz_check_files(struct fuzz_model *m)
 			{
-				(void) path;
-				(void) fi;
-				/*
-				//if we can't find the desired file, return an error
-				return -ENOENT;
-				*/
+				char *buf = malloc(FUZZ_FILE_MAX);
+				char path[48];
+				struct stat st;
+				int d, f;
+
+				for (d=0; d<FUZZ_DIRS; d++) {
+					for (f=0; f<FUZZ_FILES && m->dir_exists[d]; f++) {
+						struct fuzz_file *file = &m->files[d][f];
+						snprintf(path, sizeof(path), "/t%dd%d/f%d.txt", m->thread, d, f);
+						if (!file->exists) {
+							FUZZ_EXPECT(m, "getattr of deleted", path, hello_oper.getattr(path, &st), -ENOENT);
+							continue;
+						}
+						FUZZ_EXPECT(m, "getattr", path, hello_oper.getattr(path, &st), 0);
+						FUZZ_EXPECT(m, "size of", path, st.st_size, file->size);
+						FUZZ_EXPECT(m, "whole read", path, hello_oper.read(path, buf, FUZZ_FILE_MAX, 0, NULL), file->size);
+						if (memcmp(buf, file->data, file->size) != 0) fuzz_fail(m, "whole read of", path, 0, -1);
+						FUZZ_EXPECT(m, "unlink", path, hello_oper.unlink(path), 0);
+						file->exists = 0;
+					}
+				}
+				free(buf);
+			}
 
-				//It's not really necessary for this project to anything in open
+			/*
+			* Checks the quota usage kept up by every operation against a fresh
+			* count of each top-level directory.
+			*/
+			static void fuzz_check_quotas(void)
+			{
+				static struct cs1550_quota kept[MAX_DIR_SLOTS];
+				int i;
 
-				/* We're not going to worry about permissions for this project, but
-				if we were and we don't have them to the file we should return an error
+				memcpy(kept, quotas, sizeof(quotas));
+				FILE *fs = open_disk("rb");
+				quota_load(fs);
+				fclose(fs);
+				for (i=0; i<MAX_DIR_SLOTS; i++) {
+					struct cs1550_quota *q = kept[i].name[0] != '\0' ? quota_find(kept[i].name) : NULL;
+					if (kept[i].name[0] == '\0') continue;
+					if (q == NULL || q->nBlocks != kept[i].nBlocks || q->nEntries != kept[i].nEntries) {
+						fprintf(stderr, "cs1550 fuzz: quota for %s has %li blocks, %li entries, counted %li, %li\n", kept[i].name,
+							kept[i].nBlocks, kept[i].nEntries, q ? q->nBlocks : -1, q ? q->nEntries : -1);
+						abort();
+					}
+				}
+				for (i=0; i<MAX_DIR_SLOTS; i++) {
+					if (quotas[i].name[0] == '\0') continue;
+					int found = 0, j;
+					for (j=0; j<MAX_DIR_SLOTS; j++) found |= strcmp(kept[j].name, quotas[i].name) == 0;
+					if (!found) {
+						fprintf(stderr, "cs1550 fuzz: no quota kept for %s\n", quotas[i].name);
+						abort();
+					}
+				}
+				memcpy(quotas, kept, sizeof(quotas));
+			}
 
-				return -EACCES;
-				*/
+			/*
+			* Checks that the tracker kept in memory is the one on disk, that the
+			* free block count is the number of free blocks in it, and the quotas.
+			*/
+			static void fuzz_check_image(void)
+			{
+				cs1550_free_space_tracker *disk = malloc(sizeof(cs1550_free_space_tracker));
+				long n = 0;
+				int i;
 
-				return 0; //success!
+				//The tracker on disk is only current once the log is empty
+				FILE *fs = open_disk("rb+");
+				int cleaned = log_map != NULL ? log_clean(fs) : 0;
+				fseek(fs, TRACKER_START_BLOCK * BLOCK_SIZE, SEEK_SET);
+				size_t got = fread(disk, sizeof(cs1550_free_space_tracker), 1, fs);
+				if (cleaned != 0 || got != 1) {
+					fprintf(stderr, "cs1550 fuzz: could not %s\n", cleaned != 0 ? "empty the log" : "read the free space tracker");
+					abort();
+				}
+				if (csum_map != NULL) {
+					uint32_t *table = malloc(CSUM_BLOCKS * BLOCK_SIZE);
+					fseek(fs, CSUM_START_BLOCK * BLOCK_SIZE, SEEK_SET);
+					if (fread(table, BLOCK_SIZE, CSUM_BLOCKS, fs) != CSUM_BLOCKS || memcmp(table, csum_map, CSUM_BLOCKS * BLOCK_SIZE) != 0) {
+						fprintf(stderr, "cs1550 fuzz: checksum table in memory differs from the disk\n");
+						abort();
+					}
+					free(table);
+				}
+				fclose(fs);
+				if (memcmp(disk, tracker_map, sizeof(cs1550_free_space_tracker)) != 0) {
+					fprintf(stderr, "cs1550 fuzz: free space tracker in memory differs from the disk\n");
+					abort();
+				}
+				for (i=0; i<MAX_NUM_OF_BLOCKS; i++) if (disk->data[i] == 0) n++;
+				if (n != free_blocks) {
+					fprintf(stderr, "cs1550 fuzz: %li blocks counted free, tracker has %li\n", free_blocks, n);
+					abort();
+				}
+				free(disk);
+				fuzz_check_quotas();
 			}
 
 			/*
-			* Called when close is called on a file descriptor, but because it might
-			* have been dup'ed, this isn't a guarantee we won't ever need the file
-			* again. For us, return success simply to avoid the unimplemented error
-			* in the debug log.
+			* After the files are gone only the directories may still hold
+			* blocks, and with inline small files the pack block, which stays
+			* until the disk is formatted again.
 			*/
-			static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+			static void fuzz_check_leaks(long free_at_mount, int dirs)
 			{
-				(void) path;
-				(void) fi;
-
-				return 0; //success!
+				long expected = free_at_mount - dirs;
+				long now = fuzz_free_blocks();
+				if (options.inline_small_files && now == expected - 1) now++;
+				if (now != expected) {
+					fprintf(stderr, "cs1550 fuzz: %li blocks free after deleting every file, expected %li\n", now, expected);
+					abort();
+				}
 			}
 
+			static void fuzz_run(struct fuzz_model *m)
+			{
+				char path[48];
+				int d, f;
+
+				while (m->pos < m->len) fuzz_step(m);
+				for (d=0; d<FUZZ_DIRS; d++) {
+					for (f=0; f<FUZZ_FILES; f++) {
+						struct fuzz_file *file = &m->files[d][f];
+						if (!file->open) continue;
+						snprintf(path, sizeof(path), "/t%dd%d/f%d.txt", m->thread, d, f);
+						hello_oper.release(path, &file->fi);
+						file->open = 0;
+					}
+				}
+			}
 
-			//register our new functions as the implementations of the syscalls
-			static struct fuse_operations hello_oper = {
-				.getattr	= cs1550_getattr,
-				.readdir	= cs1550_readdir,
-				.mkdir	= cs1550_mkdir,
-				.rmdir = cs1550_rmdir,
-				.read	= cs1550_read,
-				.write	= cs1550_write,
-				.mknod	= cs1550_mknod,
-				.unlink = cs1550_unlink,
-				.truncate = cs1550_truncate,
-				.flush = cs1550_flush,
-				.open	= cs1550_open,
-			};
+#ifdef CS1550_LIBFUZZER
+			int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+			{
+				static struct fuzz_model *m = NULL;
+				if (m == NULL) m = malloc(sizeof(struct fuzz_model));
+				if (size == 0) return 0;
+
+				fuzz_setup(data[0]);
+				long free_at_mount = fuzz_free_blocks();
+				memset(m, 0, sizeof(struct fuzz_model));
+				m->in = data + 1;
+				m->len = size - 1;
+				fuzz_run(m);
+				fuzz_check_image();
+				fuzz_check_files(m);
+				fuzz_check_image();
+				fuzz_check_leaks(free_at_mount, m->dirs);
+				return 0;
+			}
+#else
+			static void *fuzz_thread_main(void *arg)
+			{
+				fuzz_run(arg);
+				return NULL;
+			}
 
-			//Don't change this.
+			/*
+			* cs1550 [-t threads] [-n ops] [-r rounds] [-s seed] [-f features] [-d]
+			* Each round formats the disk with the given FEATURE_* flags, or random
+			* ones, and runs ops random operations on every thread.
+			*/
 			int main(int argc, char *argv[])
 			{
-				return fuse_main(argc, argv, &hello_oper, NULL);
+				int threads = 1, rounds = 100, features = -1, defrag = 0;
+				long ops = 2000;
+				unsigned seed = time(NULL);
+				int c, i, round;
+
+				while ((c = getopt(argc, argv, "t:n:r:s:f:d")) != -1) {
+					switch (c) {
+					case 't': threads = atoi(optarg); break;
+					case 'n': ops = atol(optarg); break;
+					case 'r': rounds = atoi(optarg); break;
+					case 's': seed = strtoul(optarg, NULL, 0); break;
+					case 'f': features = strtol(optarg, NULL, 0); break;
+					case 'd': defrag = 1; break;
+					default:
+						fprintf(stderr, "usage: %s [-t threads] [-n ops] [-r rounds] [-s seed] [-f features] [-d]\n", argv[0]);
+						return 1;
+					}
+				}
+				if (threads < 1 || threads > FUZZ_MAX_THREADS) {
+					fprintf(stderr, "cs1550 fuzz: between 1 and %d threads\n", FUZZ_MAX_THREADS);
+					return 1;
+				}
+				fprintf(stderr, "cs1550 fuzz: seed %u\n", seed);
+
+				struct fuzz_model *models = calloc(threads, sizeof(struct fuzz_model));
+				uint8_t **inputs = calloc(threads, sizeof(uint8_t *));
+				pthread_t *tids = calloc(threads, sizeof(pthread_t));
+				for (i=0; i<threads; i++) inputs[i] = malloc(ops * 8);
+
+				for (round=0; round<rounds; round++) {
+					unsigned r = seed + round;
+					unsigned f = features >= 0 ? (unsigned)features : (unsigned)rand_r(&r);
+					long j;
+
+					fuzz_setup(f);
+					long free_at_mount = fuzz_free_blocks();
+					if (defrag) {
+						options.defrag_rate = 1000000;
+						options.defrag_interval = 0;
+						defrag_running = 1;
+						int started = pthread_create(&defrag_thread, NULL, defrag_main, NULL);
+						if (started != 0) {
+							fprintf(stderr, "cs1550 fuzz: could not start the defragmenter: %s\n", strerror(started));
+							abort();
+						}
+					}
+					for (i=0; i<threads; i++) {
+						memset(&models[i], 0, sizeof(struct fuzz_model));
+						for (j=0; j<ops * 8; j++) inputs[i][j] = rand_r(&r);
+						models[i].thread = i;
+						models[i].in = inputs[i];
+						models[i].len = ops * 8;
+						int started = pthread_create(&tids[i], NULL, fuzz_thread_main, &models[i]);
+						if (started != 0) {
+							fprintf(stderr, "cs1550 fuzz: could not start thread %d: %s\n", i, strerror(started));
+							abort();
+						}
+					}
+					for (i=0; i<threads; i++) pthread_join(tids[i], NULL);
+					if (defrag) {
+						pthread_mutex_lock(&defrag_lock);
+						defrag_running = 0;
+						pthread_cond_broadcast(&defrag_wakeup);
+						pthread_mutex_unlock(&defrag_lock);
+						pthread_join(defrag_thread, NULL);
+					}
+
+					//What was sealed into the log has to come back from it
+					if (log_map != NULL) {
+						FILE *fs = open_disk("rb+");
+						int sealed = log_seal(fs);
+						fclose(fs);
+						if (sealed != 0) {
+							fprintf(stderr, "cs1550 fuzz: could not seal the log\n");
+							abort();
+						}
+						fuzz_remount();
+					}
+
+					int dirs = 0;
+					fuzz_check_image();
+					for (i=0; i<threads; i++) {
+						fuzz_check_files(&models[i]);
+						dirs += models[i].dirs;
+					}
+					fuzz_check_image();
+					fuzz_check_leaks(free_at_mount, dirs);
+					fprintf(stderr, "cs1550 fuzz: round %d, features 0x%x: ok\n", round, disk_features);
+				}
+
+				for (i=0; i<threads; i++) free(inputs[i]);
+				free(inputs);
+				free(tids);
+				free(models);
+				return 0;
 			}
+#endif
+#endif